@@ -13,6 +13,10 @@ namespace gps {
         this->cameraRightDirection = glm::normalize(glm::cross(this->cameraFrontDirection, glm::vec3(0.0f, 1.0f, 0.0f)));
     }
 
+    Frustum Camera::getFrustum(glm::mat4 projection) {
+        return ExtractFrustum(projection * getViewMatrix());
+    }
+
     glm::vec3 Camera::getCameraPosition() {
         return this->cameraPosition;
     }
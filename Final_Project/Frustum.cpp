@@ -0,0 +1,155 @@
+#include "Frustum.hpp"
+
+#include <cmath>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_USE_SSE 1
+#endif
+
+namespace gps {
+
+    Frustum ExtractFrustum(const glm::mat4& viewProjection)
+    {
+        return ExtractFrustum(viewProjection, glm::vec3(-1.0f), glm::vec3(1.0f));
+    }
+
+    Frustum ExtractFrustum(const glm::mat4& viewProjection, const glm::vec3& clipMin, const glm::vec3& clipMax)
+    {
+        // clip x >= min * w and x <= max * w, each a combination of one row with the fourth
+        glm::vec4 rows[4];
+        for (int row = 0; row < 4; row++) {
+            rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
+        }
+
+        Frustum frustum;
+        for (int axis = 0; axis < 3; axis++) {
+            frustum.planes[axis * 2] = rows[axis] - rows[3] * clipMin[axis];
+            frustum.planes[axis * 2 + 1] = rows[3] * clipMax[axis] - rows[axis];
+        }
+        for (int i = 0; i < FRUSTUM_PLANE_COUNT; i++) {
+            float length = glm::length(glm::vec3(frustum.planes[i]));
+            if (length > 0.0f) {
+                frustum.planes[i] = frustum.planes[i] / length;
+            }
+        }
+        return frustum;
+    }
+
+    BoundsArray::BoundsArray()
+    {
+        count = 0;
+    }
+
+    void BoundsArray::Clear()
+    {
+        count = 0;
+        centerX.clear();
+        centerY.clear();
+        centerZ.clear();
+        extentX.clear();
+        extentY.clear();
+        extentZ.clear();
+        radius.clear();
+    }
+
+    void BoundsArray::Add(const glm::mat4& modelMatrix, const glm::vec3& boxMin, const glm::vec3& boxMax, float sphereRadius)
+    {
+        glm::vec3 center = glm::vec3(modelMatrix * glm::vec4((boxMin + boxMax) * 0.5f, 1.0f));
+        glm::vec3 extent = (boxMax - boxMin) * 0.5f;
+
+        // the box of the rotated box, each world axis gathers the extents it leans on
+        glm::vec3 worldExtent(0.0f);
+        float scale = 0.0f;
+        for (int column = 0; column < 3; column++) {
+            glm::vec3 axis = glm::vec3(modelMatrix[column]);
+            worldExtent += glm::abs(axis) * extent[column];
+            scale = std::fmax(scale, glm::length(axis));
+        }
+
+        centerX.push_back(center.x);
+        centerY.push_back(center.y);
+        centerZ.push_back(center.z);
+        extentX.push_back(worldExtent.x);
+        extentY.push_back(worldExtent.y);
+        extentZ.push_back(worldExtent.z);
+        radius.push_back(sphereRadius * scale);
+        count++;
+    }
+
+    size_t BoundsArray::GetCount()
+    {
+        return count;
+    }
+
+    size_t BoundsArray::Cull(const Frustum& frustum, std::vector<uint8_t>& visible)
+    {
+        visible.resize(count);
+        size_t padded = (count + 3) & ~(size_t)3;
+        centerX.resize(padded);
+        centerY.resize(padded);
+        centerZ.resize(padded);
+        extentX.resize(padded);
+        extentY.resize(padded);
+        extentZ.resize(padded);
+        radius.resize(padded);
+
+        size_t culled = 0;
+#ifdef FRUSTUM_USE_SSE
+        const __m128 signMask = _mm_set1_ps(-0.0f);
+        for (size_t i = 0; i < padded; i += 4) {
+            __m128 cx = _mm_loadu_ps(&centerX[i]);
+            __m128 cy = _mm_loadu_ps(&centerY[i]);
+            __m128 cz = _mm_loadu_ps(&centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&extentX[i]);
+            __m128 ey = _mm_loadu_ps(&extentY[i]);
+            __m128 ez = _mm_loadu_ps(&extentZ[i]);
+            __m128 r = _mm_loadu_ps(&radius[i]);
+
+            __m128 outside = _mm_setzero_ps();
+            for (int p = 0; p < FRUSTUM_PLANE_COUNT; p++) {
+                const glm::vec4& plane = frustum.planes[p];
+                __m128 nx = _mm_set1_ps(plane.x);
+                __m128 ny = _mm_set1_ps(plane.y);
+                __m128 nz = _mm_set1_ps(plane.z);
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, cx), _mm_mul_ps(ny, cy)),
+                    _mm_add_ps(_mm_mul_ps(nz, cz), _mm_set1_ps(plane.w)));
+                // how far the box reaches towards the plane
+                __m128 boxReach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_andnot_ps(signMask, nx), ex), _mm_mul_ps(_mm_andnot_ps(signMask, ny), ey)),
+                    _mm_mul_ps(_mm_andnot_ps(signMask, nz), ez));
+                __m128 reach = _mm_min_ps(r, boxReach);
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(distance, reach), _mm_setzero_ps()));
+            }
+
+            int mask = _mm_movemask_ps(outside);
+            for (size_t k = 0; k < 4 && i + k < count; k++) {
+                bool isOutside = (mask >> k) & 1;
+                visible[i + k] = isOutside ? 0 : 1;
+                culled += isOutside;
+            }
+        }
+#else
+        for (size_t i = 0; i < count; i++) {
+            bool isOutside = false;
+            for (int p = 0; p < FRUSTUM_PLANE_COUNT && !isOutside; p++) {
+                const glm::vec4& plane = frustum.planes[p];
+                float distance = plane.x * centerX[i] + plane.y * centerY[i] + plane.z * centerZ[i] + plane.w;
+                float boxReach = std::fabs(plane.x) * extentX[i] + std::fabs(plane.y) * extentY[i] + std::fabs(plane.z) * extentZ[i];
+                isOutside = distance + std::fmin(radius[i], boxReach) < 0.0f;
+            }
+            visible[i] = isOutside ? 0 : 1;
+            culled += isOutside;
+        }
+#endif
+        // drop the padding, so Add can keep appending
+        centerX.resize(count);
+        centerY.resize(count);
+        centerZ.resize(count);
+        extentX.resize(count);
+        extentY.resize(count);
+        extentZ.resize(count);
+        radius.resize(count);
+        return culled;
+    }
+
+}
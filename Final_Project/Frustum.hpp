@@ -0,0 +1,62 @@
+#ifndef Frustum_hpp
+#define Frustum_hpp
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gps {
+
+    enum FrustumPlane {
+        FRUSTUM_LEFT,
+        FRUSTUM_RIGHT,
+        FRUSTUM_BOTTOM,
+        FRUSTUM_TOP,
+        FRUSTUM_NEAR,
+        FRUSTUM_FAR,
+        FRUSTUM_PLANE_COUNT
+    };
+
+    // Planes (x, y, z) . p + w >= 0 inside, normalized so w is a distance
+    struct Frustum {
+        glm::vec4 planes[FRUSTUM_PLANE_COUNT];
+    };
+
+    // Every point is in front of it, replaces a plane to open the volume on that side
+    const glm::vec4 FRUSTUM_OPEN_PLANE = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+    // Planes of the clip volume of viewProjection, in the space it transforms from
+    Frustum ExtractFrustum(const glm::mat4& viewProjection);
+    // Same for the box [clipMin, clipMax] inside the clip volume, in normalized device coordinates
+    Frustum ExtractFrustum(const glm::mat4& viewProjection, const glm::vec3& clipMin, const glm::vec3& clipMax);
+
+    // World space bounds of many objects as a structure of arrays, tested four at a time
+    // with SSE. Each object has a box (center and half extents) and a sphere around the same
+    // center, it is culled when either of them lies behind a plane
+    class BoundsArray
+    {
+    public:
+        BoundsArray();
+
+        void Clear();
+        // Bounds of a model space box and sphere placed by modelMatrix
+        void Add(const glm::mat4& modelMatrix, const glm::vec3& boxMin, const glm::vec3& boxMax, float sphereRadius);
+        size_t GetCount();
+
+        // Sets visible[i] to 1 for the objects intersecting frustum, 0 for the others,
+        // returns how many were culled
+        size_t Cull(const Frustum& frustum, std::vector<uint8_t>& visible);
+
+    private:
+        size_t count;
+        // padded to a multiple of four while Cull runs
+        std::vector<float> centerX, centerY, centerZ;
+        std::vector<float> extentX, extentY, extentZ;
+        std::vector<float> radius;
+    };
+
+}
+
+#endif /* Frustum_hpp */
@@ -0,0 +1,203 @@
+#include "GLState.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace gps {
+
+    // no GL object or enum uses this value, so the first call of each kind is always issued
+    static const GLuint UNKNOWN_STATE = 0xFFFFFFFFu;
+
+    static const char* STATE_NAMES[] = {
+        "program", "vertex array", "texture", "active texture",
+        "framebuffer", "viewport", "depth func", "polygon mode"
+    };
+
+    GLState::GLState()
+    {
+        memset(issued, 0, sizeof(issued));
+        memset(skipped, 0, sizeof(skipped));
+        frames = 0;
+        Invalidate();
+    }
+
+    GLState& GLState::GetShared()
+    {
+        static GLState sharedState;
+        return sharedState;
+    }
+
+    void GLState::Invalidate()
+    {
+        program = UNKNOWN_STATE;
+        vertexArray = UNKNOWN_STATE;
+        for (GLuint unit = 0; unit < STATE_TEXTURE_UNITS; unit++) {
+            for (int slot = 0; slot < TEXTURE_SLOT_COUNT; slot++) {
+                textures[unit][slot] = UNKNOWN_STATE;
+            }
+        }
+        activeTexture = UNKNOWN_STATE;
+        framebuffer = UNKNOWN_STATE;
+        viewport[0] = viewport[1] = 0;
+        viewport[2] = viewport[3] = -1;
+        depthFunc = UNKNOWN_STATE;
+        polygonMode = UNKNOWN_STATE;
+    }
+
+    bool GLState::Change(StateKind kind, bool changed)
+    {
+        if (changed) {
+            issued[kind]++;
+        }
+        else {
+            skipped[kind]++;
+        }
+        return changed;
+    }
+
+    int GLState::GetTextureSlot(GLenum target)
+    {
+        switch (target) {
+        case GL_TEXTURE_2D:
+            return TEXTURE_SLOT_2D;
+        case GL_TEXTURE_CUBE_MAP:
+            return TEXTURE_SLOT_CUBE_MAP;
+        case GL_TEXTURE_2D_ARRAY:
+            return TEXTURE_SLOT_2D_ARRAY;
+        case GL_TEXTURE_BUFFER:
+            return TEXTURE_SLOT_BUFFER;
+        default:
+            return -1;
+        }
+    }
+
+    void GLState::UseProgram(GLuint newProgram)
+    {
+        if (Change(STATE_PROGRAM, program != newProgram)) {
+            program = newProgram;
+            glUseProgram(newProgram);
+        }
+    }
+
+    void GLState::BindVertexArray(GLuint newVertexArray)
+    {
+        if (Change(STATE_VERTEX_ARRAY, vertexArray != newVertexArray)) {
+            vertexArray = newVertexArray;
+            glBindVertexArray(newVertexArray);
+        }
+    }
+
+    void GLState::ActiveTexture(GLuint unit)
+    {
+        if (Change(STATE_ACTIVE_TEXTURE, activeTexture != unit)) {
+            activeTexture = unit;
+            glActiveTexture(GL_TEXTURE0 + unit);
+        }
+    }
+
+    void GLState::BindTexture(GLuint unit, GLenum target, GLuint texture)
+    {
+        int slot = GetTextureSlot(target);
+        bool tracked = slot >= 0 && unit < STATE_TEXTURE_UNITS;
+        if (!Change(STATE_TEXTURE, !tracked || textures[unit][slot] != texture)) {
+            return;
+        }
+        if (tracked) {
+            textures[unit][slot] = texture;
+        }
+        ActiveTexture(unit);
+        glBindTexture(target, texture);
+    }
+
+    void GLState::BindTextureForEdit(GLenum target, GLuint texture)
+    {
+        // the edit calls that follow act on the active unit, so it must be current even
+        // when the binding itself is already right
+        ActiveTexture(STATE_EDIT_TEXTURE_UNIT);
+        BindTexture(STATE_EDIT_TEXTURE_UNIT, target, texture);
+    }
+
+    void GLState::BindFramebuffer(GLuint newFramebuffer)
+    {
+        if (Change(STATE_FRAMEBUFFER, framebuffer != newFramebuffer)) {
+            framebuffer = newFramebuffer;
+            glBindFramebuffer(GL_FRAMEBUFFER, newFramebuffer);
+        }
+    }
+
+    void GLState::Viewport(GLint x, GLint y, GLsizei width, GLsizei height)
+    {
+        bool changed = viewport[0] != x || viewport[1] != y || viewport[2] != width || viewport[3] != height;
+        if (Change(STATE_VIEWPORT, changed)) {
+            viewport[0] = x;
+            viewport[1] = y;
+            viewport[2] = width;
+            viewport[3] = height;
+            glViewport(x, y, width, height);
+        }
+    }
+
+    void GLState::DepthFunc(GLenum func)
+    {
+        if (Change(STATE_DEPTH_FUNC, depthFunc != func)) {
+            depthFunc = func;
+            glDepthFunc(func);
+        }
+    }
+
+    void GLState::PolygonMode(GLenum mode)
+    {
+        if (Change(STATE_POLYGON_MODE, polygonMode != mode)) {
+            polygonMode = mode;
+            glPolygonMode(GL_FRONT_AND_BACK, mode);
+        }
+    }
+
+    void GLState::DeleteTexture(GLuint texture)
+    {
+        glDeleteTextures(1, &texture);
+        // GL rebinds 0 wherever the texture was bound
+        for (GLuint unit = 0; unit < STATE_TEXTURE_UNITS; unit++) {
+            for (int slot = 0; slot < TEXTURE_SLOT_COUNT; slot++) {
+                if (textures[unit][slot] == texture) {
+                    textures[unit][slot] = 0;
+                }
+            }
+        }
+    }
+
+    void GLState::DeleteVertexArray(GLuint deletedVertexArray)
+    {
+        glDeleteVertexArrays(1, &deletedVertexArray);
+        if (vertexArray == deletedVertexArray) {
+            vertexArray = 0;
+        }
+    }
+
+    void GLState::EndFrame()
+    {
+        frames++;
+    }
+
+    void GLState::PrintReport()
+    {
+        size_t frameCount = frames > 0 ? frames : 1;
+        size_t totalIssued = 0;
+        size_t totalSkipped = 0;
+
+        printf("GL state calls per frame (issued / skipped):\n");
+        for (int kind = 0; kind < STATE_KIND_COUNT; kind++) {
+            printf("  %-15s: %8.1f / %8.1f\n", STATE_NAMES[kind], (double)issued[kind] / frameCount, (double)skipped[kind] / frameCount);
+            totalIssued += issued[kind];
+            totalSkipped += skipped[kind];
+        }
+        size_t total = totalIssued + totalSkipped;
+        printf("  %-15s: %8.1f / %8.1f (%.1f%% filtered)\n", "total", (double)totalIssued / frameCount, (double)totalSkipped / frameCount,
+            total > 0 ? 100.0 * totalSkipped / total : 0.0);
+
+        memset(issued, 0, sizeof(issued));
+        memset(skipped, 0, sizeof(skipped));
+        frames = 0;
+    }
+
+}
@@ -0,0 +1,93 @@
+#ifndef GLState_hpp
+#define GLState_hpp
+
+#include <GL/glew.h>
+
+#include <cstddef>
+
+namespace gps {
+
+    // Texture units tracked per target, the last one is kept free for creating and
+    // uploading textures so that never disturbs what the draws bound
+    const GLuint STATE_TEXTURE_UNITS = 16;
+    const GLuint STATE_EDIT_TEXTURE_UNIT = STATE_TEXTURE_UNITS - 1;
+
+    // Thin cache in front of the GL binding and fixed function state the renderer changes
+    // every draw. Calls that would set what is already set never reach the driver, and
+    // both kinds are counted. Everything touching this state has to go through here (or call
+    // Invalidate afterwards). Context thread only.
+    class GLState
+    {
+    public:
+        GLState();
+
+        void UseProgram(GLuint program);
+        void BindVertexArray(GLuint vertexArray);
+        // Binds texture to unit for drawing, the active unit only changes when a bind is issued
+        void BindTexture(GLuint unit, GLenum target, GLuint texture);
+        // Binds texture on the edit unit and makes it active, for glTexImage and friends
+        void BindTextureForEdit(GLenum target, GLuint texture);
+        // Binds both the draw and the read framebuffer
+        void BindFramebuffer(GLuint framebuffer);
+        void Viewport(GLint x, GLint y, GLsizei width, GLsizei height);
+        void DepthFunc(GLenum func);
+        // Front and back faces together, the only way the renderer uses it
+        void PolygonMode(GLenum mode);
+
+        // Deleting an object unbinds it, the cache has to forget it as well
+        void DeleteTexture(GLuint texture);
+        void DeleteVertexArray(GLuint vertexArray);
+
+        // Forgets everything, the next call of each kind is always issued
+        void Invalidate();
+
+        // Call once per frame, the report averages over the frames since the last one
+        void EndFrame();
+        void PrintReport();
+
+        static GLState& GetShared();
+
+    private:
+        enum StateKind {
+            STATE_PROGRAM,
+            STATE_VERTEX_ARRAY,
+            STATE_TEXTURE,
+            STATE_ACTIVE_TEXTURE,
+            STATE_FRAMEBUFFER,
+            STATE_VIEWPORT,
+            STATE_DEPTH_FUNC,
+            STATE_POLYGON_MODE,
+            STATE_KIND_COUNT
+        };
+
+        // targets with a cached binding per unit, others are always issued
+        enum TextureSlot {
+            TEXTURE_SLOT_2D,
+            TEXTURE_SLOT_CUBE_MAP,
+            TEXTURE_SLOT_2D_ARRAY,
+            TEXTURE_SLOT_BUFFER,
+            TEXTURE_SLOT_COUNT
+        };
+
+        GLuint program;
+        GLuint vertexArray;
+        GLuint textures[STATE_TEXTURE_UNITS][TEXTURE_SLOT_COUNT];
+        GLuint activeTexture;
+        GLuint framebuffer;
+        GLint viewport[4];
+        GLenum depthFunc;
+        GLenum polygonMode;
+
+        size_t issued[STATE_KIND_COUNT];
+        size_t skipped[STATE_KIND_COUNT];
+        size_t frames;
+
+        // true when the call has to go to GL, counts it either way
+        bool Change(StateKind kind, bool changed);
+        void ActiveTexture(GLuint unit);
+        static int GetTextureSlot(GLenum target);
+    };
+
+}
+
+#endif /* GLState_hpp */
@@ -0,0 +1,319 @@
+#include "GeometryPool.hpp"
+#include "GLState.hpp"
+#include "Mesh.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+namespace gps {
+
+    // first allocation of each buffer, in elements, they double from there when full
+    static const GLuint INITIAL_VERTEX_CAPACITY = 1 << 18;
+    static const GLuint INITIAL_INDEX_CAPACITY = 1 << 20;
+
+    RangeAllocator::RangeAllocator()
+    {
+        capacity = 0;
+        used = 0;
+    }
+
+    bool RangeAllocator::Allocate(GLuint size, GLuint& offset)
+    {
+        for (std::map<GLuint, GLuint>::iterator block = freeBlocks.begin(); block != freeBlocks.end(); ++block) {
+            if (block->second < size) {
+                continue;
+            }
+            offset = block->first;
+            GLuint remaining = block->second - size;
+            freeBlocks.erase(block);
+            if (remaining > 0) {
+                freeBlocks[offset + size] = remaining;
+            }
+            used += size;
+            return true;
+        }
+        return false;
+    }
+
+    void RangeAllocator::Free(GLuint offset, GLuint size)
+    {
+        if (size == 0) {
+            return;
+        }
+        used -= size;
+
+        std::map<GLuint, GLuint>::iterator next = freeBlocks.lower_bound(offset);
+        if (next != freeBlocks.begin()) {
+            std::map<GLuint, GLuint>::iterator previous = std::prev(next);
+            if (previous->first + previous->second == offset) {
+                offset = previous->first;
+                size += previous->second;
+                freeBlocks.erase(previous);
+            }
+        }
+        if (next != freeBlocks.end() && offset + size == next->first) {
+            size += next->second;
+            freeBlocks.erase(next);
+        }
+        freeBlocks[offset] = size;
+    }
+
+    void RangeAllocator::Grow(GLuint newCapacity)
+    {
+        GLuint oldCapacity = capacity;
+        capacity = newCapacity;
+        // Free merges the new space with a free block at the old end
+        used += newCapacity - oldCapacity;
+        Free(oldCapacity, newCapacity - oldCapacity);
+    }
+
+    GLuint RangeAllocator::GetCapacity()
+    {
+        return capacity;
+    }
+
+    GLuint RangeAllocator::GetUsed()
+    {
+        return used;
+    }
+
+    GeometryPool::GeometryPool()
+    {
+        for (int format = 0; format < VERTEX_FORMAT_COUNT; format++) {
+            formats[format].vertexArray = 0;
+            formats[format].vertexBuffer = 0;
+            formats[format].instanceBuffer = 0;
+            formats[format].instanceOffset = 0;
+        }
+        indexBuffer = 0;
+        nextId = 0;
+        multiDrawIndirect = -1;
+        destroyed = false;
+    }
+
+    GeometryPool& GeometryPool::GetShared()
+    {
+        static GeometryPool sharedPool;
+        return sharedPool;
+    }
+
+    bool GeometryPool::SupportsMultiDrawIndirect()
+    {
+        if (multiDrawIndirect < 0) {
+            multiDrawIndirect = GLEW_VERSION_4_3 || (GLEW_ARB_multi_draw_indirect && GLEW_ARB_base_instance);
+        }
+        return multiDrawIndirect != 0;
+    }
+
+    // Copies the used part of buffer into a new one of newSize bytes, which replaces it
+    static void GrowBuffer(GLuint& buffer, GLsizeiptr oldSize, GLsizeiptr newSize)
+    {
+        GLuint grown;
+        glGenBuffers(1, &grown);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+        glBufferData(GL_COPY_WRITE_BUFFER, newSize, NULL, GL_STATIC_DRAW);
+        if (buffer != 0) {
+            glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, oldSize);
+            glDeleteBuffers(1, &buffer);
+        }
+        buffer = grown;
+    }
+
+    void GeometryPool::SetupVertexAttributes(VertexFormat format)
+    {
+        FormatBuffers& buffers = formats[format];
+        GLState::GetShared().BindVertexArray(buffers.vertexArray);
+        glBindBuffer(GL_ARRAY_BUFFER, buffers.vertexBuffer);
+
+        if (format == VERTEX_FORMAT_PACKED) {
+            // positions stay in [0, 1] of the mesh bounds, the instance transform rescales them,
+            // the shaders unfold the normals
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, Position));
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, Normal));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (GLvoid*)offsetof(PackedVertex, TexCoords));
+            return;
+        }
+
+        // Vertex Positions
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+        // Vertex Normals
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
+        // Vertex Texture Coords
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
+    }
+
+    void GeometryPool::CreateFormat(VertexFormat format, GLuint vertexCapacity)
+    {
+        FormatBuffers& buffers = formats[format];
+        glGenVertexArrays(1, &buffers.vertexArray);
+        GrowBuffer(buffers.vertexBuffer, 0, (GLsizeiptr)vertexCapacity * GetVertexSize(format));
+        buffers.vertices.Grow(vertexCapacity);
+
+        SetupVertexAttributes(format);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+        // the instance attributes advance once per instance, their arrays start disabled
+        for (GLuint i = 0; i < INSTANCE_ATTRIBUTE_COUNT; i++) {
+            glVertexAttribDivisor(INSTANCE_ATTRIBUTE_LOCATION + i, 1);
+        }
+    }
+
+    void GeometryPool::GrowVertices(VertexFormat format, GLuint needed)
+    {
+        FormatBuffers& buffers = formats[format];
+        GLuint capacity = buffers.vertices.GetCapacity();
+        GLuint newCapacity = std::max(capacity * 2, capacity + needed);
+        GrowBuffer(buffers.vertexBuffer, (GLsizeiptr)capacity * GetVertexSize(format), (GLsizeiptr)newCapacity * GetVertexSize(format));
+        buffers.vertices.Grow(newCapacity);
+        // the attribute pointers still name the old buffer
+        SetupVertexAttributes(format);
+    }
+
+    void GeometryPool::GrowIndices(GLuint needed)
+    {
+        GLuint capacity = indices.GetCapacity();
+        GLuint newCapacity = std::max(std::max(capacity * 2, capacity + needed), INITIAL_INDEX_CAPACITY);
+        GrowBuffer(indexBuffer, (GLsizeiptr)capacity * sizeof(GLuint), (GLsizeiptr)newCapacity * sizeof(GLuint));
+        indices.Grow(newCapacity);
+        // the element buffer binding is part of every vertex array
+        for (int format = 0; format < VERTEX_FORMAT_COUNT; format++) {
+            if (formats[format].vertexArray != 0) {
+                GLState::GetShared().BindVertexArray(formats[format].vertexArray);
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+            }
+        }
+    }
+
+    GeometryRange GeometryPool::Allocate(VertexFormat format, const void* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount)
+    {
+        GeometryRange range;
+        range.format = format;
+        range.vertexCount = (GLuint)vertexCount;
+        range.indexCount = (GLuint)indexCount;
+
+        GLuint firstIndex;
+        if (!this->indices.Allocate(range.indexCount, firstIndex)) {
+            GrowIndices(range.indexCount);
+            this->indices.Allocate(range.indexCount, firstIndex);
+        }
+        range.firstIndex = firstIndex;
+
+        FormatBuffers& buffers = formats[format];
+        if (buffers.vertexArray == 0) {
+            CreateFormat(format, std::max(INITIAL_VERTEX_CAPACITY, range.vertexCount));
+        }
+        GLuint baseVertex;
+        if (!buffers.vertices.Allocate(range.vertexCount, baseVertex)) {
+            GrowVertices(format, range.vertexCount);
+            buffers.vertices.Allocate(range.vertexCount, baseVertex);
+        }
+        range.baseVertex = (GLint)baseVertex;
+
+        // the copy targets leave the vertex array bindings alone
+        size_t vertexSize = GetVertexSize(format);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffers.vertexBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)baseVertex * vertexSize, (GLsizeiptr)(vertexCount * vertexSize), vertices);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, indexBuffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)firstIndex * sizeof(GLuint), (GLsizeiptr)(indexCount * sizeof(GLuint)), indices);
+
+        if (!freeIds.empty()) {
+            range.id = freeIds.back();
+            freeIds.pop_back();
+        }
+        else {
+            range.id = nextId++;
+        }
+        return range;
+    }
+
+    void GeometryPool::Free(const GeometryRange& range)
+    {
+        if (destroyed) {
+            return;
+        }
+        formats[range.format].vertices.Free((GLuint)range.baseVertex, range.vertexCount);
+        indices.Free(range.firstIndex, range.indexCount);
+        freeIds.push_back(range.id);
+    }
+
+    void GeometryPool::BindVertexArray(VertexFormat format)
+    {
+        GLState::GetShared().BindVertexArray(formats[format].vertexArray);
+    }
+
+    void GeometryPool::BindInstances(VertexFormat format, GLuint buffer, GLintptr offset)
+    {
+        FormatBuffers& buffers = formats[format];
+        if (buffers.instanceBuffer == buffer && (buffer == 0 || buffers.instanceOffset == offset)) {
+            return;
+        }
+        BindVertexArray(format);
+
+        // the enable state is part of the vertex array, toggled only when the draw kind changes
+        if ((buffers.instanceBuffer == 0) != (buffer == 0)) {
+            for (GLuint i = 0; i < INSTANCE_ATTRIBUTE_COUNT; i++) {
+                if (buffer != 0) {
+                    glEnableVertexAttribArray(INSTANCE_ATTRIBUTE_LOCATION + i);
+                }
+                else {
+                    glDisableVertexAttribArray(INSTANCE_ATTRIBUTE_LOCATION + i);
+                }
+            }
+        }
+        buffers.instanceBuffer = buffer;
+        buffers.instanceOffset = offset;
+        if (buffer == 0) {
+            return;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        for (GLuint column = 0; column < 4; column++) {
+            glVertexAttribPointer(INSTANCE_ATTRIBUTE_LOCATION + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                (GLvoid*)(offset + offsetof(InstanceData, Model) + column * sizeof(glm::vec4)));
+        }
+        for (GLuint column = 0; column < 3; column++) {
+            glVertexAttribPointer(INSTANCE_ATTRIBUTE_LOCATION + 4 + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                (GLvoid*)(offset + offsetof(InstanceData, NormalMatrix) + column * sizeof(glm::vec3)));
+        }
+    }
+
+    void GeometryPool::Destroy()
+    {
+        for (int format = 0; format < VERTEX_FORMAT_COUNT; format++) {
+            FormatBuffers& buffers = formats[format];
+            if (buffers.vertexArray != 0) {
+                GLState::GetShared().DeleteVertexArray(buffers.vertexArray);
+                glDeleteBuffers(1, &buffers.vertexBuffer);
+                buffers.vertexArray = 0;
+                buffers.vertexBuffer = 0;
+            }
+        }
+        if (indexBuffer != 0) {
+            glDeleteBuffers(1, &indexBuffer);
+            indexBuffer = 0;
+        }
+        destroyed = true;
+    }
+
+    void GeometryPool::PrintReport()
+    {
+        static const char* FORMAT_NAMES[VERTEX_FORMAT_COUNT] = { "float", "packed" };
+
+        printf("Geometry pool (%s):\n", SupportsMultiDrawIndirect() ? "multi draw indirect" : "instanced draws");
+        for (int format = 0; format < VERTEX_FORMAT_COUNT; format++) {
+            RangeAllocator& vertices = formats[format].vertices;
+            printf("  %-7s vertices: %9u of %9u (%.1f MB)\n", FORMAT_NAMES[format], vertices.GetUsed(), vertices.GetCapacity(),
+                vertices.GetCapacity() * GetVertexSize((VertexFormat)format) / (1024.0 * 1024.0));
+        }
+        printf("  indices         : %9u of %9u (%.1f MB)\n", indices.GetUsed(), indices.GetCapacity(),
+            indices.GetCapacity() * sizeof(GLuint) / (1024.0 * 1024.0));
+    }
+
+}
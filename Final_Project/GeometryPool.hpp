@@ -0,0 +1,123 @@
+#ifndef GeometryPool_hpp
+#define GeometryPool_hpp
+
+#include <GL/glew.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace gps {
+
+    enum VertexFormat {
+        VERTEX_FORMAT_FLOAT = 0, // Vertex
+        VERTEX_FORMAT_PACKED = 1 // PackedVertex
+    };
+
+    const int VERTEX_FORMAT_COUNT = 2;
+
+    size_t GetVertexSize(VertexFormat format);
+
+    // Where a mesh lives inside the pool
+    struct GeometryRange {
+        VertexFormat format;
+        // first vertex in the format's vertex buffer, added to every index of the mesh
+        GLint baseVertex;
+        GLuint vertexCount;
+        // first index in the shared index buffer
+        GLuint firstIndex;
+        GLuint indexCount;
+        // small id, unique among the live ranges, reused after Free
+        uint32_t id;
+    };
+
+    // The command layout glMultiDrawElementsIndirect reads
+    struct DrawElementsIndirectCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // First fit allocator over [0, capacity), in elements
+    class RangeAllocator
+    {
+    public:
+        RangeAllocator();
+
+        bool Allocate(GLuint size, GLuint& offset);
+        void Free(GLuint offset, GLuint size);
+        // Adds [capacity, newCapacity) to the free space
+        void Grow(GLuint newCapacity);
+
+        GLuint GetCapacity();
+        GLuint GetUsed();
+
+    private:
+        // free blocks by offset, merged with their neighbours on Free
+        std::map<GLuint, GLuint> freeBlocks;
+        GLuint capacity;
+        GLuint used;
+    };
+
+    // Geometry of every mesh in a few large buffers: one vertex buffer and vertex array per
+    // vertex format, and one index buffer all of them share. Meshes keep their own indices
+    // and draw with a base vertex, so any set of meshes of one format can go out in a single
+    // multi draw. The buffers grow by copying when full. Context thread only.
+    class GeometryPool
+    {
+    public:
+        GeometryPool();
+
+        // Copies the mesh data into the pool
+        GeometryRange Allocate(VertexFormat format, const void* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount);
+        void Free(const GeometryRange& range);
+
+        // Binds the vertex array of format, through GLState
+        void BindVertexArray(VertexFormat format);
+        // Points the instance attributes of format's vertex array at buffer starting at
+        // offset, buffer 0 disables them so they read their current values instead
+        void BindInstances(VertexFormat format, GLuint buffer, GLintptr offset);
+
+        // glMultiDrawElementsIndirect honouring the commands' base instance (GL 4.3, or 4.0
+        // with both extensions), known once the context exists
+        bool SupportsMultiDrawIndirect();
+
+        // Deletes the buffers, Free does nothing from then on
+        void Destroy();
+
+        // Buffer sizes and how much of them is used
+        void PrintReport();
+
+        static GeometryPool& GetShared();
+
+    private:
+        struct FormatBuffers {
+            GLuint vertexArray;
+            GLuint vertexBuffer;
+            RangeAllocator vertices;
+            // what the instance attributes read, buffer 0 while they are disabled
+            GLuint instanceBuffer;
+            GLintptr instanceOffset;
+        };
+
+        FormatBuffers formats[VERTEX_FORMAT_COUNT];
+        GLuint indexBuffer;
+        RangeAllocator indices;
+        uint32_t nextId;
+        std::vector<uint32_t> freeIds;
+        // -1 until the first query
+        int multiDrawIndirect;
+        bool destroyed;
+
+        void CreateFormat(VertexFormat format, GLuint vertexCapacity);
+        void SetupVertexAttributes(VertexFormat format);
+        void GrowVertices(VertexFormat format, GLuint needed);
+        void GrowIndices(GLuint needed);
+    };
+
+}
+
+#endif /* GeometryPool_hpp */
@@ -0,0 +1,91 @@
+#include "GpuTimer.hpp"
+
+namespace gps {
+
+    GpuTimer::GpuTimer()
+    {
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++) {
+            queries[i] = 0;
+            queryTags[i] = -1;
+        }
+        next = 0;
+    }
+
+    void GpuTimer::Create()
+    {
+        glGenQueries(GPU_TIMER_QUERIES, queries);
+    }
+
+    void GpuTimer::Destroy()
+    {
+        if (queries[0] != 0) {
+            glDeleteQueries(GPU_TIMER_QUERIES, queries);
+        }
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++) {
+            queries[i] = 0;
+            queryTags[i] = -1;
+        }
+    }
+
+    void GpuTimer::Begin(int tag)
+    {
+        // the oldest query is reused, by now its result is normally there already
+        Collect(next);
+        queryTags[next] = tag;
+        glBeginQuery(GL_TIME_ELAPSED, queries[next]);
+    }
+
+    void GpuTimer::End()
+    {
+        glEndQuery(GL_TIME_ELAPSED);
+        next = (next + 1) % GPU_TIMER_QUERIES;
+    }
+
+    void GpuTimer::Flush()
+    {
+        for (int i = 0; i < GPU_TIMER_QUERIES; i++) {
+            Collect((next + i) % GPU_TIMER_QUERIES);
+        }
+    }
+
+    void GpuTimer::Reset()
+    {
+        totals.clear();
+        counts.clear();
+    }
+
+    double GpuTimer::GetAverageMilliseconds(int tag)
+    {
+        if (tag < 0 || tag >= (int)counts.size() || counts[tag] == 0) {
+            return 0.0;
+        }
+        return (double)totals[tag] / counts[tag] / 1000000.0;
+    }
+
+    int GpuTimer::GetSampleCount(int tag)
+    {
+        if (tag < 0 || tag >= (int)counts.size()) {
+            return 0;
+        }
+        return counts[tag];
+    }
+
+    void GpuTimer::Collect(int query)
+    {
+        int tag = queryTags[query];
+        if (tag < 0) {
+            return;
+        }
+        queryTags[query] = -1;
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v(queries[query], GL_QUERY_RESULT, &elapsed);
+        if (tag >= (int)counts.size()) {
+            totals.resize(tag + 1, 0);
+            counts.resize(tag + 1, 0);
+        }
+        totals[tag] += elapsed;
+        counts[tag]++;
+    }
+
+}
@@ -0,0 +1,50 @@
+#ifndef GpuTimer_hpp
+#define GpuTimer_hpp
+
+#include <GL/glew.h>
+
+#include <vector>
+
+namespace gps {
+
+    // Intervals in flight, a query is read back this many intervals after it was issued
+    const int GPU_TIMER_QUERIES = 4;
+
+    // Measures GPU time between Begin and End with GL_TIME_ELAPSED queries and averages it
+    // per tag. Results are read back a few intervals late so the CPU never waits for the
+    // GPU to catch up. Context thread only
+    class GpuTimer
+    {
+    public:
+        GpuTimer();
+
+        void Create();
+        void Destroy();
+
+        // Intervals do not nest, only one may be open at a time
+        void Begin(int tag);
+        void End();
+
+        // Reads back the finished queries, waiting for the ones still in flight
+        void Flush();
+        // Forgets the averages, the queries in flight still count
+        void Reset();
+
+        // Average milliseconds of the intervals read back with tag, 0 when there are none
+        double GetAverageMilliseconds(int tag);
+        int GetSampleCount(int tag);
+
+    private:
+        GLuint queries[GPU_TIMER_QUERIES];
+        // -1 while a query has no result to read back
+        int queryTags[GPU_TIMER_QUERIES];
+        int next;
+        std::vector<GLuint64> totals;
+        std::vector<int> counts;
+
+        void Collect(int query);
+    };
+
+}
+
+#endif /* GpuTimer_hpp */
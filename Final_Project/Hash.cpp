@@ -0,0 +1,45 @@
+#include "Hash.hpp"
+
+#include <cstdio>
+#include <sys/stat.h>
+#include <vector>
+
+namespace gps {
+
+    bool HashFile(const std::string& fileName, uint64_t& hash)
+    {
+        FILE* file = fopen(fileName.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+
+        std::vector<unsigned char> buffer(1 << 20);
+        hash = HASH_SEED;
+        size_t readBytes;
+        while ((readBytes = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+            hash = HashBytes(buffer.data(), readBytes, hash);
+        }
+        fclose(file);
+
+        return true;
+    }
+
+    bool GetFileStamp(const std::string& fileName, uint64_t& size, int64_t& modifiedTime)
+    {
+#ifdef _WIN32
+        struct _stat64 info;
+        if (_stat64(fileName.c_str(), &info) != 0) {
+            return false;
+        }
+#else
+        struct stat info;
+        if (stat(fileName.c_str(), &info) != 0) {
+            return false;
+        }
+#endif
+        size = (uint64_t)info.st_size;
+        modifiedTime = (int64_t)info.st_mtime;
+        return true;
+    }
+
+}
@@ -0,0 +1,37 @@
+#ifndef Hash_hpp
+#define Hash_hpp
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace gps {
+
+    const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+    // 64-bit FNV-1a over a block of memory, can be chained through the seed
+    inline uint64_t HashBytes(const void* data, size_t size, uint64_t seed = HASH_SEED)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        uint64_t hash = seed;
+        for (size_t i = 0; i < size; i++) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    inline uint64_t HashString(const std::string& text, uint64_t seed = HASH_SEED)
+    {
+        return HashBytes(text.data(), text.size(), seed);
+    }
+
+    // Hashes the whole content of a file, returns false if it can't be read
+    bool HashFile(const std::string& fileName, uint64_t& hash);
+
+    // Size and last modification time of a file, returns false if it doesn't exist
+    bool GetFileStamp(const std::string& fileName, uint64_t& size, int64_t& modifiedTime);
+
+}
+
+#endif /* Hash_hpp */
@@ -0,0 +1,264 @@
+#include "LightClusters.hpp"
+#include "GLState.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+namespace gps {
+
+    static_assert(sizeof(LightData) == 48, "LightData must be three vec4 texels");
+
+    // reallocates buffer with size bytes (at least a few, empty buffers cannot back a texture)
+    // so the frames still reading the old contents never stall this one
+    static void UploadBuffer(GLuint buffer, const void* data, size_t size)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffer);
+        glBufferData(GL_TEXTURE_BUFFER, (GLsizeiptr)std::max(size, (size_t)16), NULL, GL_STREAM_DRAW);
+        if (size > 0) {
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, (GLsizeiptr)size, data);
+        }
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+
+    static void CreateBufferTexture(GLuint& buffer, GLuint& texture, GLenum format)
+    {
+        glGenBuffers(1, &buffer);
+        UploadBuffer(buffer, NULL, 0);
+        glGenTextures(1, &texture);
+        GLState::GetShared().BindTextureForEdit(GL_TEXTURE_BUFFER, texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    }
+
+    LightClusters::LightClusters()
+    {
+        nearDepth = 1.0f;
+        farDepth = 100.0f;
+        shaderParams = glm::vec4(0.0f);
+        lightsDirty = true;
+        maxIndices = 0;
+        maxLights = LIGHT_CLUSTER_MAX_LIGHTS;
+        maxClusterLights = 0;
+        warned = false;
+        lightsWarned = false;
+        lightBuffer = clusterBuffer = indexBuffer = 0;
+        lightTexture = clusterTexture = indexTexture = 0;
+    }
+
+    void LightClusters::Create(float nearDepth, float farDepth)
+    {
+        this->nearDepth = nearDepth;
+        this->farDepth = farDepth;
+
+        // GL 4.1 only promises 65536 texels per buffer texture
+        GLint maxTexels = 65536;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+        maxIndices = (size_t)maxTexels;
+        maxLights = std::min(LIGHT_CLUSTER_MAX_LIGHTS, (size_t)maxTexels / 3);
+
+        CreateBufferTexture(lightBuffer, lightTexture, GL_RGBA32F);
+        CreateBufferTexture(clusterBuffer, clusterTexture, GL_RG32UI);
+        CreateBufferTexture(indexBuffer, indexTexture, GL_R16UI);
+        lightsDirty = true;
+    }
+
+    void LightClusters::Destroy()
+    {
+        GLuint textures[] = { lightTexture, clusterTexture, indexTexture };
+        for (GLuint texture : textures) {
+            if (texture != 0) {
+                GLState::GetShared().DeleteTexture(texture);
+            }
+        }
+        GLuint buffers[] = { lightBuffer, clusterBuffer, indexBuffer };
+        glDeleteBuffers(3, buffers);
+        lightBuffer = clusterBuffer = indexBuffer = 0;
+        lightTexture = clusterTexture = indexTexture = 0;
+    }
+
+    void LightClusters::Clear()
+    {
+        lights.clear();
+        lightsDirty = true;
+    }
+
+    void LightClusters::AddPointLight(const glm::vec3& position, const glm::vec3& color, float radius)
+    {
+        // a cone wider than the sphere never dims anything
+        AddSpotLight(position, glm::vec3(0.0f, -1.0f, 0.0f), color, radius, -1.0f, -2.0f);
+    }
+
+    void LightClusters::AddSpotLight(const glm::vec3& position, const glm::vec3& direction, const glm::vec3& color, float radius,
+        float cosInnerCutoff, float cosOuterCutoff)
+    {
+        if (lights.size() >= maxLights) {
+            if (!lightsWarned) {
+                fprintf(stderr, "WARNING: more than %d lights, the rest are left out\n", (int)maxLights);
+                lightsWarned = true;
+            }
+            return;
+        }
+        LightData light;
+        light.position = position;
+        light.radius = radius;
+        light.color = color;
+        light.cosOuterCutoff = cosOuterCutoff;
+        light.direction = glm::normalize(direction);
+        light.cosInnerCutoff = cosInnerCutoff;
+        lights.push_back(light);
+        lightsDirty = true;
+    }
+
+    size_t LightClusters::GetLightCount()
+    {
+        return lights.size();
+    }
+
+    int LightClusters::GetSlice(float depth)
+    {
+        if (depth <= nearDepth) {
+            return 0;
+        }
+        int slice = (int)std::floor(std::log(depth) * shaderParams.z + shaderParams.w);
+        return std::min(std::max(slice, 0), LIGHT_CLUSTER_GRID_Z - 1);
+    }
+
+    bool LightClusters::GetClusterRange(const LightData& light, const glm::mat4& view, const glm::vec2 columns[], const glm::vec2 rows[],
+        ClusterRange& range)
+    {
+        glm::vec3 center = glm::vec3(view * glm::vec4(light.position, 1.0f));
+        float radius = light.radius;
+        float depth = -center.z;
+        if (depth + radius <= 0.0f) {
+            return false;
+        }
+        range.min[2] = GetSlice(depth - radius);
+        range.max[2] = GetSlice(depth + radius);
+
+        // the boundaries between tiles are planes through the eye, a tile is skipped when the
+        // sphere lies wholly on the far side of one of its edges
+        const glm::vec2* planes[2] = { columns, rows };
+        const int counts[2] = { LIGHT_CLUSTER_GRID_X, LIGHT_CLUSTER_GRID_Y };
+        for (int axis = 0; axis < 2; axis++) {
+            const glm::vec2* plane = planes[axis];
+            int count = counts[axis];
+            float offset = center[axis];
+            if (glm::dot(plane[0], glm::vec2(offset, center.z)) < -radius ||
+                glm::dot(plane[count], glm::vec2(offset, center.z)) > radius) {
+                return false;
+            }
+            int first = 0;
+            while (first < count - 1 && glm::dot(plane[first + 1], glm::vec2(offset, center.z)) > radius) {
+                first++;
+            }
+            int last = count - 1;
+            while (last > first && glm::dot(plane[last], glm::vec2(offset, center.z)) < -radius) {
+                last--;
+            }
+            range.min[axis] = first;
+            range.max[axis] = last;
+        }
+        return true;
+    }
+
+    void LightClusters::Update(const glm::mat4& view, const glm::mat4& projection, int width, int height)
+    {
+        float depthScale = LIGHT_CLUSTER_GRID_Z / std::log(farDepth / nearDepth);
+        shaderParams = glm::vec4((float)LIGHT_CLUSTER_GRID_X / width, (float)LIGHT_CLUSTER_GRID_Y / height,
+            depthScale, -std::log(nearDepth) * depthScale);
+
+        // tile edge i sits at NDC -1 + 2i / count, points right of (or above) it have
+        // projection[0][0] * x + ndc * z > 0 in view space
+        glm::vec2 columns[LIGHT_CLUSTER_GRID_X + 1];
+        glm::vec2 rows[LIGHT_CLUSTER_GRID_Y + 1];
+        for (int i = 0; i <= LIGHT_CLUSTER_GRID_X; i++) {
+            columns[i] = glm::normalize(glm::vec2(projection[0][0], -1.0f + 2.0f * i / LIGHT_CLUSTER_GRID_X));
+        }
+        for (int i = 0; i <= LIGHT_CLUSTER_GRID_Y; i++) {
+            rows[i] = glm::normalize(glm::vec2(projection[1][1], -1.0f + 2.0f * i / LIGHT_CLUSTER_GRID_Y));
+        }
+
+        // count the lights of every cluster, then hand out runs and fill them
+        clusters.assign(LIGHT_CLUSTER_COUNT * 2, 0);
+        ranges.resize(lights.size());
+        for (size_t i = 0; i < lights.size(); i++) {
+            ClusterRange& range = ranges[i];
+            if (!GetClusterRange(lights[i], view, columns, rows, range)) {
+                range.min[2] = 1;
+                range.max[2] = 0;
+                continue;
+            }
+            for (int z = range.min[2]; z <= range.max[2]; z++) {
+                for (int y = range.min[1]; y <= range.max[1]; y++) {
+                    for (int x = range.min[0]; x <= range.max[0]; x++) {
+                        clusters[((z * LIGHT_CLUSTER_GRID_Y + y) * LIGHT_CLUSTER_GRID_X + x) * 2 + 1]++;
+                    }
+                }
+            }
+        }
+
+        size_t total = 0;
+        maxClusterLights = 0;
+        for (int cluster = 0; cluster < LIGHT_CLUSTER_COUNT; cluster++) {
+            size_t count = clusters[cluster * 2 + 1];
+            maxClusterLights = std::max(maxClusterLights, count);
+            // past the largest buffer texture the clusters lose their last lights
+            if (total + count > maxIndices) {
+                if (!warned) {
+                    fprintf(stderr, "WARNING: more than %d light indices, some clusters are missing lights\n", (int)maxIndices);
+                    warned = true;
+                }
+                count = maxIndices - total;
+            }
+            clusters[cluster * 2] = (GLuint)total;
+            clusters[cluster * 2 + 1] = (GLuint)count;
+            total += count;
+        }
+
+        indices.resize(total);
+        cursors.assign(LIGHT_CLUSTER_COUNT, 0);
+        for (size_t i = 0; i < lights.size(); i++) {
+            const ClusterRange& range = ranges[i];
+            for (int z = range.min[2]; z <= range.max[2]; z++) {
+                for (int y = range.min[1]; y <= range.max[1]; y++) {
+                    for (int x = range.min[0]; x <= range.max[0]; x++) {
+                        int cluster = (z * LIGHT_CLUSTER_GRID_Y + y) * LIGHT_CLUSTER_GRID_X + x;
+                        if (cursors[cluster] < clusters[cluster * 2 + 1]) {
+                            indices[clusters[cluster * 2] + cursors[cluster]++] = (uint16_t)i;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (lightsDirty) {
+            UploadBuffer(lightBuffer, lights.data(), lights.size() * sizeof(LightData));
+            lightsDirty = false;
+        }
+        UploadBuffer(clusterBuffer, clusters.data(), clusters.size() * sizeof(GLuint));
+        UploadBuffer(indexBuffer, indices.data(), indices.size() * sizeof(uint16_t));
+    }
+
+    glm::vec4 LightClusters::GetShaderParams()
+    {
+        return shaderParams;
+    }
+
+    void LightClusters::Bind(GLuint lightDataUnit, GLuint clusterUnit, GLuint indexUnit)
+    {
+        GLState::GetShared().BindTexture(lightDataUnit, GL_TEXTURE_BUFFER, lightTexture);
+        GLState::GetShared().BindTexture(clusterUnit, GL_TEXTURE_BUFFER, clusterTexture);
+        GLState::GetShared().BindTexture(indexUnit, GL_TEXTURE_BUFFER, indexTexture);
+    }
+
+    size_t LightClusters::GetIndexCount()
+    {
+        return indices.size();
+    }
+
+    size_t LightClusters::GetMaxClusterLights()
+    {
+        return maxClusterLights;
+    }
+
+}
@@ -0,0 +1,105 @@
+#ifndef LightClusters_hpp
+#define LightClusters_hpp
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace gps {
+
+    // Clusters the view frustum is cut into: screen tiles times exponential depth slices,
+    // shaders/basic.frag declares the same sizes
+    const int LIGHT_CLUSTER_GRID_X = 16;
+    const int LIGHT_CLUSTER_GRID_Y = 9;
+    const int LIGHT_CLUSTER_GRID_Z = 24;
+    const int LIGHT_CLUSTER_COUNT = LIGHT_CLUSTER_GRID_X * LIGHT_CLUSTER_GRID_Y * LIGHT_CLUSTER_GRID_Z;
+
+    // Light indices are 16 bit
+    const size_t LIGHT_CLUSTER_MAX_LIGHTS = 65536;
+
+    // One light as the shaders fetch it, three vec4 texels. A point light is a spot light
+    // whose cone covers the whole sphere
+    struct LightData {
+        // world space
+        glm::vec3 position;
+        // the light fades to nothing there, it is binned with a sphere this size
+        GLfloat radius;
+        // premultiplied by the intensity
+        glm::vec3 color;
+        GLfloat cosOuterCutoff;
+        glm::vec3 direction;
+        GLfloat cosInnerCutoff;
+    };
+
+    // Clustered forward lighting. The light list lives in a texture buffer, every frame the
+    // lights are binned on the CPU into the clusters of the view they touch and each cluster's
+    // run of light indices is uploaded next to it, so a fragment only loops over the lights
+    // near it. Context thread only
+    class LightClusters
+    {
+    public:
+        LightClusters();
+
+        // Slices cover view depths nearDepth to farDepth, anything outside lands in the first
+        // or last one
+        void Create(float nearDepth, float farDepth);
+        void Destroy();
+
+        void Clear();
+        void AddPointLight(const glm::vec3& position, const glm::vec3& color, float radius);
+        // Cutoffs are cosines of the half angles, the light is full inside the inner one
+        void AddSpotLight(const glm::vec3& position, const glm::vec3& direction, const glm::vec3& color, float radius,
+            float cosInnerCutoff, float cosOuterCutoff);
+        size_t GetLightCount();
+
+        // Bins the lights into the clusters of view and a symmetric perspective projection
+        // on a width x height viewport, and uploads the lists
+        void Update(const glm::mat4& view, const glm::mat4& projection, int width, int height);
+        // Fragment coordinates to tile in xy, log of the view depth to slice in zw
+        glm::vec4 GetShaderParams();
+        // The light list, the (offset, count) of every cluster and the indices they point into
+        void Bind(GLuint lightDataUnit, GLuint clusterUnit, GLuint indexUnit);
+
+        // Of the last Update
+        size_t GetIndexCount();
+        size_t GetMaxClusterLights();
+
+    private:
+        float nearDepth;
+        float farDepth;
+        glm::vec4 shaderParams;
+
+        std::vector<LightData> lights;
+        bool lightsDirty;
+        // clusters each light touches, [min, max] on every axis
+        struct ClusterRange {
+            int min[3];
+            int max[3];
+        };
+        std::vector<ClusterRange> ranges;
+        // (offset, count) pairs
+        std::vector<GLuint> clusters;
+        std::vector<uint16_t> indices;
+        std::vector<GLuint> cursors;
+        size_t maxIndices;
+        // the light list is a buffer texture too, three texels per light
+        size_t maxLights;
+        size_t maxClusterLights;
+        bool warned;
+        bool lightsWarned;
+
+        GLuint lightBuffer, clusterBuffer, indexBuffer;
+        GLuint lightTexture, clusterTexture, indexTexture;
+
+        bool GetClusterRange(const LightData& light, const glm::mat4& view, const glm::vec2 columns[], const glm::vec2 rows[],
+            ClusterRange& range);
+        int GetSlice(float depth);
+    };
+
+}
+
+#endif /* LightClusters_hpp */
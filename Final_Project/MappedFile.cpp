@@ -0,0 +1,115 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace gps {
+
+#ifdef _WIN32
+    MappedFile::MappedFile() : data(NULL), size(0), fileHandle(INVALID_HANDLE_VALUE), mappingHandle(NULL) {}
+#else
+    MappedFile::MappedFile() : data(NULL), size(0), fileDescriptor(-1) {}
+#endif
+
+    MappedFile::~MappedFile()
+    {
+        Close();
+    }
+
+    bool MappedFile::Open(const std::string& fileName)
+    {
+        Close();
+
+#ifdef _WIN32
+        fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fileHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+            Close();
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+
+        mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mappingHandle) {
+            Close();
+            return false;
+        }
+
+        data = static_cast<const unsigned char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+        if (!data) {
+            Close();
+            return false;
+        }
+#else
+        fileDescriptor = open(fileName.c_str(), O_RDONLY);
+        if (fileDescriptor < 0) {
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fileDescriptor, &info) != 0 || info.st_size == 0) {
+            Close();
+            return false;
+        }
+        size = (size_t)info.st_size;
+
+        void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (mapping == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        data = static_cast<const unsigned char*>(mapping);
+#endif
+        return true;
+    }
+
+    void MappedFile::Close()
+    {
+#ifdef _WIN32
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mappingHandle) {
+            CloseHandle(mappingHandle);
+        }
+        if (fileHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(fileHandle);
+        }
+        mappingHandle = NULL;
+        fileHandle = INVALID_HANDLE_VALUE;
+#else
+        if (data) {
+            munmap(const_cast<unsigned char*>(data), size);
+        }
+        if (fileDescriptor >= 0) {
+            close(fileDescriptor);
+        }
+        fileDescriptor = -1;
+#endif
+        data = NULL;
+        size = 0;
+    }
+
+    const unsigned char* MappedFile::GetData() const
+    {
+        return data;
+    }
+
+    size_t MappedFile::GetSize() const
+    {
+        return size;
+    }
+
+}
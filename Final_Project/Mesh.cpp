@@ -1,71 +1,347 @@
 #include "Mesh.hpp"
+#include "GLState.hpp"
+#include "ResourceRegistry.hpp"
+
+#include <glm/gtc/matrix_inverse.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <utility>
 namespace gps {
 
+	size_t GetVertexSize(VertexFormat format)
+	{
+		return format == VERTEX_FORMAT_PACKED ? sizeof(PackedVertex) : sizeof(Vertex);
+	}
+
+	InstanceData MakeInstance(const glm::mat4& model)
+	{
+		InstanceData instance;
+		instance.Model = model;
+		instance.NormalMatrix = glm::inverseTranspose(glm::mat3(model));
+		return instance;
+	}
+
+	// Computes the axis aligned bounding box of the vertices
+	BoundingBox ComputeBounds(const Vertex* vertices, size_t vertexCount)
+	{
+		BoundingBox bounds;
+		if (vertexCount == 0) {
+			bounds.min = bounds.max = glm::vec3(0.0f);
+			return bounds;
+		}
+
+		bounds.min = bounds.max = vertices[0].Position;
+		for (size_t i = 1; i < vertexCount; i++) {
+			bounds.min = glm::min(bounds.min, vertices[i].Position);
+			bounds.max = glm::max(bounds.max, vertices[i].Position);
+		}
+		return bounds;
+	}
+
+	BoundingSphere ComputeSphere(const Vertex* vertices, size_t vertexCount, const BoundingBox& bounds)
+	{
+		BoundingSphere sphere;
+		sphere.center = (bounds.min + bounds.max) * 0.5f;
+		float radiusSquared = 0.0f;
+		for (size_t i = 0; i < vertexCount; i++) {
+			glm::vec3 offset = vertices[i].Position - sphere.center;
+			radiusSquared = std::fmax(radiusSquared, glm::dot(offset, offset));
+		}
+		sphere.radius = std::sqrt(radiusSquared);
+		return sphere;
+	}
+
+	// IEEE half float, rounded to nearest
+	static GLushort FloatToHalf(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		uint32_t sign = (bits >> 16) & 0x8000;
+		int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+		uint32_t mantissa = bits & 0x7fffff;
+
+		if (exponent <= 0) {
+			// denormal, or too small for a half
+			if (exponent < -10) {
+				return (GLushort)sign;
+			}
+			mantissa |= 0x800000;
+			int shift = 14 - exponent;
+			uint32_t half = mantissa >> shift;
+			if ((mantissa >> (shift - 1)) & 1) {
+				half++;
+			}
+			return (GLushort)(sign | half);
+		}
+		if (exponent >= 31) {
+			return (GLushort)(sign | 0x7c00);
+		}
+
+		// a carry out of the mantissa correctly bumps the exponent
+		uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+		if (mantissa & 0x1000) {
+			half++;
+		}
+		return (GLushort)half;
+	}
+
+	static float HalfToFloat(GLushort half)
+	{
+		int exponent = (half >> 10) & 31;
+		int mantissa = half & 1023;
+		float value = exponent == 0 ? ldexpf((float)mantissa, -24) : ldexpf((float)(mantissa | 1024), exponent - 25);
+		return (half & 0x8000) ? -value : value;
+	}
+
+	static GLshort ToSnorm16(float value)
+	{
+		value = std::fmin(std::fmax(value, -1.0f), 1.0f);
+		return (GLshort)lroundf(value * 32767.0f);
+	}
+
+	bool PackVertices(const Vertex* vertices, size_t vertexCount, const BoundingBox& bounds, std::vector<PackedVertex>& packed)
+	{
+		const float maxTexCoordError = 0.5f / 1024.0f;
+
+		glm::vec3 extent = bounds.max - bounds.min;
+		packed.resize(vertexCount);
+		for (size_t i = 0; i < vertexCount; i++) {
+			const Vertex& vertex = vertices[i];
+			PackedVertex& out = packed[i];
+
+			for (int k = 0; k < 3; k++) {
+				float t = extent[k] > 0.0f ? (vertex.Position[k] - bounds.min[k]) / extent[k] : 0.0f;
+				out.Position[k] = (GLushort)lroundf(std::fmin(std::fmax(t, 0.0f), 1.0f) * 65535.0f);
+			}
+			out.Position[3] = 0;
+
+			// octahedral: project on |x| + |y| + |z| = 1, fold the lower half over the diagonals
+			glm::vec3 n = vertex.Normal;
+			float l1 = std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z);
+			float x = l1 > 0.0f ? n.x / l1 : 0.0f;
+			float y = l1 > 0.0f ? n.y / l1 : 0.0f;
+			if (l1 > 0.0f && n.z < 0.0f) {
+				float foldedX = (1.0f - std::fabs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+				float foldedY = (1.0f - std::fabs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+				x = foldedX;
+				y = foldedY;
+			}
+			out.Normal[0] = ToSnorm16(x);
+			out.Normal[1] = ToSnorm16(y);
+
+			for (int k = 0; k < 2; k++) {
+				out.TexCoords[k] = FloatToHalf(vertex.TexCoords[k]);
+				if (std::fabs(HalfToFloat(out.TexCoords[k]) - vertex.TexCoords[k]) > maxTexCoordError) {
+					packed.clear();
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
 	/* Mesh Constructor */
-	Mesh::Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures)
+	Mesh::Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures, std::vector<MeshLod> lods)
 	{
-		this->vertices = vertices;
-		this->indices = indices;
-		this->textures = textures;
+		this->vertices = std::move(vertices);
+		this->indices = std::move(indices);
+		this->textures = std::move(textures);
+		this->lods = std::move(lods);
+		this->format = VERTEX_FORMAT_FLOAT;
 
-		this->setupMesh();
+		this->bounds = ComputeBounds(this->vertices.data(), this->vertices.size());
+		this->sphere = ComputeSphere(this->vertices.data(), this->vertices.size(), this->bounds);
+		this->setupMesh(this->vertices.data(), this->vertices.size(), this->indices.data(), this->indices.size());
 	}
 
-	Buffers Mesh::getBuffers() {
-	    return this->buffers;
+	Mesh::Mesh(const void* vertices, VertexFormat format, size_t vertexCount, const GLuint* indices, size_t indexCount,
+		std::vector<MeshLod> lods, std::vector<Texture> textures, BoundingBox bounds, BoundingSphere sphere)
+	{
+		this->lods = std::move(lods);
+		this->textures = std::move(textures);
+		this->bounds = bounds;
+		this->sphere = sphere;
+		this->format = format;
+
+		this->setupMesh(vertices, vertexCount, indices, indexCount);
+	}
+
+	GeometryRange Mesh::getGeometry() {
+	    return this->geometry;
+	}
+
+	glm::mat4 Mesh::GetVertexTransform()
+	{
+		if (format != VERTEX_FORMAT_PACKED) {
+			return glm::mat4(1.0f);
+		}
+		// packed positions are unorm16 across the bounds
+		glm::mat4 transform = glm::translate(glm::mat4(1.0f), bounds.min);
+		return glm::scale(transform, bounds.max - bounds.min);
 	}
 
 	/* Mesh drawing function - also applies associated textures */
-	void Mesh::Draw(gps::Shader shader)
+	void Mesh::Draw(gps::Shader& shader)
+	{
+		Draw(shader, 0, MakeInstance(glm::mat4(1.0f)));
+	}
+
+	size_t Mesh::GetSectionCount()
+	{
+		return std::max(sections.size(), (size_t)1);
+	}
+
+	const BoundingBox& Mesh::GetSectionBounds(size_t section)
+	{
+		return sections.empty() ? bounds : sections[section].bounds;
+	}
+
+	const BoundingSphere& Mesh::GetSectionSphere(size_t section)
+	{
+		return sections.empty() ? sphere : sections[section].sphere;
+	}
+
+	size_t Mesh::SelectLod(const glm::mat4& modelMatrix, const DrawContext& context, size_t section)
+	{
+		if (lods.size() < 2) {
+			return 0;
+		}
+		// a merged mesh spans many shapes, the camera is often inside its bounds
+		const BoundingBox& bounds = GetSectionBounds(section);
+		const MeshLod* levels = sections.empty() ? lods.data() : sections[section].lods;
+
+		// the model matrix may scale, the largest axis bounds how far the error grows
+		float scale = std::fmax(glm::length(glm::vec3(modelMatrix[0])),
+			std::fmax(glm::length(glm::vec3(modelMatrix[1])), glm::length(glm::vec3(modelMatrix[2]))));
+
+		float pixelsPerUnit = context.pixelScale * scale;
+		if (!context.orthographic) {
+			// distance to the closest point of the bounding sphere
+			glm::vec3 center = glm::vec3(modelMatrix * glm::vec4((bounds.min + bounds.max) * 0.5f, 1.0f));
+			float radius = glm::length(bounds.max - bounds.min) * 0.5f * scale;
+			float distance = std::fmax(glm::length(center - context.viewPosition) - radius, 0.1f);
+			pixelsPerUnit /= distance;
+		}
+
+		size_t lod = 0;
+		while (lod + 1 < lods.size() && levels[lod + 1].error * pixelsPerUnit <= context.lodErrorPixels) {
+			lod++;
+		}
+		return lod;
+	}
+
+	void Mesh::bindForDraw(gps::Shader& shader)
 	{
 		shader.useShaderProgram();
 
-		//set textures
+		//set textures, on the units the shader gave their samplers
+		GLState& state = GLState::GetShared();
 		for (GLuint i = 0; i < textures.size(); i++)
 		{
-			glActiveTexture(GL_TEXTURE0 + i);
-			glUniform1i(glGetUniformLocation(shader.shaderProgram, this->textures[i].type.c_str()), i);
-			glBindTexture(GL_TEXTURE_2D, this->textures[i].id);
-		}
-
-		glBindVertexArray(this->buffers.VAO);
-		glDrawElements(GL_TRIANGLES, this->indices.size(), GL_UNSIGNED_INT, 0);
-		glBindVertexArray(0);
-
-        for(GLuint i = 0; i < this->textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i);
-            glBindTexture(GL_TEXTURE_2D, 0);
-        }
-
-    }
-
-	// Initializes all the buffer objects/arrays
-	void Mesh::setupMesh(){
-		// Create buffers/arrays
-		glGenVertexArrays(1, &this->buffers.VAO);
-		glGenBuffers(1, &this->buffers.VBO);
-		glGenBuffers(1, &this->buffers.EBO);
-
-		glBindVertexArray(this->buffers.VAO);
-		// Load data into vertex buffers
-		glBindBuffer(GL_ARRAY_BUFFER, this->buffers.VBO);
-		glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STATIC_DRAW);
-
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->buffers.EBO);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, this->indices.size() * sizeof(GLuint), &this->indices[0], GL_STATIC_DRAW);
-
-		// Set the vertex attribute pointers
-		// Vertex Positions
-		glEnableVertexAttribArray(0);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
-		// Vertex Normals
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, Normal));
-		// Vertex Texture Coords
-		glEnableVertexAttribArray(2);
-		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, TexCoords));
-
-		glBindVertexArray(0);
+			GLint unit = shader.getSamplerUnit(this->textures[i].type);
+			if (unit < 0) {
+				continue;
+			}
+			state.BindTexture((GLuint)unit, GL_TEXTURE_2D, this->textures[i].handle->id);
+		}
+
+		// packed positions are rescaled by the instance transform, only the normals need the shader
+		shader.setInt("packedNormals", format == VERTEX_FORMAT_PACKED);
+
+		// the bindings stay, the next mesh overwrites only what differs
+		GeometryPool::GetShared().BindVertexArray(format);
+	}
+
+	void Mesh::GetSectionRange(size_t section, size_t lod, GLuint& count, GLuint& firstIndex)
+	{
+		if (sections.empty()) {
+			getLodRange(lod, count, firstIndex);
+			return;
+		}
+		const MeshLod& range = sections[section].lods[std::min(lod, MAX_LOD_LEVELS - 1)];
+		count = range.indexCount;
+		firstIndex = geometry.firstIndex + range.indexOffset;
+	}
+
+	void Mesh::getLodRange(size_t lod, GLuint& count, GLuint& firstIndex)
+	{
+		count = geometry.indexCount;
+		firstIndex = geometry.firstIndex;
+		if (lod < lods.size()) {
+			count = lods[lod].indexCount;
+			firstIndex += lods[lod].indexOffset;
+		}
+	}
+
+	void Mesh::setInstance(const InstanceData& instance)
+	{
+		// a disabled attribute array reads the attribute's current value instead
+		GeometryPool::GetShared().BindInstances(format, 0, 0);
+		glm::mat4 model = instance.Model * GetVertexTransform();
+		for (GLuint column = 0; column < 4; column++) {
+			glVertexAttrib4fv(INSTANCE_ATTRIBUTE_LOCATION + column, &model[column][0]);
+		}
+		for (GLuint column = 0; column < 3; column++) {
+			glVertexAttrib3fv(INSTANCE_ATTRIBUTE_LOCATION + 4 + column, &instance.NormalMatrix[column][0]);
+		}
+	}
+
+	void Mesh::Draw(gps::Shader& shader, size_t lod, const InstanceData& instance)
+	{
+		bindForDraw(shader);
+		setInstance(instance);
+
+		GLuint count, firstIndex;
+		getLodRange(lod, count, firstIndex);
+		glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)count, GL_UNSIGNED_INT, (GLvoid*)(firstIndex * sizeof(GLuint)), geometry.baseVertex);
+	}
+
+	void Mesh::DrawSection(gps::Shader& shader, size_t section, size_t lod, const InstanceData& instance)
+	{
+		bindForDraw(shader);
+		setInstance(instance);
+
+		GLuint count, firstIndex;
+		GetSectionRange(section, lod, count, firstIndex);
+		glDrawElementsBaseVertex(GL_TRIANGLES, (GLsizei)count, GL_UNSIGNED_INT, (GLvoid*)(firstIndex * sizeof(GLuint)), geometry.baseVertex);
+	}
+
+	void Mesh::DrawInstanced(gps::Shader& shader, GLuint count, GLuint firstIndex, GLuint instanceBuffer, GLintptr offset, GLsizei instanceCount)
+	{
+		bindForDraw(shader);
+
+		// GL 4.1 has no base instance, so the attributes are pointed at the batch's first instance
+		GeometryPool::GetShared().BindInstances(format, instanceBuffer, offset);
+
+		glDrawElementsInstancedBaseVertex(GL_TRIANGLES, (GLsizei)count, GL_UNSIGNED_INT, (GLvoid*)(firstIndex * sizeof(GLuint)),
+			instanceCount, geometry.baseVertex);
+	}
+
+	DrawElementsIndirectCommand Mesh::GetDrawCommand(GLuint count, GLuint firstIndex, GLuint instanceCount, GLuint baseInstance)
+	{
+		DrawElementsIndirectCommand command;
+		command.count = count;
+		command.firstIndex = firstIndex;
+		command.instanceCount = instanceCount;
+		command.baseVertex = geometry.baseVertex;
+		command.baseInstance = baseInstance;
+		return command;
+	}
+
+	void Mesh::DrawIndirect(gps::Shader& shader, GLuint instanceBuffer, GLintptr commandOffset, GLsizei commandCount)
+	{
+		bindForDraw(shader);
+
+		// every command names its first instance, the attributes stay at the start of the buffer
+		GeometryPool::GetShared().BindInstances(format, instanceBuffer, 0);
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid*)commandOffset, commandCount, 0);
+	}
+
+	// Copies the vertices and indices into the geometry pool
+	void Mesh::setupMesh(const void* vertexData, size_t vertexCount, const GLuint* indexData, size_t indexCount){
+		this->geometry = GeometryPool::GetShared().Allocate(format, vertexData, vertexCount, indexData, indexCount);
 	}
 }
@@ -4,14 +4,22 @@
 #include <GL/glew.h>
 #include "glm/glm.hpp"
 
+#include "Frustum.hpp"
+#include "GeometryPool.hpp"
 #include "Shader.hpp"
 
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
 
 namespace gps {
 
+// shared GPU texture, see ResourceRegistry
+struct TextureRecord;
+typedef std::shared_ptr<TextureRecord> TextureHandle;
+
 struct Vertex
 {
     glm::vec3 Position;
@@ -19,9 +27,34 @@ struct Vertex
     glm::vec2 TexCoords;
 };
 
+// 16 byte alternative to Vertex: the position is quantized against the mesh bounds,
+// the normal octahedrally encoded and the texture coordinates stored as half floats
+struct PackedVertex
+{
+    GLushort Position[4]; // unorm16, w is padding
+    GLshort Normal[2];    // snorm16
+    GLushort TexCoords[2];
+};
+
+// Per instance attributes of every draw: the model matrix at locations 3-6 and
+// its normal matrix at 7-9, both to world space
+struct InstanceData
+{
+    // for the instanced draws of a mesh, times its GetVertexTransform
+    glm::mat4 Model;
+    // inverse transpose of the upper 3x3 of the model matrix alone
+    glm::mat3 NormalMatrix;
+};
+
+const GLuint INSTANCE_ATTRIBUTE_LOCATION = 3;
+const GLuint INSTANCE_ATTRIBUTE_COUNT = 7;
+
+// The instance placed by model
+InstanceData MakeInstance(const glm::mat4& model);
+
 struct Texture
 {
-    GLuint id;
+    TextureHandle handle;
     //ambientTexture, diffuseTexture, specularTexture
     std::string type;
     std::string path;
@@ -34,31 +67,151 @@ struct Material
         glm::vec3 specular;
     };
 
-struct Buffers {
-    GLuint VAO;
-    GLuint VBO;
-    GLuint EBO;
+struct BoundingBox {
+    glm::vec3 min;
+    glm::vec3 max;
 };
 
+// Sphere around the same center as the mesh's BoundingBox, usually tighter than its corners
+struct BoundingSphere {
+    glm::vec3 center;
+    float radius;
+};
+
+// Levels of detail built per mesh, the full resolution one included
+const size_t MAX_LOD_LEVELS = 4;
+
+// One level of detail: a range of the index buffer over the shared vertices
+struct MeshLod {
+    GLuint indexOffset;
+    GLuint indexCount;
+    // how far (in model units) the surface moved from the full resolution mesh
+    float error;
+};
+
+// Part of a merged mesh that came from one source shape, levels of detail are selected
+// and drawn per section so a merged mesh keeps the granularity of its shapes
+struct MeshSection {
+    BoundingBox bounds;
+    BoundingSphere sphere;
+    // the shape's range inside each level of the merged mesh
+    MeshLod lods[MAX_LOD_LEVELS];
+};
+
+// What the LOD selection and culling need to know about the pass being drawn
+struct DrawContext {
+    glm::vec3 viewPosition;
+    // pixels covered by one world unit at distance 1, or at any distance when orthographic
+    float pixelScale;
+    bool orthographic;
+    // projected error (in pixels) a level may have, larger values pick coarser levels
+    float lodErrorPixels;
+    // meshes outside frustum are skipped when cull is set
+    bool cull;
+    Frustum frustum;
+};
+
+// CPU side data of a mesh, filled in by the loaders before the GL upload
+struct MeshData {
+    VertexFormat format;
+    // vertices for VERTEX_FORMAT_FLOAT, packedVertices for VERTEX_FORMAT_PACKED
+    std::vector<Vertex> vertices;
+    std::vector<PackedVertex> packedVertices;
+    // every level of detail, the full resolution one first
+    std::vector<GLuint> indices;
+    std::vector<MeshLod> lods;
+    // source shapes of a merged mesh, empty when it holds a single shape
+    std::vector<MeshSection> sections;
+    // texture references (type and path only, the handle is assigned on upload)
+    std::vector<Texture> textures;
+    BoundingBox bounds;
+    BoundingSphere sphere;
+    // content hash of the vertex and index data
+    uint64_t geometryHash;
+};
+
+// Computes the axis aligned bounding box of the vertices
+BoundingBox ComputeBounds(const Vertex* vertices, size_t vertexCount);
+
+// Smallest sphere around the center of bounds that holds all the vertices
+BoundingSphere ComputeSphere(const Vertex* vertices, size_t vertexCount, const BoundingBox& bounds);
+
+// Packs the vertices against bounds, fails if the texture coordinates would lose more
+// than half a texel of a 1024 texture as half floats (e.g. tiled UVs)
+bool PackVertices(const Vertex* vertices, size_t vertexCount, const BoundingBox& bounds, std::vector<PackedVertex>& packed);
+
 class Mesh
 {
 public:
     std::vector<Vertex> vertices;
     std::vector<GLuint> indices;
     std::vector<Texture> textures;
+    BoundingBox bounds;
+    BoundingSphere sphere;
+    // source shapes merged into this mesh, empty for a single shape
+    std::vector<MeshSection> sections;
+
+	Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures,
+		std::vector<MeshLod> lods = std::vector<MeshLod>());
+
+	// Uploads the arrays directly (e.g. from a mapped mesh cache) without keeping a CPU copy,
+	// vertices are Vertex or PackedVertex depending on format, lods index into indices
+	Mesh(const void* vertices, VertexFormat format, size_t vertexCount, const GLuint* indices, size_t indexCount,
+		std::vector<MeshLod> lods, std::vector<Texture> textures, BoundingBox bounds, BoundingSphere sphere);
 
-	Mesh(std::vector<Vertex> vertices, std::vector<GLuint> indices, std::vector<Texture> textures);
+	// Where the vertices and indices live in the GeometryPool
+	GeometryRange getGeometry();
 
-	Buffers getBuffers();
+	// Maps the stored vertex positions to model space, identity unless they are packed
+	glm::mat4 GetVertexTransform();
 
-	void Draw(gps::Shader shader);
+	void Draw(gps::Shader& shader);
+
+	// Draws one copy of a level of detail (0 is the full resolution mesh) placed by instance
+	void Draw(gps::Shader& shader, size_t lod, const InstanceData& instance);
+
+	// Draws one copy of a section at a level of detail placed by instance
+	void DrawSection(gps::Shader& shader, size_t section, size_t lod, const InstanceData& instance);
+
+	// Draws instanceCount copies of an index range (see GetSectionRange) in one call, their
+	// InstanceData (already times GetVertexTransform) read from instanceBuffer starting at offset
+	void DrawInstanced(gps::Shader& shader, GLuint count, GLuint firstIndex, GLuint instanceBuffer, GLintptr offset, GLsizei instanceCount);
+
+	// The indirect command drawing instanceCount copies of an index range, starting at
+	// baseInstance of the instance buffer
+	DrawElementsIndirectCommand GetDrawCommand(GLuint count, GLuint firstIndex, GLuint instanceCount, GLuint baseInstance);
+
+	// Runs commandCount commands from the bound GL_DRAW_INDIRECT_BUFFER with this mesh's
+	// textures. The commands may draw any mesh of the same vertex format and material
+	void DrawIndirect(gps::Shader& shader, GLuint instanceBuffer, GLintptr commandOffset, GLsizei commandCount);
+
+	// The merged shapes, or one section covering the whole mesh when it holds a single shape
+	size_t GetSectionCount();
+	const BoundingBox& GetSectionBounds(size_t section);
+	const BoundingSphere& GetSectionSphere(size_t section);
+
+	// Coarsest level of a section whose error projects to at most context.lodErrorPixels
+	size_t SelectLod(const glm::mat4& modelMatrix, const DrawContext& context, size_t section);
+
+	// Index range of a section at a level, in indices from the start of the pool's index buffer.
+	// The sections of a level are back to back in section order
+	void GetSectionRange(size_t section, size_t lod, GLuint& count, GLuint& firstIndex);
 
 private:
     /*  Render data  */
-    Buffers buffers;
-
-	// Initializes all the buffer objects/arrays
-	void setupMesh();
+    GeometryRange geometry;
+    VertexFormat format;
+    std::vector<MeshLod> lods;
+
+	// Copies the vertices and indices into the geometry pool
+	void setupMesh(const void* vertexData, size_t vertexCount, const GLuint* indexData, size_t indexCount);
+
+	// Binds the textures, the normal decoding uniform and the format's vertex array
+	void bindForDraw(gps::Shader& shader);
+	// Index range of a level, in indices from the start of the pool's index buffer
+	void getLodRange(size_t lod, GLuint& count, GLuint& firstIndex);
+	// Feeds a single instance to a non-instanced draw
+	void setInstance(const InstanceData& instance);
 
 };
 
@@ -0,0 +1,313 @@
+#include "MeshCache.hpp"
+#include "Hash.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+namespace gps {
+
+    struct MeshCacheHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint64_t sourceHash;
+        uint32_t meshCount;
+        uint32_t options;
+    };
+
+    struct MeshCacheEntry {
+        uint64_t vertexOffset;
+        uint64_t indexOffset;
+        uint64_t textureOffset;
+        uint64_t lodOffset;
+        uint64_t sectionOffset;
+        uint64_t geometryHash;
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t textureCount;
+        float boundsMin[3];
+        float boundsMax[3];
+        uint32_t vertexFormat;
+        uint32_t lodCount;
+        uint32_t sectionCount;
+        // the sphere is centered on the bounds
+        float sphereRadius;
+    };
+
+    static const char MESH_CACHE_MAGIC[4] = { 'G', 'P', 'S', 'M' };
+
+    // array data starts on 16 byte boundaries so the mapped pointers are well aligned
+    static uint64_t AlignOffset(uint64_t offset)
+    {
+        return (offset + 15) & ~(uint64_t)15;
+    }
+
+    static void WritePadding(FILE* file, uint64_t& offset)
+    {
+        static const unsigned char zeros[16] = { 0 };
+        uint64_t aligned = AlignOffset(offset);
+        fwrite(zeros, 1, (size_t)(aligned - offset), file);
+        offset = aligned;
+    }
+
+    std::string MeshCache::GetCachePath(const std::string& sourceFile)
+    {
+        return sourceFile + ".gpsmesh";
+    }
+
+    bool MeshCache::Open(const std::string& sourceFile, uint32_t options)
+    {
+        Close();
+
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!GetFileStamp(sourceFile, sourceSize, sourceTime)) {
+            return false;
+        }
+
+        if (!file.Open(GetCachePath(sourceFile))) {
+            return false;
+        }
+
+        const unsigned char* data = file.GetData();
+        size_t size = file.GetSize();
+        const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(data);
+
+        // cheap checks first, the content hash only when size and mtime still match
+        uint64_t sourceHash;
+        if (size < sizeof(MeshCacheHeader) ||
+            memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0 ||
+            header->version != MESH_CACHE_VERSION ||
+            header->options != options ||
+            header->sourceSize != sourceSize ||
+            header->sourceTime != sourceTime ||
+            size < sizeof(MeshCacheHeader) + header->meshCount * sizeof(MeshCacheEntry) ||
+            !HashFile(sourceFile, sourceHash) ||
+            header->sourceHash != sourceHash) {
+            Close();
+            return false;
+        }
+
+        // reject truncated files instead of reading past the mapping
+        const MeshCacheEntry* entries = reinterpret_cast<const MeshCacheEntry*>(data + sizeof(MeshCacheHeader));
+        for (uint32_t i = 0; i < header->meshCount; i++) {
+            if ((entries[i].vertexFormat != VERTEX_FORMAT_FLOAT && entries[i].vertexFormat != VERTEX_FORMAT_PACKED) ||
+                entries[i].vertexOffset + (uint64_t)entries[i].vertexCount * GetVertexSize((VertexFormat)entries[i].vertexFormat) > size ||
+                entries[i].indexOffset + (uint64_t)entries[i].indexCount * sizeof(GLuint) > size ||
+                entries[i].lodOffset + (uint64_t)entries[i].lodCount * sizeof(MeshLod) > size ||
+                entries[i].sectionOffset + (uint64_t)entries[i].sectionCount * sizeof(MeshSection) > size ||
+                entries[i].textureOffset > size) {
+                Close();
+                return false;
+            }
+
+            // texture references: both lengths, then both strings, all inside the file
+            uint64_t cursor = entries[i].textureOffset;
+            for (uint32_t t = 0; t < entries[i].textureCount; t++) {
+                uint32_t lengths[2];
+                if (size - cursor < sizeof(lengths)) {
+                    Close();
+                    return false;
+                }
+                memcpy(lengths, data + cursor, sizeof(lengths));
+                cursor += sizeof(lengths);
+                if (size - cursor < (uint64_t)lengths[0] + lengths[1]) {
+                    Close();
+                    return false;
+                }
+                cursor += (uint64_t)lengths[0] + lengths[1];
+            }
+
+            // every level must stay inside the index array
+            const MeshLod* lods = reinterpret_cast<const MeshLod*>(data + entries[i].lodOffset);
+            for (uint32_t l = 0; l < entries[i].lodCount; l++) {
+                if ((uint64_t)lods[l].indexOffset + lods[l].indexCount > entries[i].indexCount) {
+                    Close();
+                    return false;
+                }
+            }
+            const MeshSection* sections = reinterpret_cast<const MeshSection*>(data + entries[i].sectionOffset);
+            for (uint32_t c = 0; c < entries[i].sectionCount; c++) {
+                for (size_t l = 0; l < MAX_LOD_LEVELS; l++) {
+                    if ((uint64_t)sections[c].lods[l].indexOffset + sections[c].lods[l].indexCount > entries[i].indexCount) {
+                        Close();
+                        return false;
+                    }
+                }
+            }
+        }
+
+        meshCount = header->meshCount;
+        return true;
+    }
+
+    void MeshCache::Close()
+    {
+        file.Close();
+        meshCount = 0;
+    }
+
+    size_t MeshCache::GetMeshCount()
+    {
+        return meshCount;
+    }
+
+    CachedMesh MeshCache::GetMesh(size_t index)
+    {
+        const unsigned char* data = file.GetData();
+        const MeshCacheEntry* entry = reinterpret_cast<const MeshCacheEntry*>(data + sizeof(MeshCacheHeader)) + index;
+
+        CachedMesh mesh;
+        mesh.format = (VertexFormat)entry->vertexFormat;
+        mesh.vertices = data + entry->vertexOffset;
+        mesh.vertexCount = entry->vertexCount;
+        mesh.indices = reinterpret_cast<const GLuint*>(data + entry->indexOffset);
+        mesh.indexCount = entry->indexCount;
+        const MeshLod* lods = reinterpret_cast<const MeshLod*>(data + entry->lodOffset);
+        mesh.lods.assign(lods, lods + entry->lodCount);
+        const MeshSection* sections = reinterpret_cast<const MeshSection*>(data + entry->sectionOffset);
+        mesh.sections.assign(sections, sections + entry->sectionCount);
+        mesh.bounds.min = glm::vec3(entry->boundsMin[0], entry->boundsMin[1], entry->boundsMin[2]);
+        mesh.bounds.max = glm::vec3(entry->boundsMax[0], entry->boundsMax[1], entry->boundsMax[2]);
+        mesh.sphere.center = (mesh.bounds.min + mesh.bounds.max) * 0.5f;
+        mesh.sphere.radius = entry->sphereRadius;
+        mesh.geometryHash = entry->geometryHash;
+
+        // texture references: type length, path length, then both strings
+        const unsigned char* cursor = data + entry->textureOffset;
+        for (uint32_t i = 0; i < entry->textureCount; i++) {
+            uint32_t lengths[2];
+            memcpy(lengths, cursor, sizeof(lengths));
+            cursor += sizeof(lengths);
+
+            CachedTexture texture;
+            texture.type.assign(reinterpret_cast<const char*>(cursor), lengths[0]);
+            cursor += lengths[0];
+            texture.path.assign(reinterpret_cast<const char*>(cursor), lengths[1]);
+            cursor += lengths[1];
+            mesh.textures.push_back(texture);
+        }
+
+        return mesh;
+    }
+
+    bool MeshCache::Write(const std::string& sourceFile, const std::vector<gps::MeshData>& meshes, uint32_t options)
+    {
+        MeshCacheHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+        header.version = MESH_CACHE_VERSION;
+        header.meshCount = (uint32_t)meshes.size();
+        header.options = options;
+        if (!GetFileStamp(sourceFile, header.sourceSize, header.sourceTime) ||
+            !HashFile(sourceFile, header.sourceHash)) {
+            return false;
+        }
+
+        // lay out the data blocks behind the header and the entry table
+        std::vector<MeshCacheEntry> entries(meshes.size());
+        uint64_t offset = sizeof(MeshCacheHeader) + meshes.size() * sizeof(MeshCacheEntry);
+        for (size_t i = 0; i < meshes.size(); i++) {
+            const gps::MeshData& mesh = meshes[i];
+            MeshCacheEntry& entry = entries[i];
+            memset(&entry, 0, sizeof(entry));
+
+            entry.vertexFormat = mesh.format;
+            entry.vertexCount = (uint32_t)(mesh.format == VERTEX_FORMAT_PACKED ? mesh.packedVertices.size() : mesh.vertices.size());
+            entry.indexCount = (uint32_t)mesh.indices.size();
+            entry.lodCount = (uint32_t)mesh.lods.size();
+            entry.sectionCount = (uint32_t)mesh.sections.size();
+            entry.textureCount = (uint32_t)mesh.textures.size();
+            entry.geometryHash = mesh.geometryHash;
+            for (int k = 0; k < 3; k++) {
+                entry.boundsMin[k] = mesh.bounds.min[k];
+                entry.boundsMax[k] = mesh.bounds.max[k];
+            }
+            entry.sphereRadius = mesh.sphere.radius;
+
+            offset = AlignOffset(offset);
+            entry.vertexOffset = offset;
+            offset += entry.vertexCount * GetVertexSize(mesh.format);
+
+            offset = AlignOffset(offset);
+            entry.indexOffset = offset;
+            offset += mesh.indices.size() * sizeof(GLuint);
+
+            entry.lodOffset = offset;
+            offset += mesh.lods.size() * sizeof(MeshLod);
+
+            entry.sectionOffset = offset;
+            offset += mesh.sections.size() * sizeof(MeshSection);
+
+            entry.textureOffset = offset;
+            for (size_t t = 0; t < mesh.textures.size(); t++) {
+                offset += 2 * sizeof(uint32_t) + mesh.textures[t].type.size() + mesh.textures[t].path.size();
+            }
+        }
+
+        // write to a temporary file first so a crash never leaves a half written cache
+        std::string cachePath = GetCachePath(sourceFile);
+        std::string tempPath = cachePath + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file) {
+            fprintf(stderr, "WARNING: could not write mesh cache %s\n", cachePath.c_str());
+            return false;
+        }
+
+        fwrite(&header, sizeof(header), 1, file);
+        if (!entries.empty()) {
+            fwrite(entries.data(), sizeof(MeshCacheEntry), entries.size(), file);
+        }
+
+        offset = sizeof(MeshCacheHeader) + meshes.size() * sizeof(MeshCacheEntry);
+        for (size_t i = 0; i < meshes.size(); i++) {
+            const gps::MeshData& mesh = meshes[i];
+
+            WritePadding(file, offset);
+            if (mesh.format == VERTEX_FORMAT_PACKED) {
+                fwrite(mesh.packedVertices.data(), sizeof(PackedVertex), mesh.packedVertices.size(), file);
+            }
+            else {
+                fwrite(mesh.vertices.data(), sizeof(Vertex), mesh.vertices.size(), file);
+            }
+            offset += entries[i].vertexCount * GetVertexSize(mesh.format);
+
+            WritePadding(file, offset);
+            fwrite(mesh.indices.data(), sizeof(GLuint), mesh.indices.size(), file);
+            offset += mesh.indices.size() * sizeof(GLuint);
+
+            if (!mesh.lods.empty()) {
+                fwrite(mesh.lods.data(), sizeof(MeshLod), mesh.lods.size(), file);
+            }
+            offset += mesh.lods.size() * sizeof(MeshLod);
+
+            if (!mesh.sections.empty()) {
+                fwrite(mesh.sections.data(), sizeof(MeshSection), mesh.sections.size(), file);
+            }
+            offset += mesh.sections.size() * sizeof(MeshSection);
+
+            for (size_t t = 0; t < mesh.textures.size(); t++) {
+                uint32_t lengths[2] = { (uint32_t)mesh.textures[t].type.size(), (uint32_t)mesh.textures[t].path.size() };
+                fwrite(lengths, sizeof(lengths), 1, file);
+                fwrite(mesh.textures[t].type.data(), 1, lengths[0], file);
+                fwrite(mesh.textures[t].path.data(), 1, lengths[1], file);
+                offset += sizeof(lengths) + lengths[0] + lengths[1];
+            }
+        }
+
+        bool ok = !ferror(file);
+        fclose(file);
+
+        remove(cachePath.c_str());
+        if (!ok || rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+            remove(tempPath.c_str());
+            fprintf(stderr, "WARNING: could not write mesh cache %s\n", cachePath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+}
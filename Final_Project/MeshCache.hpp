@@ -0,0 +1,73 @@
+#ifndef MeshCache_hpp
+#define MeshCache_hpp
+
+#include "Mesh.hpp"
+#include "MappedFile.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gps {
+
+    // bump whenever the layout of the cached vertex/index data changes
+    const uint32_t MESH_CACHE_VERSION = 7;
+
+    // load options that change the cached data, a cache is only used with the options it was written with
+    enum MeshLoadOptions {
+        // vertex cache, overdraw and vertex fetch reordering, see MeshOptimizer
+        MESH_OPTION_OPTIMIZE = 1,
+        // PackedVertex for every mesh whose texture coordinates fit in half floats
+        MESH_OPTION_QUANTIZE = 2,
+        // simplified index ranges for distance based selection, see MeshSimplifier
+        MESH_OPTION_LODS = 4,
+        // one mesh per material, the shapes kept as sections
+        MESH_OPTION_MERGE = 8
+    };
+
+    struct CachedTexture {
+        std::string type;
+        std::string path;
+    };
+
+    // View of one mesh inside a mapped cache file
+    struct CachedMesh {
+        // Vertex or PackedVertex array depending on format
+        VertexFormat format;
+        const void* vertices;
+        size_t vertexCount;
+        const GLuint* indices;
+        size_t indexCount;
+        // levels of detail inside indices, empty for a single level
+        std::vector<MeshLod> lods;
+        std::vector<MeshSection> sections;
+        BoundingBox bounds;
+        BoundingSphere sphere;
+        uint64_t geometryHash;
+        std::vector<CachedTexture> textures;
+    };
+
+    // Versioned binary sidecar holding the final mesh arrays of a model,
+    // invalidated when the source size, mtime or content hash changes
+    class MeshCache
+    {
+    public:
+        // Maps the sidecar of sourceFile, fails if it is missing, stale or written with other options
+        bool Open(const std::string& sourceFile, uint32_t options);
+        void Close();
+
+        size_t GetMeshCount();
+        CachedMesh GetMesh(size_t index);
+
+        // Writes the sidecar for sourceFile from the loaded mesh data
+        static bool Write(const std::string& sourceFile, const std::vector<gps::MeshData>& meshes, uint32_t options);
+        static std::string GetCachePath(const std::string& sourceFile);
+
+    private:
+        MappedFile file;
+        size_t meshCount;
+    };
+
+}
+
+#endif /* MeshCache_hpp */
@@ -0,0 +1,283 @@
+#include "MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace gps {
+
+    // Forsyth's scoring: the cache it models is larger than the FIFO used for the stats,
+    // which keeps the ordering good across hardware
+    const int FORSYTH_CACHE_SIZE = 32;
+    const float FORSYTH_CACHE_DECAY_POWER = 1.5f;
+    const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75f;
+    const float FORSYTH_VALENCE_BOOST_SCALE = 2.0f;
+    const float FORSYTH_VALENCE_BOOST_POWER = 0.5f;
+
+    VertexCacheStats AnalyzeVertexCache(const std::vector<GLuint>& indices, size_t vertexCount, unsigned cacheSize)
+    {
+        VertexCacheStats stats;
+        stats.acmr = 0.0f;
+        stats.atvr = 0.0f;
+        if (indices.size() < 3) {
+            return stats;
+        }
+
+        // a vertex is still cached while fewer than cacheSize misses happened after its own
+        std::vector<unsigned> cacheTime(vertexCount, 0);
+        std::vector<char> used(vertexCount, 0);
+        unsigned now = cacheSize + 1;
+        size_t misses = 0;
+        size_t usedCount = 0;
+        for (size_t i = 0; i < indices.size(); i++) {
+            GLuint v = indices[i];
+            if (now - cacheTime[v] > cacheSize) {
+                cacheTime[v] = now++;
+                misses++;
+            }
+            if (!used[v]) {
+                used[v] = 1;
+                usedCount++;
+            }
+        }
+
+        stats.acmr = (float)misses / (indices.size() / 3);
+        stats.atvr = (float)misses / usedCount;
+        return stats;
+    }
+
+    static float VertexScore(int cachePosition, unsigned remainingTriangles)
+    {
+        if (remainingTriangles == 0) {
+            return -1.0f;
+        }
+
+        float score = 0.0f;
+        if (cachePosition >= 0) {
+            if (cachePosition < 3) {
+                // used by the last triangle, a fixed score so it isn't reused straight away
+                score = FORSYTH_LAST_TRIANGLE_SCORE;
+            }
+            else {
+                float scale = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+                score = powf(1.0f - (cachePosition - 3) * scale, FORSYTH_CACHE_DECAY_POWER);
+            }
+        }
+
+        // vertices with few triangles left are finished first, so they leave the working set
+        score += FORSYTH_VALENCE_BOOST_SCALE * powf((float)remainingTriangles, -FORSYTH_VALENCE_BOOST_POWER);
+        return score;
+    }
+
+    void OptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount < 2 || indices.size() % 3 != 0) {
+            return;
+        }
+
+        // triangles of each vertex, the ones not emitted yet are kept at the front of its range
+        std::vector<unsigned> remaining(vertexCount, 0);
+        for (size_t i = 0; i < indices.size(); i++) {
+            remaining[indices[i]]++;
+        }
+        std::vector<size_t> offsets(vertexCount + 1, 0);
+        for (size_t v = 0; v < vertexCount; v++) {
+            offsets[v + 1] = offsets[v] + remaining[v];
+        }
+        std::vector<unsigned> adjacency(indices.size());
+        std::vector<size_t> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < indices.size(); i++) {
+            adjacency[fill[indices[i]]++] = (unsigned)(i / 3);
+        }
+
+        std::vector<int> cachePosition(vertexCount, -1);
+        std::vector<float> vertexScore(vertexCount);
+        for (size_t v = 0; v < vertexCount; v++) {
+            vertexScore[v] = VertexScore(-1, remaining[v]);
+        }
+
+        std::vector<char> emitted(triangleCount, 0);
+        std::vector<GLuint> output;
+        output.reserve(indices.size());
+
+        GLuint cache[FORSYTH_CACHE_SIZE + 3];
+        int cacheCount = 0;
+        size_t nextUnemitted = 0;
+        long long bestTriangle = -1;
+
+        while (output.size() < indices.size()) {
+            if (bestTriangle < 0) {
+                // nothing in the cache leads anywhere, continue with the next unused triangle
+                while (emitted[nextUnemitted]) {
+                    nextUnemitted++;
+                }
+                bestTriangle = (long long)nextUnemitted;
+            }
+
+            size_t t = (size_t)bestTriangle;
+            const GLuint* triangle = &indices[3 * t];
+            emitted[t] = 1;
+            output.insert(output.end(), triangle, triangle + 3);
+
+            for (int k = 0; k < 3; k++) {
+                GLuint v = triangle[k];
+                unsigned* begin = &adjacency[offsets[v]];
+                unsigned* end = begin + remaining[v];
+                unsigned* found = std::find(begin, end, (unsigned)t);
+                std::swap(*found, *(end - 1));
+                remaining[v]--;
+            }
+
+            // the new triangle goes to the front, the rest of the cache moves down
+            GLuint newCache[FORSYTH_CACHE_SIZE + 3];
+            int newCount = 0;
+            for (int k = 0; k < 3; k++) {
+                newCache[newCount++] = triangle[k];
+            }
+            for (int i = 0; i < cacheCount; i++) {
+                if (cache[i] != triangle[0] && cache[i] != triangle[1] && cache[i] != triangle[2]) {
+                    newCache[newCount++] = cache[i];
+                }
+            }
+
+            for (int i = 0; i < newCount; i++) {
+                GLuint v = newCache[i];
+                cachePosition[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+                vertexScore[v] = VertexScore(cachePosition[v], remaining[v]);
+            }
+
+            // only triangles touching the cache changed their score
+            bestTriangle = -1;
+            float bestScore = -1.0f;
+            for (int i = 0; i < newCount; i++) {
+                GLuint v = newCache[i];
+                for (size_t a = offsets[v]; a < offsets[v] + remaining[v]; a++) {
+                    unsigned candidate = adjacency[a];
+                    float score = vertexScore[indices[3 * candidate]] + vertexScore[indices[3 * candidate + 1]] + vertexScore[indices[3 * candidate + 2]];
+                    if (score > bestScore) {
+                        bestScore = score;
+                        bestTriangle = candidate;
+                    }
+                }
+            }
+
+            cacheCount = std::min(newCount, FORSYTH_CACHE_SIZE);
+            std::copy(newCache, newCache + cacheCount, cache);
+        }
+
+        indices.swap(output);
+    }
+
+    void OptimizeOverdraw(std::vector<GLuint>& indices, const std::vector<Vertex>& vertices, float threshold)
+    {
+        size_t triangleCount = indices.size() / 3;
+        if (triangleCount < 2 || indices.size() % 3 != 0) {
+            return;
+        }
+
+        float meshAcmr = AnalyzeVertexCache(indices, vertices.size()).acmr;
+
+        // clusters end where the cache restarts anyway (all three vertices missed), or as soon
+        // as a cluster drawn from a cold cache would stay within threshold of the mesh ACMR
+        std::vector<size_t> clusterStarts;
+        std::vector<unsigned> cacheTime(vertices.size(), 0);
+        unsigned now = VERTEX_CACHE_SIZE + 1;
+        size_t clusterStart = 0;
+        size_t clusterMisses = 0;
+        clusterStarts.push_back(0);
+        for (size_t t = 0; t < triangleCount; t++) {
+            int misses = 0;
+            for (int k = 0; k < 3; k++) {
+                GLuint v = indices[3 * t + k];
+                if (now - cacheTime[v] > VERTEX_CACHE_SIZE) {
+                    cacheTime[v] = now++;
+                    misses++;
+                }
+            }
+
+            if (misses == 3 && t > clusterStart) {
+                clusterStarts.push_back(t);
+                clusterStart = t;
+                clusterMisses = 0;
+            }
+            clusterMisses += misses;
+
+            if (t + 1 < triangleCount && clusterMisses <= threshold * meshAcmr * (t - clusterStart + 1)) {
+                clusterStarts.push_back(t + 1);
+                clusterStart = t + 1;
+                clusterMisses = 0;
+                now += VERTEX_CACHE_SIZE + 1;
+            }
+        }
+        clusterStarts.push_back(triangleCount);
+
+        // outward facing clusters first: they are the likely occluders
+        glm::vec3 meshCentroid(0.0f);
+        for (size_t v = 0; v < vertices.size(); v++) {
+            meshCentroid += vertices[v].Position;
+        }
+        meshCentroid /= (float)std::max(vertices.size(), (size_t)1);
+
+        size_t clusterCount = clusterStarts.size() - 1;
+        std::vector<float> sortKeys(clusterCount);
+        for (size_t c = 0; c < clusterCount; c++) {
+            glm::vec3 centroid(0.0f);
+            glm::vec3 normal(0.0f);
+            float area = 0.0f;
+            for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; t++) {
+                const glm::vec3& a = vertices[indices[3 * t]].Position;
+                const glm::vec3& b = vertices[indices[3 * t + 1]].Position;
+                const glm::vec3& d = vertices[indices[3 * t + 2]].Position;
+                // the cross product is twice the area, pointing along the face normal
+                glm::vec3 faceNormal = glm::cross(b - a, d - a);
+                float faceArea = glm::length(faceNormal);
+                centroid += (a + b + d) * (faceArea / 3.0f);
+                normal += faceNormal;
+                area += faceArea;
+            }
+
+            float normalLength = glm::length(normal);
+            if (area <= 0.0f || normalLength <= 0.0f) {
+                sortKeys[c] = 0.0f;
+                continue;
+            }
+            centroid /= area;
+            sortKeys[c] = glm::dot(centroid - meshCentroid, normal / normalLength);
+        }
+
+        std::vector<size_t> order(clusterCount);
+        for (size_t c = 0; c < clusterCount; c++) {
+            order[c] = c;
+        }
+        std::stable_sort(order.begin(), order.end(), [&sortKeys](size_t a, size_t b) { return sortKeys[a] > sortKeys[b]; });
+
+        std::vector<GLuint> output;
+        output.reserve(indices.size());
+        for (size_t i = 0; i < clusterCount; i++) {
+            size_t c = order[i];
+            output.insert(output.end(), indices.begin() + 3 * clusterStarts[c], indices.begin() + 3 * clusterStarts[c + 1]);
+        }
+        indices.swap(output);
+    }
+
+    void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<GLuint>& indices)
+    {
+        const GLuint unassigned = (GLuint)-1;
+        std::vector<GLuint> remap(vertices.size(), unassigned);
+        std::vector<Vertex> output;
+        output.reserve(vertices.size());
+
+        // vertices no triangle uses are dropped
+        for (size_t i = 0; i < indices.size(); i++) {
+            GLuint& v = indices[i];
+            if (remap[v] == unassigned) {
+                remap[v] = (GLuint)output.size();
+                output.push_back(vertices[v]);
+            }
+            v = remap[v];
+        }
+
+        vertices.swap(output);
+    }
+
+}
@@ -0,0 +1,37 @@
+#ifndef MeshOptimizer_hpp
+#define MeshOptimizer_hpp
+
+#include "Mesh.hpp"
+
+#include <vector>
+
+namespace gps {
+
+    // Post-transform cache efficiency of an index buffer, measured on a FIFO cache
+    struct VertexCacheStats {
+        // transformed vertices per triangle: 3 is the worst, about 0.5 on large regular grids
+        float acmr;
+        // transformed vertices per vertex: 1 is the best possible
+        float atvr;
+    };
+
+    // FIFO size of typical hardware, used by the simulations below
+    const unsigned VERTEX_CACHE_SIZE = 16;
+
+    VertexCacheStats AnalyzeVertexCache(const std::vector<GLuint>& indices, size_t vertexCount, unsigned cacheSize = VERTEX_CACHE_SIZE);
+
+    // Reorders the triangles for post-transform cache hits (Forsyth's linear-speed
+    // vertex cache optimisation)
+    void OptimizeVertexCache(std::vector<GLuint>& indices, size_t vertexCount);
+
+    // Splits the cache optimized triangles into clusters and draws the outward facing
+    // ones first, threshold bounds the ACMR each cluster may lose (1.05 = 5%)
+    void OptimizeOverdraw(std::vector<GLuint>& indices, const std::vector<Vertex>& vertices, float threshold = 1.05f);
+
+    // Renumbers the vertices in the order the triangles first use them, so the
+    // vertex fetch walks memory linearly
+    void OptimizeVertexFetch(std::vector<Vertex>& vertices, std::vector<GLuint>& indices);
+
+}
+
+#endif /* MeshOptimizer_hpp */
@@ -0,0 +1,346 @@
+#include "MeshSimplifier.hpp"
+#include "MeshOptimizer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+
+namespace gps {
+
+    // Levels that keep more than this share of the previous level are not worth a draw range
+    const float LOD_MIN_REDUCTION = 0.8f;
+    // Collapses never move the surface more than this share of the mesh diagonal
+    const float LOD_MAX_ERROR_SCALE = 0.1f;
+
+    // Sum of squared distances to a set of planes, weighted by triangle area
+    struct Quadric {
+        double a2, b2, c2, ab, ac, bc, ad, bd, cd, d2;
+        double weight;
+    };
+
+    static void AddPlane(Quadric& q, const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2)
+    {
+        glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+        float length = glm::length(normal);
+        if (length <= 0.0f) {
+            return;
+        }
+
+        double area = length * 0.5;
+        double a = normal.x / length;
+        double b = normal.y / length;
+        double c = normal.z / length;
+        double d = -(a * p0.x + b * p0.y + c * p0.z);
+
+        q.a2 += area * a * a; q.b2 += area * b * b; q.c2 += area * c * c;
+        q.ab += area * a * b; q.ac += area * a * c; q.bc += area * b * c;
+        q.ad += area * a * d; q.bd += area * b * d; q.cd += area * c * d;
+        q.d2 += area * d * d;
+        q.weight += area;
+    }
+
+    static void AddQuadric(Quadric& q, const Quadric& other)
+    {
+        q.a2 += other.a2; q.b2 += other.b2; q.c2 += other.c2;
+        q.ab += other.ab; q.ac += other.ac; q.bc += other.bc;
+        q.ad += other.ad; q.bd += other.bd; q.cd += other.cd;
+        q.d2 += other.d2;
+        q.weight += other.weight;
+    }
+
+    // Area weighted sum of squared plane distances at p
+    static double EvaluateQuadric(const Quadric& q, const glm::vec3& p)
+    {
+        double x = p.x, y = p.y, z = p.z;
+        double r = q.a2 * x * x + q.b2 * y * y + q.c2 * z * z
+            + 2.0 * (q.ab * x * y + q.ac * x * z + q.bc * y * z)
+            + 2.0 * (q.ad * x + q.bd * y + q.cd * z)
+            + q.d2;
+        return r > 0.0 ? r : 0.0;
+    }
+
+    struct PositionHash {
+        size_t operator()(const glm::vec3& p) const
+        {
+            uint32_t bits[3];
+            memcpy(bits, &p, sizeof(bits));
+            return (size_t)(bits[0] * 73856093u ^ bits[1] * 19349663u ^ bits[2] * 83492791u);
+        }
+    };
+
+    struct PositionEqual {
+        bool operator()(const glm::vec3& a, const glm::vec3& b) const
+        {
+            return memcmp(&a, &b, sizeof(glm::vec3)) == 0;
+        }
+    };
+
+    static uint64_t EdgeKey(GLuint a, GLuint b)
+    {
+        return ((uint64_t)a << 32) | b;
+    }
+
+    struct Collapse {
+        GLuint from;
+        GLuint to;
+        double error;
+    };
+
+    // Removes triangles that lost an edge to a collapse
+    static void RemoveDegenerate(std::vector<GLuint>& indices)
+    {
+        size_t write = 0;
+        for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+            GLuint a = indices[i], b = indices[i + 1], c = indices[i + 2];
+            if (a != b && b != c && a != c) {
+                indices[write++] = a;
+                indices[write++] = b;
+                indices[write++] = c;
+            }
+        }
+        indices.resize(write);
+    }
+
+    std::vector<GLuint> SimplifyMesh(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices,
+        size_t targetIndexCount, float maxError, float& error)
+    {
+        error = 0.0f;
+        std::vector<GLuint> result(indices);
+        if (indices.size() % 3 != 0 || result.size() <= targetIndexCount) {
+            return result;
+        }
+
+        size_t vertexCount = vertices.size();
+
+        // welding left one vertex per attribute combination: vertices sharing a position
+        // lie on a seam and stay where they are
+        std::unordered_map<glm::vec3, GLuint, PositionHash, PositionEqual> positionIds;
+        std::vector<GLuint> position(vertexCount);
+        std::vector<unsigned> positionUses;
+        for (size_t v = 0; v < vertexCount; v++) {
+            auto inserted = positionIds.insert(std::make_pair(vertices[v].Position, (GLuint)positionUses.size()));
+            if (inserted.second) {
+                positionUses.push_back(0);
+            }
+            position[v] = inserted.first->second;
+            positionUses[position[v]]++;
+        }
+
+        std::vector<char> locked(vertexCount, 0);
+        for (size_t v = 0; v < vertexCount; v++) {
+            locked[v] = positionUses[position[v]] > 1;
+        }
+
+        // edges used once (open borders) or more than twice (non manifold) keep their vertices
+        std::unordered_map<uint64_t, unsigned> edgeUses;
+        for (size_t i = 0; i < result.size(); i += 3) {
+            for (int k = 0; k < 3; k++) {
+                GLuint a = position[result[i + k]];
+                GLuint b = position[result[i + (k + 1) % 3]];
+                edgeUses[EdgeKey(a, b)]++;
+            }
+        }
+        std::vector<char> lockedPosition(positionUses.size(), 0);
+        for (size_t i = 0; i < result.size(); i += 3) {
+            for (int k = 0; k < 3; k++) {
+                GLuint a = position[result[i + k]];
+                GLuint b = position[result[i + (k + 1) % 3]];
+                if (edgeUses[EdgeKey(a, b)] != 1 || edgeUses.count(EdgeKey(b, a)) == 0 || edgeUses[EdgeKey(b, a)] != 1) {
+                    lockedPosition[a] = lockedPosition[b] = 1;
+                }
+            }
+        }
+        for (size_t v = 0; v < vertexCount; v++) {
+            locked[v] |= lockedPosition[position[v]];
+        }
+
+        std::vector<Quadric> quadrics(vertexCount);
+        memset(quadrics.data(), 0, vertexCount * sizeof(Quadric));
+        for (size_t i = 0; i < result.size(); i += 3) {
+            const glm::vec3& p0 = vertices[result[i]].Position;
+            const glm::vec3& p1 = vertices[result[i + 1]].Position;
+            const glm::vec3& p2 = vertices[result[i + 2]].Position;
+            for (int k = 0; k < 3; k++) {
+                AddPlane(quadrics[result[i + k]], p0, p1, p2);
+            }
+        }
+
+        double maxErrorSquared = (double)maxError * maxError;
+        double resultError = 0.0;
+
+        // every pass collapses an independent set of the cheapest edges, then rebuilds
+        while (result.size() > targetIndexCount) {
+            size_t triangleCount = result.size() / 3;
+
+            std::vector<unsigned> triangleOffsets(vertexCount + 1, 0);
+            for (size_t i = 0; i < result.size(); i++) {
+                triangleOffsets[result[i] + 1]++;
+            }
+            for (size_t v = 0; v < vertexCount; v++) {
+                triangleOffsets[v + 1] += triangleOffsets[v];
+            }
+            std::vector<unsigned> vertexTriangles(result.size());
+            std::vector<unsigned> fill(triangleOffsets.begin(), triangleOffsets.end() - 1);
+            for (size_t i = 0; i < result.size(); i++) {
+                vertexTriangles[fill[result[i]]++] = (unsigned)(i / 3);
+            }
+
+            std::vector<uint64_t> edges;
+            edges.reserve(result.size());
+            for (size_t i = 0; i < result.size(); i += 3) {
+                for (int k = 0; k < 3; k++) {
+                    GLuint a = result[i + k];
+                    GLuint b = result[i + (k + 1) % 3];
+                    edges.push_back(EdgeKey(std::min(a, b), std::max(a, b)));
+                }
+            }
+            std::sort(edges.begin(), edges.end());
+            edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+            // the cheaper direction of each edge whose source may move
+            std::vector<Collapse> collapses;
+            collapses.reserve(edges.size());
+            for (size_t e = 0; e < edges.size(); e++) {
+                GLuint a = (GLuint)(edges[e] >> 32);
+                GLuint b = (GLuint)(edges[e] & 0xffffffffu);
+                if (locked[a] && locked[b]) {
+                    continue;
+                }
+
+                Quadric q = quadrics[a];
+                AddQuadric(q, quadrics[b]);
+                double weight = q.weight > 0.0 ? q.weight : 1.0;
+                double errorToB = locked[a] ? -1.0 : EvaluateQuadric(q, vertices[b].Position) / weight;
+                double errorToA = locked[b] ? -1.0 : EvaluateQuadric(q, vertices[a].Position) / weight;
+
+                Collapse collapse;
+                if (errorToA < 0.0 || (errorToB >= 0.0 && errorToB <= errorToA)) {
+                    collapse.from = a;
+                    collapse.to = b;
+                    collapse.error = errorToB;
+                }
+                else {
+                    collapse.from = b;
+                    collapse.to = a;
+                    collapse.error = errorToA;
+                }
+                if (collapse.error <= maxErrorSquared) {
+                    collapses.push_back(collapse);
+                }
+            }
+            std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+            // each collapse of a closed mesh removes two triangles
+            size_t trianglesToRemove = triangleCount - targetIndexCount / 3;
+            size_t removed = 0;
+            size_t applied = 0;
+            std::vector<char> touched(vertexCount, 0);
+
+            for (size_t c = 0; c < collapses.size() && removed < trianglesToRemove; c++) {
+                const Collapse& collapse = collapses[c];
+                GLuint from = collapse.from;
+                GLuint to = collapse.to;
+                if (touched[from] || touched[to]) {
+                    continue;
+                }
+
+                // the triangles that survive must not flip over
+                const glm::vec3& target = vertices[to].Position;
+                bool valid = true;
+                unsigned collapsing = 0;
+                for (unsigned a = triangleOffsets[from]; a < triangleOffsets[from + 1] && valid; a++) {
+                    const GLuint* triangle = &result[3 * vertexTriangles[a]];
+                    if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+                        collapsing++;
+                        continue;
+                    }
+
+                    glm::vec3 p[3];
+                    for (int k = 0; k < 3; k++) {
+                        p[k] = vertices[triangle[k]].Position;
+                    }
+                    glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    for (int k = 0; k < 3; k++) {
+                        if (triangle[k] == from) {
+                            p[k] = target;
+                        }
+                    }
+                    glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    valid = glm::dot(before, after) > 0.0f;
+                }
+                if (!valid) {
+                    continue;
+                }
+
+                // the neighbourhood changes, later collapses this pass would use stale adjacency
+                for (unsigned a = triangleOffsets[from]; a < triangleOffsets[from + 1]; a++) {
+                    GLuint* triangle = &result[3 * vertexTriangles[a]];
+                    for (int k = 0; k < 3; k++) {
+                        touched[triangle[k]] = 1;
+                        if (triangle[k] == from) {
+                            triangle[k] = to;
+                        }
+                    }
+                }
+
+                AddQuadric(quadrics[to], quadrics[from]);
+                resultError = std::max(resultError, collapse.error);
+                removed += collapsing;
+                applied++;
+            }
+
+            RemoveDegenerate(result);
+            if (applied == 0) {
+                break;
+            }
+        }
+
+        error = (float)sqrt(resultError);
+        return result;
+    }
+
+    void BuildLods(const std::vector<Vertex>& vertices, std::vector<GLuint>& indices, std::vector<MeshLod>& lods)
+    {
+        lods.clear();
+        MeshLod full;
+        full.indexOffset = 0;
+        full.indexCount = (GLuint)indices.size();
+        full.error = 0.0f;
+        lods.push_back(full);
+
+        if (indices.size() < 3 || indices.size() % 3 != 0) {
+            return;
+        }
+
+        BoundingBox bounds = ComputeBounds(vertices.data(), vertices.size());
+        float maxError = glm::length(bounds.max - bounds.min) * LOD_MAX_ERROR_SCALE;
+
+        // every level starts over from the full mesh, so its error is measured against it
+        std::vector<GLuint> source(indices);
+        size_t previousCount = source.size();
+        float previousError = 0.0f;
+        for (size_t level = 1; level < MAX_LOD_LEVELS; level++) {
+            size_t target = (source.size() / 3 >> level) * 3;
+            float error;
+            std::vector<GLuint> simplified = SimplifyMesh(vertices, source, target, maxError, error);
+            if (simplified.empty() || simplified.size() > previousCount * LOD_MIN_REDUCTION) {
+                break;
+            }
+
+            OptimizeVertexCache(simplified, vertices.size());
+
+            MeshLod lod;
+            lod.indexOffset = (GLuint)indices.size();
+            lod.indexCount = (GLuint)simplified.size();
+            // selection walks the levels in order and expects the error to grow
+            lod.error = std::max(error, previousError);
+            lods.push_back(lod);
+            indices.insert(indices.end(), simplified.begin(), simplified.end());
+
+            previousCount = simplified.size();
+            previousError = lod.error;
+        }
+    }
+
+}
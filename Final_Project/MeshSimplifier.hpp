@@ -0,0 +1,24 @@
+#ifndef MeshSimplifier_hpp
+#define MeshSimplifier_hpp
+
+#include "Mesh.hpp"
+
+#include <vector>
+
+namespace gps {
+
+    // Quadric edge collapse (Garland & Heckbert) onto existing vertices, so the result
+    // indexes the same vertex buffer. Collapses until the index count reaches targetIndexCount
+    // or the next one would move the surface further than maxError. Vertices on open borders
+    // and attribute seams never move, which keeps holes and texture seams closed.
+    // error receives how far the surface moved, in model units
+    std::vector<GLuint> SimplifyMesh(const std::vector<Vertex>& vertices, const std::vector<GLuint>& indices,
+        size_t targetIndexCount, float maxError, float& error);
+
+    // Appends coarser versions of indices (each about half the triangles of the previous level)
+    // and describes every level in lods. Levels that barely shrink are not kept
+    void BuildLods(const std::vector<Vertex>& vertices, std::vector<GLuint>& indices, std::vector<MeshLod>& lods);
+
+}
+
+#endif /* MeshSimplifier_hpp */
@@ -1,53 +1,339 @@
 #include "Model3D.hpp"
+#include "Hash.hpp"
+#include "MeshOptimizer.hpp"
+#include "MeshSimplifier.hpp"
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <unordered_map>
 
 namespace gps {
 
+	// Bitwise key for welding identical position/normal/texcoord tuples
+	struct VertexKeyHash {
+		size_t operator()(const gps::Vertex& vertex) const {
+			// FNV-1a over the raw attribute bytes
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&vertex);
+			unsigned long long hash = 14695981039346656037ULL;
+			for (size_t i = 0; i < sizeof(gps::Vertex); i++) {
+				hash ^= bytes[i];
+				hash *= 1099511628211ULL;
+			}
+			return (size_t)hash;
+		}
+	};
+
+	struct VertexKeyEqual {
+		bool operator()(const gps::Vertex& a, const gps::Vertex& b) const {
+			return memcmp(&a, &b, sizeof(gps::Vertex)) == 0;
+		}
+	};
+
+	// Shapes draw the same way when they bind the same textures
+	static std::string MaterialKey(const std::vector<gps::Texture>& textures)
+	{
+		std::string key;
+		for (size_t i = 0; i < textures.size(); i++) {
+			key += textures[i].type + '\n' + textures[i].path + '\n';
+		}
+		return key;
+	}
+
+	// Replaces the shapes from first on with one mesh per material. Every level of the merged
+	// mesh holds the same level of all its shapes back to back, so one draw covers a level
+	// and the sections keep each shape's ranges, bounds and sphere for culling
+	static void MergeByMaterial(std::vector<gps::MeshData>& meshes, size_t first)
+	{
+		std::vector<std::vector<size_t> > groups;
+		std::unordered_map<std::string, size_t> groupOfMaterial;
+		for (size_t m = first; m < meshes.size(); m++) {
+			auto inserted = groupOfMaterial.insert(std::make_pair(MaterialKey(meshes[m].textures), groups.size()));
+			if (inserted.second) {
+				groups.push_back(std::vector<size_t>());
+			}
+			groups[inserted.first->second].push_back(m);
+		}
+
+		std::vector<gps::MeshData> merged(groups.size());
+		for (size_t g = 0; g < groups.size(); g++) {
+			const std::vector<size_t>& group = groups[g];
+			gps::MeshData& mesh = merged[g];
+			if (group.size() == 1) {
+				mesh = std::move(meshes[group[0]]);
+				continue;
+			}
+
+			mesh.textures = meshes[group[0]].textures;
+			mesh.sections.resize(group.size());
+
+			size_t levelCount = 0;
+			size_t vertexCount = 0;
+			size_t indexCount = 0;
+			for (size_t i = 0; i < group.size(); i++) {
+				levelCount = std::max(levelCount, meshes[group[i]].lods.size());
+				vertexCount += meshes[group[i]].vertices.size();
+			}
+			// shapes with fewer levels repeat their coarsest one
+			for (size_t l = 0; l < levelCount; l++) {
+				for (size_t i = 0; i < group.size(); i++) {
+					const std::vector<MeshLod>& lods = meshes[group[i]].lods;
+					indexCount += lods[std::min(l, lods.size() - 1)].indexCount;
+				}
+			}
+			mesh.vertices.reserve(vertexCount);
+			mesh.indices.reserve(indexCount);
+
+			std::vector<GLuint> baseVertex(group.size());
+			for (size_t i = 0; i < group.size(); i++) {
+				const gps::MeshData& shape = meshes[group[i]];
+				baseVertex[i] = (GLuint)mesh.vertices.size();
+				mesh.vertices.insert(mesh.vertices.end(), shape.vertices.begin(), shape.vertices.end());
+				mesh.sections[i].bounds = ComputeBounds(shape.vertices.data(), shape.vertices.size());
+				mesh.sections[i].sphere = ComputeSphere(shape.vertices.data(), shape.vertices.size(), mesh.sections[i].bounds);
+			}
+
+			for (size_t l = 0; l < levelCount; l++) {
+				MeshLod level;
+				level.indexOffset = (GLuint)mesh.indices.size();
+				level.error = 0.0f;
+				for (size_t i = 0; i < group.size(); i++) {
+					const gps::MeshData& shape = meshes[group[i]];
+					const MeshLod& source = shape.lods[std::min(l, shape.lods.size() - 1)];
+
+					MeshLod& range = mesh.sections[i].lods[l];
+					range.indexOffset = (GLuint)mesh.indices.size();
+					range.indexCount = source.indexCount;
+					range.error = source.error;
+					for (GLuint k = 0; k < source.indexCount; k++) {
+						mesh.indices.push_back(shape.indices[source.indexOffset + k] + baseVertex[i]);
+					}
+
+					// the whole level is selected at once, the worst shape decides
+					level.error = std::max(level.error, source.error);
+				}
+				level.indexCount = (GLuint)mesh.indices.size() - level.indexOffset;
+				mesh.lods.push_back(level);
+			}
+			for (size_t i = 0; i < group.size(); i++) {
+				for (size_t l = levelCount; l < MAX_LOD_LEVELS; l++) {
+					mesh.sections[i].lods[l] = mesh.sections[i].lods[levelCount - 1];
+				}
+			}
+		}
+
+		meshes.resize(first);
+		for (size_t g = 0; g < merged.size(); g++) {
+			meshes.push_back(std::move(merged[g]));
+		}
+	}
+
+	// Meshes are only shared when both the geometry and the textures match
+	static uint64_t MeshKey(uint64_t geometryHash, const std::vector<gps::Texture>& textures)
+	{
+		uint64_t key = HashBytes(&geometryHash, sizeof(geometryHash));
+		for (size_t i = 0; i < textures.size(); i++) {
+			key = HashBytes(&textures[i].handle->contentHash, sizeof(uint64_t), key);
+			key = HashString(textures[i].type, key);
+		}
+		return key;
+	}
+
+	Model3D::Model3D() : loadOptions(MESH_OPTION_OPTIMIZE | MESH_OPTION_QUANTIZE | MESH_OPTION_LODS | MESH_OPTION_MERGE)
+	{
+	}
+
+	void Model3D::SetLoadOptions(uint32_t options)
+	{
+		loadOptions = options;
+	}
+
 	void Model3D::LoadModel(std::string fileName)
 	{
         std::string basePath = fileName.substr(0, fileName.find_last_of('/')) + "/";
-		ReadOBJ(fileName, basePath);
+		LoadModel(fileName, basePath);
 	}
 
     void Model3D::LoadModel(std::string fileName, std::string basePath)
 	{
-		ReadOBJ(fileName, basePath);
+		ReadModel(fileName, basePath);
+		UploadModel();
+	}
+
+	void Model3D::ReadModel(std::string fileName)
+	{
+		std::string basePath = fileName.substr(0, fileName.find_last_of('/')) + "/";
+		ReadModel(fileName, basePath);
+	}
+
+	void Model3D::ReadModel(std::string fileName, std::string basePath)
+	{
+		if (!ReadCache(fileName)) {
+			ReadOBJ(fileName, basePath);
+			MeshCache::Write(fileName, pendingMeshes, loadOptions);
+		}
+		HashTextureFiles();
+
+		// workers load models concurrently, so the log goes out in one piece
+		std::cout << loadLog.str() << std::flush;
+		loadLog.str("");
+	}
+
+	void Model3D::UploadModel()
+	{
+		meshes.reserve(meshes.size() + pendingMeshes.size() + pendingCachedMeshes.size());
+
+		for (size_t i = 0; i < pendingMeshes.size(); i++) {
+			std::vector<gps::Texture> textures;
+			for (size_t t = 0; t < pendingMeshes[i].textures.size(); t++) {
+				textures.push_back(LoadTexture(pendingMeshes[i].textures[t].path, pendingMeshes[i].textures[t].type));
+			}
+			gps::MeshData& data = pendingMeshes[i];
+			size_t bytes = data.vertices.size() * sizeof(gps::Vertex) + data.packedVertices.size() * sizeof(gps::PackedVertex) +
+				data.indices.size() * sizeof(GLuint);
+			meshes.push_back(ResourceRegistry::GetShared().AcquireMesh(MeshKey(data.geometryHash, textures), bytes, [&]() {
+				gps::Mesh* mesh;
+				if (data.format == VERTEX_FORMAT_PACKED) {
+					mesh = new gps::Mesh(data.packedVertices.data(), VERTEX_FORMAT_PACKED, data.packedVertices.size(),
+						data.indices.data(), data.indices.size(), std::move(data.lods), std::move(textures), data.bounds, data.sphere);
+				}
+				else {
+					mesh = new gps::Mesh(std::move(data.vertices), std::move(data.indices), std::move(textures), std::move(data.lods));
+				}
+				mesh->sections = std::move(data.sections);
+				return mesh;
+			}));
+		}
+
+		for (size_t i = 0; i < pendingCachedMeshes.size(); i++) {
+			const CachedMesh& cachedMesh = pendingCachedMeshes[i];
+			std::vector<gps::Texture> textures;
+			for (size_t t = 0; t < cachedMesh.textures.size(); t++) {
+				textures.push_back(LoadTexture(cachedMesh.textures[t].path, cachedMesh.textures[t].type));
+			}
+
+			// the mapped arrays go straight to the GPU
+			size_t bytes = cachedMesh.vertexCount * GetVertexSize(cachedMesh.format) + cachedMesh.indexCount * sizeof(GLuint);
+			meshes.push_back(ResourceRegistry::GetShared().AcquireMesh(MeshKey(cachedMesh.geometryHash, textures), bytes, [&]() {
+				gps::Mesh* mesh = new gps::Mesh(cachedMesh.vertices, cachedMesh.format, cachedMesh.vertexCount,
+					cachedMesh.indices, cachedMesh.indexCount, cachedMesh.lods, std::move(textures), cachedMesh.bounds, cachedMesh.sphere);
+				mesh->sections = cachedMesh.sections;
+				return mesh;
+			}));
+		}
+
+		pendingMeshes.clear();
+		pendingCachedMeshes.clear();
+		pendingCache.Close();
+		textureHashes.clear();
+	}
+
+	// Maps a valid binary sidecar of the .obj file
+	bool Model3D::ReadCache(std::string fileName) {
+		auto loadStart = std::chrono::high_resolution_clock::now();
+
+		if (!pendingCache.Open(fileName, loadOptions))
+			return false;
+
+		loadLog << "Loading (cached) : " << fileName << std::endl;
+
+		size_t vertexCount = 0;
+		for (size_t i = 0; i < pendingCache.GetMeshCount(); i++) {
+			pendingCachedMeshes.push_back(pendingCache.GetMesh(i));
+			vertexCount += pendingCachedMeshes.back().vertexCount;
+		}
+
+		double loadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+		loadLog << "# of meshes    : " << pendingCachedMeshes.size() << std::endl;
+		loadLog << "# of vertices  : " << vertexCount << std::endl;
+		loadLog << "Load time      : " << loadMs << " ms" << std::endl;
+		return true;
+	}
+
+	void Model3D::Release()
+	{
+		meshes.clear();
+		pendingMeshes.clear();
+		pendingCachedMeshes.clear();
 	}
 
 	// Draw each mesh from the model
-	void Model3D::Draw(gps::Shader shaderProgram)
+	void Model3D::Draw(gps::Shader& shaderProgram)
+	{
+		for (size_t i = 0; i < meshes.size(); i++)
+			meshes[i]->Draw(shaderProgram);
+	}
+
+	size_t Model3D::GetDrawCount()
 	{
-		for (int i = 0; i < meshes.size(); i++)
-			meshes[i].Draw(shaderProgram);
+		return meshes.size();
+	}
+
+	size_t Model3D::GetShapeCount()
+	{
+		size_t shapeCount = 0;
+		for (size_t i = 0; i < meshes.size(); i++) {
+			shapeCount += std::max(meshes[i]->sections.size(), (size_t)1);
+		}
+		return shapeCount;
+	}
+
+	const std::vector<gps::MeshHandle>& Model3D::GetMeshes()
+	{
+		return meshes;
+	}
+
+	// Draw each section of each mesh at the level of detail its projected size needs
+	void Model3D::Draw(gps::Shader& shaderProgram, const glm::mat4& modelMatrix, const DrawContext& context)
+	{
+		InstanceData instance = MakeInstance(modelMatrix);
+		for (size_t i = 0; i < meshes.size(); i++)
+			for (size_t section = 0; section < meshes[i]->GetSectionCount(); section++)
+				meshes[i]->DrawSection(shaderProgram, section, meshes[i]->SelectLod(modelMatrix, context, section), instance);
 	}
 
 	// Does the parsing of the .obj file and fills in the data structure
 	void Model3D::ReadOBJ(std::string fileName, std::string basePath){
 
-        std::cout << "Loading : " << fileName << std::endl;
+        loadLog << "Loading : " << fileName << std::endl;
+		auto loadStart = std::chrono::high_resolution_clock::now();
 		tinyobj::attrib_t attrib;
 		std::vector<tinyobj::shape_t> shapes;
 		std::vector<tinyobj::material_t> materials;
-		int materialId;
 
 		std::string err;
 		bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, fileName.c_str(), basePath.c_str(), GL_TRUE);
 
 		if (!err.empty()) { // `err` may contain warning message.
-			std::cerr << err << std::endl;
+			loadLog << err << std::endl;
 		}
 
 		if (!ret) {
+			std::cerr << loadLog.str() << std::flush;
 			exit(1);
 		}
 
-		std::cout << "# of shapes    : " << shapes.size() << std::endl;
-		std::cout << "# of materials : " << materials.size() << std::endl;
-
-		// Loop over shapes
-		for (size_t s = 0; s < shapes.size(); s++) {
-			std::vector<gps::Vertex> vertices;
-			std::vector<GLuint> indices;
-			std::vector<gps::Texture> textures;
+		loadLog << "# of shapes    : " << shapes.size() << std::endl;
+		loadLog << "# of materials : " << materials.size() << std::endl;
+
+		// Loop over shapes - they are independent, so each one is converted on its own
+		// thread into a preallocated slot
+		size_t firstMesh = pendingMeshes.size();
+		pendingMeshes.resize(firstMesh + shapes.size());
+		std::vector<VertexCacheStats> statsBefore(shapes.size());
+		std::vector<VertexCacheStats> statsAfter(shapes.size());
+		ThreadPool::GetShared().ParallelFor(shapes.size(), [&](size_t s) {
+			std::vector<gps::Vertex>& vertices = pendingMeshes[firstMesh + s].vertices;
+			std::vector<GLuint>& indices = pendingMeshes[firstMesh + s].indices;
+			std::vector<gps::Texture>& textures = pendingMeshes[firstMesh + s].textures;
+
+			// face corners that share all attributes are emitted only once
+			std::unordered_map<gps::Vertex, GLuint, VertexKeyHash, VertexKeyEqual> uniqueVertices;
+			uniqueVertices.reserve(shapes[s].mesh.indices.size());
+			// the index count would over-reserve, most corners are shared after deduplication
+			vertices.reserve(std::min(shapes[s].mesh.indices.size(), attrib.vertices.size() / 3));
+			indices.resize(shapes[s].mesh.indices.size());
 
 			// Loop over faces(polygon)
 			size_t index_offset = 0;
@@ -58,7 +344,7 @@ namespace gps {
 				//textures.push_back(currentTexture);
 
 				// Loop over vertices in the face.
-				for (size_t v = 0; v < fv; v++) {
+				for (int v = 0; v < fv; v++) {
 					// access to vertex
 					tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
 
@@ -84,9 +370,16 @@ namespace gps {
 					currentVertex.Normal = vertexNormal;
 					currentVertex.TexCoords = vertexTexCoords;
 
-					vertices.push_back(currentVertex);
-
-					indices.push_back(index_offset + v);
+					auto found = uniqueVertices.find(currentVertex);
+					if (found == uniqueVertices.end()) {
+						GLuint newIndex = (GLuint)vertices.size();
+						uniqueVertices.emplace(currentVertex, newIndex);
+						vertices.push_back(currentVertex);
+						indices[index_offset + v] = newIndex;
+					}
+					else {
+						indices[index_offset + v] = found->second;
+					}
 				}
 
 				index_offset += fv;
@@ -96,7 +389,7 @@ namespace gps {
 			// Only try to read materials if the .mtl file is present
 			int a = shapes[s].mesh.material_ids.size();
 			if (a > 0 && materials.size()>0) {
-				materialId = shapes[s].mesh.material_ids[0];
+				int materialId = shapes[s].mesh.material_ids[0];
 				if (materialId != -1) {
 					gps::Material currentMaterial;
 					currentMaterial.ambient = glm::vec3(materials[materialId].ambient[0], materials[materialId].ambient[1], materials[materialId].ambient[2]);
@@ -108,7 +401,8 @@ namespace gps {
 					if (!ambientTexturePath.empty())
 					{
 						gps::Texture currentTexture;
-						currentTexture = LoadTexture(basePath + ambientTexturePath, "ambientTexture");
+						currentTexture.type = "ambientTexture";
+						currentTexture.path = basePath + ambientTexturePath;
 						textures.push_back(currentTexture);
 					}
 
@@ -117,7 +411,8 @@ namespace gps {
 					if (!diffuseTexturePath.empty())
 					{
 						gps::Texture currentTexture;
-						currentTexture = LoadTexture(basePath + diffuseTexturePath, "diffuseTexture");
+						currentTexture.type = "diffuseTexture";
+						currentTexture.path = basePath + diffuseTexturePath;
 						textures.push_back(currentTexture);
 					}
 
@@ -126,108 +421,163 @@ namespace gps {
 					if (!specularTexturePath.empty())
 					{
 						gps::Texture currentTexture;
-						currentTexture = LoadTexture(basePath + specularTexturePath, "specularTexture");
+						currentTexture.type = "specularTexture";
+						currentTexture.path = basePath + specularTexturePath;
 						textures.push_back(currentTexture);
 					}
 				}
 			}
 
-			meshes.push_back(gps::Mesh(vertices, indices, textures));
+			// triangle order for the post-transform cache, then against overdraw, then the
+			// vertex order for fetch locality
+			if (loadOptions & MESH_OPTION_OPTIMIZE) {
+				statsBefore[s] = AnalyzeVertexCache(indices, vertices.size());
+				OptimizeVertexCache(indices, vertices.size());
+				OptimizeOverdraw(indices, vertices);
+				statsAfter[s] = AnalyzeVertexCache(indices, vertices.size());
+			}
+
+			// the coarser levels are appended to indices and share the vertices
+			gps::MeshData& mesh = pendingMeshes[firstMesh + s];
+			if (loadOptions & MESH_OPTION_LODS) {
+				BuildLods(vertices, indices, mesh.lods);
+			}
+			else {
+				MeshLod full;
+				full.indexOffset = 0;
+				full.indexCount = (GLuint)indices.size();
+				full.error = 0.0f;
+				mesh.lods.assign(1, full);
+			}
+		});
+
+		size_t cornerCount = 0;
+		size_t weldedCount = 0;
+		std::vector<size_t> lodTriangles(MAX_LOD_LEVELS, 0);
+		for (size_t s = firstMesh; s < pendingMeshes.size(); s++) {
+			// meshes without coarser levels draw the full one at every distance
+			const std::vector<MeshLod>& lods = pendingMeshes[s].lods;
+			for (size_t l = 0; l < MAX_LOD_LEVELS; l++) {
+				lodTriangles[l] += lods[std::min(l, lods.size() - 1)].indexCount / 3;
+			}
+			cornerCount += lods[0].indexCount;
+			weldedCount += pendingMeshes[s].vertices.size();
+		}
+
+		// ACMR: transformed vertices per triangle, ATVR: transformed vertices per vertex
+		if (loadOptions & MESH_OPTION_OPTIMIZE) {
+			double missesBefore = 0.0;
+			double missesAfter = 0.0;
+			for (size_t s = 0; s < shapes.size(); s++) {
+				size_t triangleCount = pendingMeshes[firstMesh + s].lods[0].indexCount / 3;
+				missesBefore += statsBefore[s].acmr * triangleCount;
+				missesAfter += statsAfter[s].acmr * triangleCount;
+				loadLog << "  " << shapes[s].name << " : " << triangleCount << " triangles, ACMR "
+					<< statsBefore[s].acmr << " -> " << statsAfter[s].acmr << ", ATVR "
+					<< statsBefore[s].atvr << " -> " << statsAfter[s].atvr << std::endl;
+			}
+			if (cornerCount > 0) {
+				loadLog << "Vertex cache   : ACMR " << missesBefore * 3 / cornerCount << " -> " << missesAfter * 3 / cornerCount
+					<< ", ATVR " << missesBefore / weldedCount << " -> " << missesAfter / weldedCount << std::endl;
+			}
 		}
-	}
 
-	// Retrieves a texture associated with the object - by its name and type
-	gps::Texture Model3D::LoadTexture(std::string path, std::string type) {
+		if (loadOptions & MESH_OPTION_MERGE) {
+			MergeByMaterial(pendingMeshes, firstMesh);
+		}
 
-			for (int i = 0; i < loadedTextures.size(); i++) {
-				if (loadedTextures[i].path == path)
-				{
-					//already loaded texture
-					return loadedTextures[i];
-				}
+		// the final vertex order, bounds and packing depend on which shapes ended up together
+		ThreadPool::GetShared().ParallelFor(pendingMeshes.size() - firstMesh, [&](size_t m) {
+			gps::MeshData& mesh = pendingMeshes[firstMesh + m];
+			std::vector<gps::Vertex>& vertices = mesh.vertices;
+			std::vector<GLuint>& indices = mesh.indices;
+
+			// vertex order over all the levels, the full one decides
+			if (loadOptions & MESH_OPTION_OPTIMIZE) {
+				OptimizeVertexFetch(vertices, indices);
 			}
 
-			gps::Texture currentTexture;
-			currentTexture.id = ReadTextureFromFile(path.c_str());
-			currentTexture.type = std::string(type);
-			currentTexture.path = path;
+			mesh.bounds = ComputeBounds(vertices.data(), vertices.size());
+			mesh.sphere = ComputeSphere(vertices.data(), vertices.size(), mesh.bounds);
+			mesh.format = VERTEX_FORMAT_FLOAT;
+			if ((loadOptions & MESH_OPTION_QUANTIZE) && PackVertices(vertices.data(), vertices.size(), mesh.bounds, mesh.packedVertices)) {
+				// the float copy isn't needed anymore
+				mesh.format = VERTEX_FORMAT_PACKED;
+				std::vector<gps::Vertex>().swap(vertices);
+			}
 
-			loadedTextures.push_back(currentTexture);
+			if (mesh.format == VERTEX_FORMAT_PACKED) {
+				mesh.geometryHash = HashBytes(mesh.packedVertices.data(), mesh.packedVertices.size() * sizeof(gps::PackedVertex));
+			}
+			else {
+				mesh.geometryHash = HashBytes(vertices.data(), vertices.size() * sizeof(gps::Vertex));
+			}
+			mesh.geometryHash = HashBytes(indices.data(), indices.size() * sizeof(GLuint), mesh.geometryHash);
+		});
 
-			return currentTexture;
+		size_t packedCount = 0;
+		for (size_t m = firstMesh; m < pendingMeshes.size(); m++) {
+			packedCount += pendingMeshes[m].format == VERTEX_FORMAT_PACKED ? 1 : 0;
 		}
 
-	// Reads the pixel data from an image file and loads it into the video memory
-	GLuint Model3D::ReadTextureFromFile(const char* file_name) {
-		int x, y, n;
-		int force_channels = 4;
-		unsigned char* image_data = stbi_load(file_name, &x, &y, &n, force_channels);
-		if (!image_data) {
-			fprintf(stderr, "ERROR: could not load %s\n", file_name);
-			return false;
+		double loadMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+		loadLog << "# of vertices  : " << weldedCount << " (before welding: " << cornerCount << ")" << std::endl;
+		if (loadOptions & MESH_OPTION_LODS) {
+			loadLog << "LOD triangles  :";
+			for (size_t l = 0; l < MAX_LOD_LEVELS; l++) {
+				loadLog << " " << lodTriangles[l];
+			}
+			loadLog << std::endl;
+		}
+		if (loadOptions & MESH_OPTION_MERGE) {
+			loadLog << "Draw calls     : " << shapes.size() << " -> " << pendingMeshes.size() - firstMesh << " (merged by material)" << std::endl;
+		}
+		if (loadOptions & MESH_OPTION_QUANTIZE) {
+			loadLog << "Packed meshes  : " << packedCount << " of " << pendingMeshes.size() - firstMesh << std::endl;
+		}
+		loadLog << "Load time      : " << loadMs << " ms" << std::endl;
+	}
+
+	// Retrieves a texture associated with the object - by its name and type,
+	// the registry shares it with every other model using the same image
+	gps::Texture Model3D::LoadTexture(std::string path, std::string type) {
+		gps::Texture currentTexture;
+		currentTexture.handle = ResourceRegistry::GetShared().AcquireTexture(path, textureHashes[path]);
+		currentTexture.type = std::string(type);
+		currentTexture.path = path;
+
+		return currentTexture;
+	}
+
+	// Image files referenced by the model, valid between ReadModel and UploadModel
+	std::vector<std::string> Model3D::GetTexturePaths() {
+		std::vector<std::string> paths;
+		for (std::unordered_map<std::string, uint64_t>::iterator it = textureHashes.begin(); it != textureHashes.end(); ++it) {
+			paths.push_back(it->first);
+		}
+		return paths;
+	}
+
+	// Hashes the image files referenced by the pending meshes
+	void Model3D::HashTextureFiles() {
+		std::vector<std::string> paths;
+		for (size_t i = 0; i < pendingMeshes.size(); i++) {
+			for (size_t t = 0; t < pendingMeshes[i].textures.size(); t++) {
+				paths.push_back(pendingMeshes[i].textures[t].path);
+			}
+		}
+		for (size_t i = 0; i < pendingCachedMeshes.size(); i++) {
+			for (size_t t = 0; t < pendingCachedMeshes[i].textures.size(); t++) {
+				paths.push_back(pendingCachedMeshes[i].textures[t].path);
+			}
+		}
+
+		for (size_t i = 0; i < paths.size(); i++) {
+			if (textureHashes.count(paths[i]) == 0) {
+				uint64_t hash = 0;
+				HashFile(paths[i], hash);
+				textureHashes[paths[i]] = hash;
+			}
 		}
-		// NPOT check
-		if ((x & (x - 1)) != 0 || (y & (y - 1)) != 0) {
-			fprintf(
-				stderr, "WARNING: texture %s is not power-of-2 dimensions\n", file_name
-			);
-		}
-
-		int width_in_bytes = x * 4;
-		unsigned char *top = NULL;
-		unsigned char *bottom = NULL;
-		unsigned char temp = 0;
-		int half_height = y / 2;
-
-		for (int row = 0; row < half_height; row++) {
-			top = image_data + row * width_in_bytes;
-			bottom = image_data + (y - row - 1) * width_in_bytes;
-			for (int col = 0; col < width_in_bytes; col++) {
-				temp = *top;
-				*top = *bottom;
-				*bottom = temp;
-				top++;
-				bottom++;
-			}
-		}
-
-		GLuint textureID;
-		glGenTextures(1, &textureID);
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(
-			GL_TEXTURE_2D,
-			0,
-			GL_SRGB, //GL_SRGB,//GL_RGBA,
-			x,
-			y,
-			0,
-			GL_RGBA,
-			GL_UNSIGNED_BYTE,
-			image_data
-		);
-		glGenerateMipmap(GL_TEXTURE_2D);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glBindTexture(GL_TEXTURE_2D, 0);
-
-		return textureID;
-	}
-
-	Model3D::~Model3D() {
-        for (size_t i = 0; i < loadedTextures.size(); i++) {
-            glDeleteTextures(1, &loadedTextures.at(i).id);
-        }
-
-        for (size_t i = 0; i < meshes.size(); i++) {
-            GLuint VBO = meshes.at(i).getBuffers().VBO;
-            GLuint EBO = meshes.at(i).getBuffers().EBO;
-            GLuint VAO = meshes.at(i).getBuffers().VAO;
-            glDeleteBuffers(1, &VBO);
-            glDeleteBuffers(1, &EBO);
-            glDeleteVertexArrays(1, &VAO);
-        }
 	}
 }
@@ -2,12 +2,16 @@
 #define Model3D_hpp
 
 #include "Mesh.hpp"
+#include "MeshCache.hpp"
+#include "ResourceRegistry.hpp"
 
 #include "tiny_obj_loader.h"
 #include "stb_image.h"
 
 #include <iostream>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace gps {
@@ -16,28 +20,68 @@ namespace gps {
     {
 
     public:
-        ~Model3D();
+		Model3D();
+
+		// MeshLoadOptions applied by the following loads, all of them by default
+		void SetLoadOptions(uint32_t options);
 
 		void LoadModel(std::string fileName);
 
 		void LoadModel(std::string fileName, std::string basePath);
 
-		void Draw(gps::Shader shaderProgram);
+		// CPU side of loading: parses (or maps the cache of) the model.
+		// Touches no GL state, so it can run on a worker thread
+		void ReadModel(std::string fileName);
+
+		void ReadModel(std::string fileName, std::string basePath);
+
+		// GL side of loading: creates the buffers and textures for the data prepared by ReadModel
+		void UploadModel();
+
+		// Drops the meshes and their textures, the registry deletes the ones no other model
+		// holds. Needs the context, so it runs before the window goes, not from the destructor
+		void Release();
+
+		void Draw(gps::Shader& shaderProgram);
+
+		// Draws every mesh at the coarsest level the pass described by context allows
+		void Draw(gps::Shader& shaderProgram, const glm::mat4& modelMatrix, const DrawContext& context);
+
+		// Draw calls per pass, and how many it would take without merging shapes by material
+		size_t GetDrawCount();
+		size_t GetShapeCount();
+
+		// Meshes the Draw functions go through, for renderers that order the draws themselves
+		const std::vector<gps::MeshHandle>& GetMeshes();
+
+		// Image files referenced by the model, valid between ReadModel and UploadModel
+		std::vector<std::string> GetTexturePaths();
 
     private:
-		// Component meshes - group of objects
-        std::vector<gps::Mesh> meshes;
-		// Associated textures
-        std::vector<gps::Texture> loadedTextures;
+		// Component meshes - group of objects, shared with other models through the registry
+        std::vector<gps::MeshHandle> meshes;
+
+		// Data prepared by ReadModel
+		std::vector<gps::MeshData> pendingMeshes;
+		std::vector<gps::CachedMesh> pendingCachedMeshes;
+		gps::MeshCache pendingCache;
+		// content hash of every referenced image file
+		std::unordered_map<std::string, uint64_t> textureHashes;
+		std::ostringstream loadLog;
+		uint32_t loadOptions;
 
 		// Does the parsing of the .obj file and fills in the data structure
 		void ReadOBJ(std::string fileName, std::string basePath);
 
-		// Retrieves a texture associated with the object - by its name and type
+		// Maps a valid binary sidecar of the .obj file
+		bool ReadCache(std::string fileName);
+
+		// Retrieves a texture associated with the object - by its name and type,
+		// the registry shares it with every other model using the same image
 		gps::Texture LoadTexture(std::string path, std::string type);
 
-		// Reads the pixel data from an image file and loads it into the video memory
-		GLuint ReadTextureFromFile(const char* file_name);
+		// Hashes the image files referenced by the pending meshes
+		void HashTextureFiles();
     };
 }
 
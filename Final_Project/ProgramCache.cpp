@@ -0,0 +1,134 @@
+#include "ProgramCache.hpp"
+#include "Hash.hpp"
+#include "MappedFile.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace gps {
+
+    struct ProgramCacheHeader {
+        char magic[4];
+        uint32_t version;
+        // both stages after includes and defines
+        uint64_t sourceHash;
+        uint64_t driverHash;
+        uint32_t binaryFormat;
+        uint32_t binarySize;
+    };
+
+    static const char PROGRAM_CACHE_MAGIC[4] = { 'G', 'P', 'S', 'P' };
+
+    std::string ProgramCache::GetCachePath(const std::string& vertexFile, const std::string& fragmentFile, const std::vector<std::string>& defines)
+    {
+        uint64_t key = HashString(vertexFile);
+        for (const std::string& define : defines) {
+            key = HashString(define, HashString("\n", key));
+        }
+        char name[32];
+        snprintf(name, sizeof(name), ".%016llx.gpsprog", (unsigned long long)key);
+        return fragmentFile + name;
+    }
+
+    bool ProgramCache::IsSupported()
+    {
+        static int formats = -1;
+        if (formats < 0) {
+            formats = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        }
+        return formats > 0;
+    }
+
+    uint64_t ProgramCache::GetDriverHash()
+    {
+        static uint64_t driverHash = 0;
+        if (driverHash == 0) {
+            const GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+            driverHash = HASH_SEED;
+            for (GLenum name : names) {
+                const char* value = reinterpret_cast<const char*>(glGetString(name));
+                if (value != NULL) {
+                    driverHash = HashBytes(value, strlen(value) + 1, driverHash);
+                }
+            }
+        }
+        return driverHash;
+    }
+
+    bool ProgramCache::Load(const std::string& cachePath, uint64_t sourceHash, GLuint program)
+    {
+        if (!IsSupported()) {
+            return false;
+        }
+
+        MappedFile file;
+        if (!file.Open(cachePath)) {
+            return false;
+        }
+
+        const unsigned char* data = file.GetData();
+        size_t size = file.GetSize();
+        const ProgramCacheHeader* header = reinterpret_cast<const ProgramCacheHeader*>(data);
+        if (size < sizeof(ProgramCacheHeader) ||
+            memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC)) != 0 ||
+            header->version != PROGRAM_CACHE_VERSION ||
+            header->sourceHash != sourceHash ||
+            header->driverHash != GetDriverHash() ||
+            size < sizeof(ProgramCacheHeader) + header->binarySize) {
+            return false;
+        }
+
+        // drivers may still refuse a binary of their own, after an update that kept the
+        // version string for instance
+        glProgramBinary(program, header->binaryFormat, data + sizeof(ProgramCacheHeader), (GLsizei)header->binarySize);
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        return linked == GL_TRUE;
+    }
+
+    bool ProgramCache::Write(const std::string& cachePath, uint64_t sourceHash, GLuint program)
+    {
+        if (!IsSupported()) {
+            return false;
+        }
+
+        GLint binarySize = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+        if (binarySize <= 0) {
+            return false;
+        }
+        std::vector<unsigned char> binary(binarySize);
+        GLenum binaryFormat = 0;
+        glGetProgramBinary(program, binarySize, &binarySize, &binaryFormat, binary.data());
+
+        ProgramCacheHeader header;
+        memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+        header.version = PROGRAM_CACHE_VERSION;
+        header.sourceHash = sourceHash;
+        header.driverHash = GetDriverHash();
+        header.binaryFormat = binaryFormat;
+        header.binarySize = (uint32_t)binarySize;
+
+        // write to a temporary file first so a crash never leaves a half written cache
+        std::string tempPath = cachePath + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file) {
+            fprintf(stderr, "WARNING: could not write program cache %s\n", cachePath.c_str());
+            return false;
+        }
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(binary.data(), 1, (size_t)binarySize, file);
+        bool ok = !ferror(file);
+        fclose(file);
+
+        remove(cachePath.c_str());
+        if (!ok || rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+            remove(tempPath.c_str());
+            fprintf(stderr, "WARNING: could not write program cache %s\n", cachePath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+}
@@ -0,0 +1,37 @@
+#ifndef ProgramCache_hpp
+#define ProgramCache_hpp
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gps {
+
+    // bump whenever the layout of the cache file changes
+    const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+    // Linked program binaries stored in sidecars next to the fragment shader, one per set of
+    // defines. An entry is only used for the exact sources it was linked from and the driver
+    // that produced it, anything else compiles from source and replaces it. Context thread only
+    class ProgramCache
+    {
+    public:
+        // Loads the binary cached for sourceHash into program, fails if it is missing, stale
+        // or the driver rejects it, the program can then still be linked from source
+        static bool Load(const std::string& cachePath, uint64_t sourceHash, GLuint program);
+        // Stores the binary of a linked program, which must have been linked with
+        // GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+        static bool Write(const std::string& cachePath, uint64_t sourceHash, GLuint program);
+
+        static std::string GetCachePath(const std::string& vertexFile, const std::string& fragmentFile, const std::vector<std::string>& defines);
+        // The driver offers at least one binary format
+        static bool IsSupported();
+        // Vendor, renderer and version strings, a driver update invalidates every entry
+        static uint64_t GetDriverHash();
+    };
+
+}
+
+#endif /* ProgramCache_hpp */
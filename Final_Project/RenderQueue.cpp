@@ -0,0 +1,391 @@
+#include "RenderQueue.hpp"
+
+#include <algorithm>
+
+namespace gps {
+
+    static const int KEY_PASS_SHIFT = 61;
+    static const int KEY_SHADER_SHIFT = 53;
+    static const int KEY_MATERIAL_SHIFT = 37;
+    static const int KEY_FORMAT_SHIFT = 36;
+    static const int KEY_MESH_SHIFT = 23;
+    static const int KEY_LOD_SHIFT = 21;
+    static const int KEY_SECTION_SHIFT = 11;
+    static const uint64_t KEY_SHADER_MASK = 0xFF;
+    static const uint64_t KEY_MATERIAL_MASK = 0xFFFF;
+    static const uint64_t KEY_MESH_MASK = 0x1FFF;
+    static const uint64_t KEY_SECTION_MASK = 0x3FF;
+    static const uint64_t KEY_DEPTH_MASK = 0x7FF;
+    static_assert(RENDER_PASS_COUNT <= 8, "the sort key keeps three bits for the pass");
+    static_assert(MAX_LOD_LEVELS <= 4, "the sort key keeps two bits for the level of detail");
+
+    // packets whose keys agree above the mesh draw with the same program, textures and
+    // vertex array, so they can share one multi draw
+    static const int KEY_BATCH_SHIFT = KEY_FORMAT_SHIFT;
+    static_assert(VERTEX_FORMAT_COUNT <= 2, "the sort key keeps one bit for the vertex format");
+
+    // view distance spread over the depth bits, anything farther shares the last value
+    static const float SORT_DEPTH_RANGE = 1024.0f;
+
+    // the keys are sorted one byte at a time
+    static const int RADIX_BITS = 8;
+    static const size_t RADIX_BUCKETS = 1 << RADIX_BITS;
+
+    RenderQueue::RenderQueue()
+    {
+        for (int pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+            passes[pass].enabled = false;
+            passes[pass].shader = NULL;
+            lastPassCulledCounts[pass] = 0;
+        }
+        instanceBuffer = 0;
+        instanceBufferSize = 0;
+        commandBuffer = 0;
+        commandBufferSize = 0;
+        lastCulledCount = 0;
+        lastPacketCount = 0;
+        lastCommandCount = 0;
+        lastDrawCount = 0;
+    }
+
+    void RenderQueue::SetPass(RenderPass pass, Shader& shader, const DrawContext& context, std::function<void()> begin)
+    {
+        PassInfo& info = passes[pass];
+        info.enabled = true;
+        info.shader = &shader;
+        info.context = context;
+        info.begin = begin;
+    }
+
+    void RenderQueue::Submit(Model3D& model, const glm::mat4& modelMatrix, uint32_t passMask)
+    {
+        InstanceData instance = MakeInstance(modelMatrix);
+        SubmitInstances(model, &instance, 1, passMask);
+    }
+
+    void RenderQueue::SubmitInstances(Model3D& model, const InstanceData* instances, size_t count, uint32_t passMask)
+    {
+        SubmittedObject submitted;
+        submitted.model = &model;
+        submitted.firstInstance = (uint32_t)this->instances.size();
+        submitted.instanceCount = (uint32_t)count;
+        submitted.passMask = passMask;
+        objects.push_back(submitted);
+        this->instances.insert(this->instances.end(), instances, instances + count);
+    }
+
+    uint64_t RenderQueue::MakeStateKey(RenderPass pass, Mesh& mesh)
+    {
+        const PassInfo& info = passes[pass];
+
+        // ids are handed out in order of first use, the masks only wrap past 255 shaders,
+        // 65535 texture sets or 8191 meshes, which costs sorting quality and nothing else
+        uint32_t shaderId = shaderIds.emplace(info.shader->shaderProgram, (uint32_t)shaderIds.size()).first->second;
+
+        // the material is the set of textures this shader actually binds, so passes
+        // without samplers (the depth pass) see every mesh as the same material
+        uint64_t textureSet = 0;
+        for (size_t i = 0; i < mesh.textures.size(); i++) {
+            if (info.shader->getSamplerUnit(mesh.textures[i].type) >= 0) {
+                textureSet = (textureSet ^ mesh.textures[i].handle->id) * 1099511628211ull;
+            }
+        }
+        uint32_t materialId = 0;
+        if (textureSet != 0) {
+            materialId = materialIds.emplace(textureSet, (uint32_t)materialIds.size() + 1).first->second;
+        }
+
+        return ((uint64_t)pass << KEY_PASS_SHIFT)
+            | ((shaderId & KEY_SHADER_MASK) << KEY_SHADER_SHIFT)
+            | ((materialId & KEY_MATERIAL_MASK) << KEY_MATERIAL_SHIFT)
+            | ((uint64_t)mesh.getGeometry().format << KEY_FORMAT_SHIFT)
+            | ((mesh.getGeometry().id & KEY_MESH_MASK) << KEY_MESH_SHIFT);
+    }
+
+    // Least significant digit first radix sort of the packet indices, stable, so every
+    // byte pass keeps the order of the bytes below it
+    void RenderQueue::SortPackets()
+    {
+        size_t count = keys.size();
+        order.resize(count);
+        scratch.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            order[i] = (uint32_t)i;
+        }
+
+        for (int shift = 0; shift < 64 && count > 1; shift += RADIX_BITS) {
+            size_t histogram[RADIX_BUCKETS] = { 0 };
+            for (size_t i = 0; i < count; i++) {
+                histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+            }
+            // a byte all keys share moves nothing, most of the middle bytes are like that
+            if (histogram[(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == count) {
+                continue;
+            }
+
+            size_t offset = 0;
+            for (size_t bucket = 0; bucket < RADIX_BUCKETS; bucket++) {
+                size_t bucketSize = histogram[bucket];
+                histogram[bucket] = offset;
+                offset += bucketSize;
+            }
+            for (size_t i = 0; i < count; i++) {
+                uint32_t packet = order[i];
+                scratch[histogram[(keys[packet] >> shift) & (RADIX_BUCKETS - 1)]++] = packet;
+            }
+            order.swap(scratch);
+        }
+    }
+
+    void RenderQueue::BuildRuns()
+    {
+        drawInstances.resize(order.size());
+        runs.clear();
+        glm::mat4 vertexTransform;
+        size_t instanceCount = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            const DrawPacket& packet = packets[order[i]];
+            uint64_t key = keys[order[i]];
+            GLuint indexCount, firstIndex;
+            packet.mesh->GetSectionRange(packet.section, packet.lod, indexCount, firstIndex);
+
+            bool sameLevel = !runs.empty() && runs.back().mesh == packet.mesh && runs.back().lod == packet.lod &&
+                (runs.back().key >> KEY_PASS_SHIFT) == (key >> KEY_PASS_SHIFT);
+            if (sameLevel && runs.back().section == packet.section && runs.back().sectionCount == 1) {
+                runs.back().instanceCount++;
+            }
+            // the sections of a level are back to back, the next one drawn by the same single
+            // instance extends the range, so a merged mesh seen whole is still one draw
+            else if (sameLevel && runs.back().instanceCount == 1 && runs.back().section < packet.section &&
+                packets[order[i - 1]].instance == packet.instance && runs.back().firstIndex + runs.back().indexCount == firstIndex) {
+                runs.back().section = packet.section;
+                runs.back().sectionCount++;
+                runs.back().indexCount += indexCount;
+                continue;
+            }
+            else {
+                DrawRun run;
+                run.mesh = packet.mesh;
+                run.lod = packet.lod;
+                run.section = packet.section;
+                run.sectionCount = 1;
+                run.indexCount = indexCount;
+                run.firstIndex = firstIndex;
+                run.firstInstance = (uint32_t)instanceCount;
+                run.instanceCount = 1;
+                run.key = key;
+                runs.push_back(run);
+                vertexTransform = packet.mesh->GetVertexTransform();
+            }
+
+            // the instanced draws read the vertices as stored, packed positions need rescaling
+            InstanceData& instance = drawInstances[instanceCount++];
+            instance = instances[packet.instance];
+            if (packet.mesh->getGeometry().format == VERTEX_FORMAT_PACKED) {
+                instance.Model = instance.Model * vertexTransform;
+            }
+        }
+        drawInstances.resize(instanceCount);
+    }
+
+    // Replaces the contents of buffer, growing it to the largest size it held
+    static void StreamBuffer(GLenum target, GLuint& buffer, GLsizeiptr& capacity, const void* data, GLsizeiptr size)
+    {
+        if (buffer == 0) {
+            glGenBuffers(1, &buffer);
+        }
+        capacity = std::max(capacity, size);
+        glBindBuffer(target, buffer);
+        glBufferData(target, capacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(target, 0, size, data);
+    }
+
+    void RenderQueue::UploadInstances()
+    {
+        if (drawInstances.empty()) {
+            return;
+        }
+        StreamBuffer(GL_ARRAY_BUFFER, instanceBuffer, instanceBufferSize, drawInstances.data(),
+            (GLsizeiptr)(drawInstances.size() * sizeof(InstanceData)));
+
+        if (!GeometryPool::GetShared().SupportsMultiDrawIndirect()) {
+            return;
+        }
+        commands.resize(runs.size());
+        for (size_t i = 0; i < runs.size(); i++) {
+            const DrawRun& run = runs[i];
+            commands[i] = run.mesh->GetDrawCommand(run.indexCount, run.firstIndex, run.instanceCount, run.firstInstance);
+        }
+        // stays bound to the indirect target for the draws of this Execute
+        StreamBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer, commandBufferSize, commands.data(),
+            (GLsizeiptr)(commands.size() * sizeof(DrawElementsIndirectCommand)));
+    }
+
+    size_t RenderQueue::DrawPass(RenderPass pass, size_t next, size_t& draws)
+    {
+        Shader& shader = *passes[pass].shader;
+        bool multiDraw = GeometryPool::GetShared().SupportsMultiDrawIndirect();
+        while (next < runs.size() && (runs[next].key >> KEY_PASS_SHIFT) == (uint64_t)pass) {
+            const DrawRun& first = runs[next];
+            if (!multiDraw) {
+                first.mesh->DrawInstanced(shader, first.indexCount, first.firstIndex, instanceBuffer,
+                    (GLintptr)(first.firstInstance * sizeof(InstanceData)), (GLsizei)first.instanceCount);
+                draws++;
+                next++;
+                continue;
+            }
+
+            size_t end = next + 1;
+            while (end < runs.size() && (runs[end].key >> KEY_BATCH_SHIFT) == (first.key >> KEY_BATCH_SHIFT)) {
+                end++;
+            }
+            first.mesh->DrawIndirect(shader, instanceBuffer, (GLintptr)(next * sizeof(DrawElementsIndirectCommand)), (GLsizei)(end - next));
+            draws++;
+            next = end;
+        }
+        return next;
+    }
+
+    size_t RenderQueue::BuildPackets(RenderPass pass)
+    {
+        const DrawContext& context = passes[pass].context;
+        candidates.clear();
+        candidateBounds.Clear();
+        for (size_t i = 0; i < objects.size(); i++) {
+            const SubmittedObject& object = objects[i];
+            if (!(object.passMask & (1u << pass))) {
+                continue;
+            }
+            const std::vector<MeshHandle>& meshes = object.model->GetMeshes();
+            for (size_t m = 0; m < meshes.size(); m++) {
+                Mesh& mesh = *meshes[m];
+                CullCandidate candidate;
+                candidate.mesh = &mesh;
+                candidate.stateKey = MakeStateKey(pass, mesh);
+                // merged meshes span the scene, their source shapes are what the frustum can reject
+                for (uint32_t k = 0; k < object.instanceCount; k++) {
+                    candidate.instance = object.firstInstance + k;
+                    for (size_t section = 0; section < mesh.GetSectionCount(); section++) {
+                        candidate.section = (uint32_t)section;
+                        candidates.push_back(candidate);
+                        if (context.cull) {
+                            const BoundingBox& bounds = mesh.GetSectionBounds(section);
+                            candidateBounds.Add(instances[candidate.instance].Model, bounds.min, bounds.max,
+                                mesh.GetSectionSphere(section).radius);
+                        }
+                    }
+                }
+            }
+        }
+
+        size_t culled = 0;
+        if (context.cull) {
+            culled = candidateBounds.Cull(context.frustum, visible);
+        }
+        else {
+            visible.assign(candidates.size(), 1);
+        }
+
+        for (size_t i = 0; i < candidates.size(); i++) {
+            if (!visible[i]) {
+                continue;
+            }
+            const CullCandidate& candidate = candidates[i];
+            Mesh& mesh = *candidate.mesh;
+            const glm::mat4& modelMatrix = instances[candidate.instance].Model;
+
+            // every section picks its own level, a merged mesh usually surrounds the camera
+            DrawPacket packet;
+            packet.mesh = &mesh;
+            packet.instance = candidate.instance;
+            packet.section = candidate.section;
+            packet.lod = (uint32_t)mesh.SelectLod(modelMatrix, context, candidate.section);
+            packets.push_back(packet);
+
+            glm::vec3 center = glm::vec3(modelMatrix * glm::vec4(mesh.GetSectionSphere(candidate.section).center, 1.0f));
+            float distance = glm::length(center - context.viewPosition);
+            uint64_t depth = (uint64_t)(std::min(distance / SORT_DEPTH_RANGE, 1.0f) * KEY_DEPTH_MASK);
+            keys.push_back(candidate.stateKey | ((uint64_t)packet.lod << KEY_LOD_SHIFT)
+                | (((uint64_t)candidate.section & KEY_SECTION_MASK) << KEY_SECTION_SHIFT) | depth);
+        }
+        return culled;
+    }
+
+    void RenderQueue::Execute()
+    {
+        packets.clear();
+        keys.clear();
+        size_t culled = 0;
+        for (int pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+            lastPassCulledCounts[pass] = passes[pass].enabled ? BuildPackets((RenderPass)pass) : 0;
+            culled += lastPassCulledCounts[pass];
+        }
+        SortPackets();
+        BuildRuns();
+        UploadInstances();
+
+        // the runs of a pass are contiguous, a pass with none still begins so its target is cleared
+        size_t draws = 0;
+        size_t next = 0;
+        for (int pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+            if (!passes[pass].enabled) {
+                continue;
+            }
+            if (passes[pass].begin) {
+                passes[pass].begin();
+            }
+            next = DrawPass((RenderPass)pass, next, draws);
+        }
+
+        lastCulledCount = culled;
+        lastPacketCount = packets.size();
+        lastCommandCount = runs.size();
+        lastDrawCount = draws;
+        objects.clear();
+        instances.clear();
+        for (int pass = 0; pass < RENDER_PASS_COUNT; pass++) {
+            passes[pass].enabled = false;
+            passes[pass].begin = nullptr;
+        }
+    }
+
+    void RenderQueue::Destroy()
+    {
+        if (instanceBuffer != 0) {
+            glDeleteBuffers(1, &instanceBuffer);
+            instanceBuffer = 0;
+            instanceBufferSize = 0;
+        }
+        if (commandBuffer != 0) {
+            glDeleteBuffers(1, &commandBuffer);
+            commandBuffer = 0;
+            commandBufferSize = 0;
+        }
+    }
+
+    size_t RenderQueue::GetCulledCount()
+    {
+        return lastCulledCount;
+    }
+
+    size_t RenderQueue::GetCulledCount(RenderPass pass)
+    {
+        return lastPassCulledCounts[pass];
+    }
+
+    size_t RenderQueue::GetPacketCount()
+    {
+        return lastPacketCount;
+    }
+
+    size_t RenderQueue::GetCommandCount()
+    {
+        return lastCommandCount;
+    }
+
+    size_t RenderQueue::GetDrawCount()
+    {
+        return lastDrawCount;
+    }
+
+}
@@ -0,0 +1,154 @@
+#ifndef RenderQueue_hpp
+#define RenderQueue_hpp
+
+#include "Frustum.hpp"
+#include "Model3D.hpp"
+#include "UniformBuffer.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace gps {
+
+    // Passes in execution order, the pass is the top of the sort key. Shadow cascade i
+    // renders in pass RENDER_PASS_SHADOW + i
+    enum RenderPass {
+        RENDER_PASS_SHADOW = 0,
+        RENDER_PASS_MAIN = RENDER_PASS_SHADOW + MAX_SHADOW_CASCADES,
+        RENDER_PASS_COUNT
+    };
+
+    // every shadow cascade, the ones not enabled for a frame are skipped
+    const uint32_t RENDER_PASS_SHADOW_BIT = ((1u << MAX_SHADOW_CASCADES) - 1) << RENDER_PASS_SHADOW;
+    const uint32_t RENDER_PASS_MAIN_BIT = 1u << RENDER_PASS_MAIN;
+
+    // Collects the objects of a frame once and draws them in every enabled pass. Each section
+    // (merged shape) of each mesh of each instance becomes a draw packet with its own level
+    // of detail and a 64 bit key, most significant field first:
+    //   pass (3) | shader (8) | material (16) | vertex format (1) | mesh (13) | lod (2) | section (10) | depth (11)
+    // The packets are radix sorted, so a pass changes shader, then textures, then vertex
+    // formats as rarely as possible. Runs of packets drawing the same section at the same level
+    // become one indirect command, whatever object submitted them, and so do neighbouring
+    // sections one instance draws at the same level. The commands sharing everything above
+    // the mesh go out in one glMultiDrawElementsIndirect. Without multi draw indirect every
+    // command is an instanced draw of its own. Passes whose context culls test every section
+    // of every instance against their frustum before it becomes a packet
+    class RenderQueue
+    {
+    public:
+        RenderQueue();
+
+        // Enables pass for the next Execute, begin sets its render target and bindings
+        void SetPass(RenderPass pass, Shader& shader, const DrawContext& context, std::function<void()> begin);
+
+        // Queues one copy of model placed by modelMatrix for the passes in passMask
+        void Submit(Model3D& model, const glm::mat4& modelMatrix, uint32_t passMask);
+        // Queues count copies of model, the instances are copied
+        void SubmitInstances(Model3D& model, const InstanceData* instances, size_t count, uint32_t passMask);
+
+        // Sorts the packets, uploads their instances in draw order and draws them, then
+        // empties the queue and disables the passes
+        void Execute();
+
+        void Destroy();
+
+        // Sections culled, packets, indirect commands and draw calls of the last Execute
+        size_t GetCulledCount();
+        size_t GetCulledCount(RenderPass pass);
+        size_t GetPacketCount();
+        size_t GetCommandCount();
+        size_t GetDrawCount();
+
+    private:
+        struct PassInfo {
+            bool enabled;
+            Shader* shader;
+            DrawContext context;
+            std::function<void()> begin;
+        };
+
+        struct SubmittedObject {
+            Model3D* model;
+            uint32_t firstInstance;
+            uint32_t instanceCount;
+            uint32_t passMask;
+        };
+
+        struct DrawPacket {
+            Mesh* mesh;
+            uint32_t instance;
+            uint32_t section;
+            uint32_t lod;
+        };
+
+        // a section of a mesh instance waiting for the frustum test
+        struct CullCandidate {
+            Mesh* mesh;
+            uint32_t instance;
+            uint32_t section;
+            uint64_t stateKey;
+        };
+
+        // packets drawing the same index range, one indirect command
+        struct DrawRun {
+            Mesh* mesh;
+            uint32_t lod;
+            // the last section joined, sectionCount of them end there
+            uint32_t section;
+            uint32_t sectionCount;
+            GLuint indexCount;
+            GLuint firstIndex;
+            uint32_t firstInstance;
+            uint32_t instanceCount;
+            uint64_t key;
+        };
+
+        PassInfo passes[RENDER_PASS_COUNT];
+        std::vector<SubmittedObject> objects;
+        std::vector<InstanceData> instances;
+        std::vector<CullCandidate> candidates;
+        BoundsArray candidateBounds;
+        std::vector<uint8_t> visible;
+        std::vector<DrawPacket> packets;
+        std::vector<uint64_t> keys;
+        // packet indices, sorted by key
+        std::vector<uint32_t> order;
+        std::vector<uint32_t> scratch;
+        // the instance of every packet, in sorted order
+        std::vector<InstanceData> drawInstances;
+        std::vector<DrawRun> runs;
+        std::vector<DrawElementsIndirectCommand> commands;
+
+        // streamed every frame, orphaned before the upload so they never wait for the GPU
+        GLuint instanceBuffer;
+        GLsizeiptr instanceBufferSize;
+        GLuint commandBuffer;
+        GLsizeiptr commandBufferSize;
+
+        size_t lastCulledCount;
+        size_t lastPassCulledCounts[RENDER_PASS_COUNT];
+        size_t lastPacketCount;
+        size_t lastCommandCount;
+        size_t lastDrawCount;
+
+        // small stable ids for the key fields that are GL names or texture sets
+        std::unordered_map<GLuint, uint32_t> shaderIds;
+        std::unordered_map<uint64_t, uint32_t> materialIds;
+
+        // the key fields shared by all instances of mesh in pass
+        uint64_t MakeStateKey(RenderPass pass, Mesh& mesh);
+        // Appends the packets of the visible sections of pass, returns how many were culled
+        size_t BuildPackets(RenderPass pass);
+        void SortPackets();
+        // Fills drawInstances and runs in sorted order
+        void BuildRuns();
+        void UploadInstances();
+        // Draws the runs of pass starting at run next, returns the first run of the next pass
+        size_t DrawPass(RenderPass pass, size_t next, size_t& draws);
+    };
+
+}
+
+#endif /* RenderQueue_hpp */
@@ -0,0 +1,153 @@
+#include "ResourceRegistry.hpp"
+#include "GLState.hpp"
+#include "TextureLoader.hpp"
+#include "Hash.hpp"
+
+#include <cstdio>
+
+namespace gps {
+
+    ResourceRegistry& ResourceRegistry::GetShared()
+    {
+        static ResourceRegistry sharedRegistry;
+        return sharedRegistry;
+    }
+
+    static void ReleaseTexture(TextureRecord* record)
+    {
+        // aliases borrow the id of the texture they point to
+        if (!record->aliasOf) {
+            TextureLoader::Release(record->id);
+            GLState::GetShared().DeleteTexture(record->id);
+        }
+        delete record;
+    }
+
+    static void ReleaseMesh(Mesh* mesh)
+    {
+        GeometryPool::GetShared().Free(mesh->getGeometry());
+        delete mesh;
+    }
+
+    TextureHandle ResourceRegistry::AcquireTexture(const std::string& path, uint64_t contentHash)
+    {
+        // unreadable files can't be hashed, fall back to the path
+        uint64_t key = contentHash != 0 ? contentHash : HashString(path);
+
+        std::unordered_map<uint64_t, std::weak_ptr<TextureRecord> >::iterator found = texturesByContent.find(key);
+        if (found != texturesByContent.end()) {
+            TextureHandle existing = found->second.lock();
+            if (existing) {
+                existing->shareCount++;
+                return existing;
+            }
+        }
+
+        TextureRecord* record = new TextureRecord();
+        record->id = TextureLoader::GetShared().Request(path);
+        record->path = path;
+        record->contentHash = key;
+        record->bytes = 0;
+        record->shareCount = 0;
+
+        TextureHandle handle(record, ReleaseTexture);
+        texturesByContent[key] = handle;
+        texturesById[record->id] = handle;
+        return handle;
+    }
+
+    MeshHandle ResourceRegistry::AcquireMesh(uint64_t key, size_t bytes, std::function<Mesh*()> build)
+    {
+        std::unordered_map<uint64_t, MeshRecord>::iterator found = meshesByContent.find(key);
+        if (found != meshesByContent.end()) {
+            MeshHandle existing = found->second.mesh.lock();
+            if (existing) {
+                found->second.shareCount++;
+                return existing;
+            }
+        }
+
+        MeshHandle handle(build(), ReleaseMesh);
+        MeshRecord record;
+        record.mesh = handle;
+        record.bytes = bytes;
+        record.shareCount = 0;
+        meshesByContent[key] = record;
+        return handle;
+    }
+
+    void ResourceRegistry::Update()
+    {
+        TextureLoader& loader = TextureLoader::GetShared();
+        loader.Update();
+
+        std::vector<TextureLoader::UploadEvent> events = loader.TakeEvents();
+        for (size_t i = 0; i < events.size(); i++) {
+            std::unordered_map<GLuint, std::weak_ptr<TextureRecord> >::iterator found = texturesById.find(events[i].texture);
+            TextureHandle record = found != texturesById.end() ? found->second.lock() : TextureHandle();
+            if (!record) {
+                continue;
+            }
+
+            if (events[i].aliasOf == 0) {
+                record->bytes = events[i].bytes;
+                continue;
+            }
+
+            // different files, same pixels: drop the placeholder and point at the existing texture
+            std::unordered_map<GLuint, std::weak_ptr<TextureRecord> >::iterator canonicalFound = texturesById.find(events[i].aliasOf);
+            TextureHandle canonical = canonicalFound != texturesById.end() ? canonicalFound->second.lock() : TextureHandle();
+            if (!canonical) {
+                continue;
+            }
+
+            TextureLoader::Release(record->id);
+            GLState::GetShared().DeleteTexture(record->id);
+            texturesById.erase(found);
+
+            record->id = canonical->id;
+            record->aliasOf = canonical;
+            record->bytes = events[i].bytes;
+            canonical->shareCount++;
+        }
+    }
+
+    void ResourceRegistry::PrintReport()
+    {
+        size_t textureCount = 0, textureShares = 0, textureBytes = 0, textureSaved = 0;
+        for (std::unordered_map<uint64_t, std::weak_ptr<TextureRecord> >::iterator it = texturesByContent.begin(); it != texturesByContent.end(); ++it) {
+            TextureHandle record = it->second.lock();
+            if (!record) {
+                continue;
+            }
+            if (record->aliasOf) {
+                // the alias' own file would have needed its own texture
+                textureSaved += record->bytes * (record->shareCount + 1);
+                textureShares += record->shareCount + 1;
+                continue;
+            }
+            textureCount++;
+            textureShares += record->shareCount;
+            textureBytes += record->bytes;
+            textureSaved += record->bytes * record->shareCount;
+        }
+
+        size_t meshCount = 0, meshShares = 0, meshBytes = 0, meshSaved = 0;
+        for (std::unordered_map<uint64_t, MeshRecord>::iterator it = meshesByContent.begin(); it != meshesByContent.end(); ++it) {
+            if (it->second.mesh.expired()) {
+                continue;
+            }
+            meshCount++;
+            meshShares += it->second.shareCount;
+            meshBytes += it->second.bytes;
+            meshSaved += it->second.bytes * it->second.shareCount;
+        }
+
+        printf("Resource registry\n");
+        printf("  textures : %zu unique, %zu shared references, %.1f MB resident, %.1f MB saved\n",
+            textureCount, textureShares, textureBytes / 1048576.0, textureSaved / 1048576.0);
+        printf("  meshes   : %zu unique, %zu shared references, %.1f MB resident, %.1f MB saved\n",
+            meshCount, meshShares, meshBytes / 1048576.0, meshSaved / 1048576.0);
+    }
+
+}
@@ -0,0 +1,63 @@
+#ifndef ResourceRegistry_hpp
+#define ResourceRegistry_hpp
+
+#include "Mesh.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace gps {
+
+    // GPU texture shared by every mesh that references the same image
+    struct TextureRecord {
+        GLuint id;
+        std::string path;
+        uint64_t contentHash;
+        // video memory, known once the pixels are uploaded
+        size_t bytes;
+        // extra references served by this record instead of a new texture
+        size_t shareCount;
+        // set when the decoded pixels turned out to match an existing texture
+        TextureHandle aliasOf;
+    };
+
+    typedef std::shared_ptr<Mesh> MeshHandle;
+
+    // Process-wide, content-addressed store of textures and meshes. Textures are keyed on the
+    // hash of their file, then on the hash of the decoded pixels; meshes on the hash of their
+    // vertex/index data and textures. Handles are reference counted and release the GL objects
+    // when the last Model3D using them goes away. Context thread only.
+    class ResourceRegistry
+    {
+    public:
+        TextureHandle AcquireTexture(const std::string& path, uint64_t contentHash);
+
+        // build is only called when no live mesh matches key
+        MeshHandle AcquireMesh(uint64_t key, size_t bytes, std::function<Mesh*()> build);
+
+        // Once per frame: streams in decoded textures and folds pixel-identical ones together
+        void Update();
+
+        // How many bytes of video memory the deduplication saved so far
+        void PrintReport();
+
+        static ResourceRegistry& GetShared();
+
+    private:
+        struct MeshRecord {
+            std::weak_ptr<Mesh> mesh;
+            size_t bytes;
+            size_t shareCount;
+        };
+
+        std::unordered_map<uint64_t, std::weak_ptr<TextureRecord> > texturesByContent;
+        std::unordered_map<GLuint, std::weak_ptr<TextureRecord> > texturesById;
+        std::unordered_map<uint64_t, MeshRecord> meshesByContent;
+    };
+
+}
+
+#endif /* ResourceRegistry_hpp */
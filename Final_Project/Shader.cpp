@@ -1,4 +1,14 @@
 #include "Shader.hpp"
+#include "GLState.hpp"
+#include "Hash.hpp"
+#include "ProgramCache.hpp"
+#include "UniformBuffer.hpp"
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 
 namespace gps {
     std::string Shader::readShaderFile(std::string fileName)
@@ -8,6 +18,10 @@ namespace gps {
 
         //open shader file
         shaderFile.open(fileName.c_str());
+        if (!shaderFile.is_open()) {
+            fprintf(stderr, "ERROR: could not open shader file %s\n", fileName.c_str());
+            return shaderString;
+        }
 
         std::stringstream shaderStringStream;
 
@@ -22,69 +36,498 @@ namespace gps {
         return shaderString;
     }
 
-    void Shader::shaderCompileLog(GLuint shaderId)
+    //includes deeper than this are taken for a cycle
+    static const int MAX_INCLUDE_DEPTH = 16;
+
+    std::string Shader::resolveIncludes(const std::string& source, const std::string& fileName, std::vector<std::string>& included, int depth)
+    {
+        size_t slash = fileName.find_last_of("/\\");
+        std::string directory = slash != std::string::npos ? fileName.substr(0, slash + 1) : std::string();
+
+        std::string resolved;
+        std::istringstream lines(source);
+        std::string line;
+        int lineNumber = 0;
+        while (std::getline(lines, line)) {
+            lineNumber++;
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+                resolved += line;
+                resolved += '\n';
+                continue;
+            }
+
+            size_t open = line.find('"', start);
+            size_t close = open != std::string::npos ? line.find('"', open + 1) : std::string::npos;
+            if (close == std::string::npos || depth >= MAX_INCLUDE_DEPTH) {
+                fprintf(stderr, "ERROR: bad #include in %s line %d\n", fileName.c_str(), lineNumber);
+                resolved += '\n';
+                continue;
+            }
+            std::string includeName = directory + line.substr(open + 1, close - open - 1);
+            if (std::find(included.begin(), included.end(), includeName) == included.end()) {
+                included.push_back(includeName);
+                resolved += resolveIncludes(readShaderFile(includeName), includeName, included, depth + 1);
+            }
+            //errors after the include keep the line numbers of this file
+            resolved += "#line " + std::to_string(lineNumber + 1) + "\n";
+        }
+        return resolved;
+    }
+
+    std::string Shader::applyDefines(const std::string& source) const
+    {
+        if (defines.empty()) {
+            return source;
+        }
+        std::string header;
+        for (const std::string& define : defines) {
+            header += "#define " + define + "\n";
+        }
+
+        //#version has to stay the first line
+        size_t version = source.find("#version");
+        size_t versionEnd = version != std::string::npos ? source.find('\n', version) : std::string::npos;
+        if (versionEnd == std::string::npos) {
+            return header + source;
+        }
+        return source.substr(0, versionEnd + 1) + header + "#line 2\n" + source.substr(versionEnd + 1);
+    }
+
+    bool Shader::shaderCompileLog(GLuint shaderId, const std::string& fileName)
     {
         GLint success;
-        GLchar infoLog[512];
 
-        //check compilation info
+        //check compilation info, the log is printed whole
         glGetShaderiv(shaderId, GL_COMPILE_STATUS, &success);
         if(!success)
         {
-            glGetShaderInfoLog(shaderId, 512, NULL, infoLog);
-            std::cout << "Shader compilation error\n" << infoLog << std::endl;
+            GLint logLength = 0;
+            glGetShaderiv(shaderId, GL_INFO_LOG_LENGTH, &logLength);
+            std::vector<GLchar> infoLog(logLength + 1, 0);
+            glGetShaderInfoLog(shaderId, (GLsizei)infoLog.size(), NULL, infoLog.data());
+            fprintf(stderr, "ERROR: compiling %s", fileName.c_str());
+            for (const std::string& define : defines) {
+                fprintf(stderr, " %s", define.c_str());
+            }
+            fprintf(stderr, "\n%s\n", infoLog.data());
         }
+        return success == GL_TRUE;
     }
 
-    void Shader::shaderLinkLog(GLuint shaderProgramId)
+    bool Shader::shaderLinkLog(GLuint shaderProgramId)
     {
         GLint success;
-        GLchar infoLog[512];
 
         //check linking info
         glGetProgramiv(shaderProgramId, GL_LINK_STATUS, &success);
         if(!success) {
-            glGetProgramInfoLog(shaderProgram, 512, NULL, infoLog);
-            std::cout << "Shader linking error\n" << infoLog << std::endl;
+            GLint logLength = 0;
+            glGetProgramiv(shaderProgramId, GL_INFO_LOG_LENGTH, &logLength);
+            std::vector<GLchar> infoLog(logLength + 1, 0);
+            glGetProgramInfoLog(shaderProgramId, (GLsizei)infoLog.size(), NULL, infoLog.data());
+            fprintf(stderr, "ERROR: linking %s and %s\n%s\n", vertexShaderFileName.c_str(), fragmentShaderFileName.c_str(), infoLog.data());
         }
+        return success == GL_TRUE;
     }
 
     void Shader::loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName)
     {
-        //read, parse and compile the vertex shader
-        std::string v = readShaderFile(vertexShaderFileName);
-        const GLchar* vertexShaderString = v.c_str();
-        GLuint vertexShader;
+        readShaderSources(vertexShaderFileName, fragmentShaderFileName);
+        compileShader();
+    }
+
+    void Shader::readShaderSources(std::string vertexShaderFileName, std::string fragmentShaderFileName)
+    {
+        this->vertexShaderFileName = vertexShaderFileName;
+        this->fragmentShaderFileName = fragmentShaderFileName;
+        std::vector<std::string> included;
+        vertexShaderSource = resolveIncludes(readShaderFile(vertexShaderFileName), vertexShaderFileName, included, 0);
+        included.clear();
+        fragmentShaderSource = resolveIncludes(readShaderFile(fragmentShaderFileName), fragmentShaderFileName, included, 0);
+    }
+
+    void Shader::setDefines(const std::vector<std::string>& defines)
+    {
+        this->defines = defines;
+    }
+
+    void Shader::compileShader()
+    {
+        beginCompile();
+        finishCompile();
+    }
+
+    void Shader::enableParallelCompile()
+    {
+        if (GLEW_KHR_parallel_shader_compile) {
+            glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+        }
+    }
+
+    void Shader::beginCompile()
+    {
+        //the defines go into copies, the read sources stay untouched until finishCompile drops them
+        std::string vertexSource = applyDefines(vertexShaderSource);
+        std::string fragmentSource = applyDefines(fragmentShaderSource);
+        sourceHash = HashString(fragmentSource, HashString(vertexSource));
+
+        this->shaderProgram = glCreateProgram();
+        vertexShader = 0;
+        fragmentShader = 0;
+        if (ProgramCache::Load(ProgramCache::GetCachePath(vertexShaderFileName, fragmentShaderFileName, defines), sourceHash, shaderProgram)) {
+            return;
+        }
+
+        //parse and compile the vertex shader
+        const GLchar* vertexShaderString = vertexSource.c_str();
         vertexShader = glCreateShader(GL_VERTEX_SHADER);
         glShaderSource(vertexShader, 1, &vertexShaderString, NULL);
         glCompileShader(vertexShader);
-        //check compilation status
-        shaderCompileLog(vertexShader);
 
-        //read, parse and compile the vertex shader
-        std::string f = readShaderFile(fragmentShaderFileName);
-        const GLchar* fragmentShaderString = f.c_str();
-        GLuint fragmentShader;
+        //parse and compile the fragment shader
+        const GLchar* fragmentShaderString = fragmentSource.c_str();
         fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         glShaderSource(fragmentShader, 1, &fragmentShaderString, NULL);
         glCompileShader(fragmentShader);
-        //check compilation status
-        shaderCompileLog(fragmentShader);
 
-        //attach and link the shader programs
-        this->shaderProgram = glCreateProgram();
+        //attach and link the shader programs, the status is only checked in finishCompile
+        //so the driver can work on it in the meantime
         glAttachShader(this->shaderProgram, vertexShader);
         glAttachShader(this->shaderProgram, fragmentShader);
+        glProgramParameteri(this->shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(this->shaderProgram);
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);
-        //check linking info
-        shaderLinkLog(this->shaderProgram);
+    }
+
+    bool Shader::isCompileDone() const
+    {
+        if (vertexShader == 0 || !GLEW_KHR_parallel_shader_compile) {
+            return true;
+        }
+        GLint done = GL_TRUE;
+        glGetProgramiv(shaderProgram, GL_COMPLETION_STATUS_KHR, &done);
+        return done == GL_TRUE;
+    }
+
+    void Shader::finishCompile()
+    {
+        if (vertexShader != 0) {
+            //check compilation status
+            shaderCompileLog(vertexShader, vertexShaderFileName);
+            shaderCompileLog(fragmentShader, fragmentShaderFileName);
+            //check linking info
+            if (shaderLinkLog(this->shaderProgram)) {
+                ProgramCache::Write(ProgramCache::GetCachePath(vertexShaderFileName, fragmentShaderFileName, defines), sourceHash, shaderProgram);
+            }
+            glDeleteShader(vertexShader);
+            glDeleteShader(fragmentShader);
+            vertexShader = 0;
+            fragmentShader = 0;
+        }
+        reflectUniforms();
+        bindUniformBlocks();
+
+        //the sources are not needed anymore and Shader gets copied around
+        vertexShaderSource.clear();
+        fragmentShaderSource.clear();
     }
 
     void Shader::useShaderProgram()
     {
-        glUseProgram(this->shaderProgram);
+        GLState::GetShared().UseProgram(this->shaderProgram);
+    }
+
+    static bool isSamplerType(GLenum type)
+    {
+        switch (type) {
+        case GL_SAMPLER_1D:
+        case GL_SAMPLER_2D:
+        case GL_SAMPLER_3D:
+        case GL_SAMPLER_CUBE:
+        case GL_SAMPLER_1D_SHADOW:
+        case GL_SAMPLER_2D_SHADOW:
+        case GL_SAMPLER_1D_ARRAY:
+        case GL_SAMPLER_2D_ARRAY:
+        case GL_SAMPLER_1D_ARRAY_SHADOW:
+        case GL_SAMPLER_2D_ARRAY_SHADOW:
+        case GL_SAMPLER_CUBE_SHADOW:
+        case GL_SAMPLER_2D_MULTISAMPLE:
+        case GL_SAMPLER_2D_RECT:
+        case GL_SAMPLER_BUFFER:
+        case GL_INT_SAMPLER_2D:
+        case GL_INT_SAMPLER_BUFFER:
+        case GL_UNSIGNED_INT_SAMPLER_2D:
+        case GL_UNSIGNED_INT_SAMPLER_BUFFER:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void Shader::reflectUniforms()
+    {
+        uniformTable = std::make_shared<UniformTable>();
+
+        GLint uniformCount = 0;
+        GLint maxNameLength = 0;
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORMS, &uniformCount);
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+        std::vector<GLchar> nameBuffer(maxNameLength + 1);
+
+        GLint nextUnit = 0;
+        for (GLint i = 0; i < uniformCount; i++) {
+            ShaderUniform uniform;
+            GLsizei nameLength = 0;
+            glGetActiveUniform(shaderProgram, (GLuint)i, (GLsizei)nameBuffer.size(), &nameLength, &uniform.size, &uniform.type, nameBuffer.data());
+            uniform.name.assign(nameBuffer.data(), nameLength);
+            uniform.location = glGetUniformLocation(shaderProgram, uniform.name.c_str());
+            //members of uniform blocks have no location, they are set through their buffer
+            if (uniform.location < 0) {
+                continue;
+            }
+            uniform.samplerUnit = -1;
+            uniform.cached = false;
+            uniform.warned = false;
+
+            //every sampler keeps its own units for the lifetime of the program
+            if (isSamplerType(uniform.type)) {
+                uniform.samplerUnit = nextUnit;
+                std::vector<GLint> units(uniform.size);
+                for (GLint k = 0; k < uniform.size; k++) {
+                    units[k] = nextUnit++;
+                }
+                glProgramUniform1iv(shaderProgram, uniform.location, uniform.size, units.data());
+            }
+
+            UniformHandle handle = (UniformHandle)uniformTable->uniforms.size();
+            uniformTable->handles[uniform.name] = handle;
+            size_t bracket = uniform.name.find('[');
+            if (bracket != std::string::npos) {
+                uniformTable->handles[uniform.name.substr(0, bracket)] = handle;
+            }
+            uniformTable->uniforms.push_back(uniform);
+        }
+    }
+
+    void Shader::bindUniformBlocks()
+    {
+        GLint blockCount = 0;
+        GLint maxNameLength = 0;
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_BLOCKS, &blockCount);
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &maxNameLength);
+        std::vector<GLchar> nameBuffer(maxNameLength + 1);
+
+        for (GLint i = 0; i < blockCount; i++) {
+            glGetActiveUniformBlockName(shaderProgram, (GLuint)i, (GLsizei)nameBuffer.size(), NULL, nameBuffer.data());
+            const UniformBlockInfo* block = FindUniformBlock(nameBuffer.data());
+            if (block == NULL) {
+                fprintf(stderr, "WARNING: uniform block %s has no binding point\n", nameBuffer.data());
+                continue;
+            }
+
+            //a block bigger than its C++ struct went out of sync with it (drivers may drop the tail padding)
+            GLint dataSize = 0;
+            glGetActiveUniformBlockiv(shaderProgram, (GLuint)i, GL_UNIFORM_BLOCK_DATA_SIZE, &dataSize);
+            if (dataSize > block->size) {
+                fprintf(stderr, "ERROR: uniform block %s is %d bytes, expected at most %d\n", block->name, dataSize, (int)block->size);
+            }
+            glUniformBlockBinding(shaderProgram, (GLuint)i, block->binding);
+        }
+    }
+
+    UniformHandle Shader::getUniform(const std::string& name) const
+    {
+        if (!uniformTable) {
+            return -1;
+        }
+        auto found = uniformTable->handles.find(name);
+        return found != uniformTable->handles.end() ? found->second : -1;
+    }
+
+    GLint Shader::getSamplerUnit(UniformHandle uniform) const
+    {
+        if (uniform < 0) {
+            return -1;
+        }
+        return uniformTable->uniforms[uniform].samplerUnit;
+    }
+
+    GLint Shader::getSamplerUnit(const std::string& name) const
+    {
+        return getSamplerUnit(getUniform(name));
+    }
+
+    static bool isCompatibleType(GLenum uniformType, GLenum valueType)
+    {
+        if (uniformType == valueType) {
+            return true;
+        }
+        //booleans take either integers or floats, samplers take their unit
+        if (uniformType == GL_BOOL) {
+            return valueType == GL_INT || valueType == GL_FLOAT;
+        }
+        return valueType == GL_INT && isSamplerType(uniformType);
+    }
+
+    bool Shader::updateUniform(UniformHandle uniform, GLenum type, const void* value, size_t size)
+    {
+        if (uniform < 0) {
+            return false;
+        }
+
+        ShaderUniform& entry = uniformTable->uniforms[uniform];
+        if (!isCompatibleType(entry.type, type)) {
+            if (!entry.warned) {
+                fprintf(stderr, "WARNING: uniform %s set with a value of the wrong type\n", entry.name.c_str());
+                entry.warned = true;
+            }
+            return false;
+        }
+
+        if (entry.cached && memcmp(entry.value, value, size) == 0) {
+            return false;
+        }
+        memcpy(entry.value, value, size);
+        entry.cached = true;
+        return true;
+    }
+
+    void Shader::setInt(UniformHandle uniform, GLint value)
+    {
+        if (updateUniform(uniform, GL_INT, &value, sizeof(value))) {
+            ShaderUniform& entry = uniformTable->uniforms[uniform];
+            if (entry.samplerUnit >= 0) {
+                entry.samplerUnit = value;
+            }
+            glProgramUniform1i(shaderProgram, entry.location, value);
+        }
+    }
+
+    void Shader::setFloat(UniformHandle uniform, GLfloat value)
+    {
+        if (updateUniform(uniform, GL_FLOAT, &value, sizeof(value))) {
+            glProgramUniform1f(shaderProgram, uniformTable->uniforms[uniform].location, value);
+        }
+    }
+
+    void Shader::setVec3(UniformHandle uniform, const glm::vec3& value)
+    {
+        if (updateUniform(uniform, GL_FLOAT_VEC3, glm::value_ptr(value), sizeof(value))) {
+            glProgramUniform3fv(shaderProgram, uniformTable->uniforms[uniform].location, 1, glm::value_ptr(value));
+        }
+    }
+
+    void Shader::setMat3(UniformHandle uniform, const glm::mat3& value)
+    {
+        if (updateUniform(uniform, GL_FLOAT_MAT3, glm::value_ptr(value), sizeof(value))) {
+            glProgramUniformMatrix3fv(shaderProgram, uniformTable->uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+        }
+    }
+
+    void Shader::setMat4(UniformHandle uniform, const glm::mat4& value)
+    {
+        if (updateUniform(uniform, GL_FLOAT_MAT4, glm::value_ptr(value), sizeof(value))) {
+            glProgramUniformMatrix4fv(shaderProgram, uniformTable->uniforms[uniform].location, 1, GL_FALSE, glm::value_ptr(value));
+        }
+    }
+
+    void Shader::setInt(const std::string& name, GLint value)
+    {
+        setInt(getUniform(name), value);
+    }
+
+    void Shader::setFloat(const std::string& name, GLfloat value)
+    {
+        setFloat(getUniform(name), value);
+    }
+
+    void Shader::setVec3(const std::string& name, const glm::vec3& value)
+    {
+        setVec3(getUniform(name), value);
+    }
+
+    void Shader::setMat3(const std::string& name, const glm::mat3& value)
+    {
+        setMat3(getUniform(name), value);
+    }
+
+    void Shader::setMat4(const std::string& name, const glm::mat4& value)
+    {
+        setMat4(getUniform(name), value);
+    }
+
+    void ShaderVariants::readShaderSources(std::string vertexShaderFileName, std::string fragmentShaderFileName, const std::vector<std::string>& features,
+        const std::vector<unsigned int>& masks)
+    {
+        this->features = features;
+        Shader shader;
+        shader.readShaderSources(vertexShaderFileName, fragmentShaderFileName);
+
+        variantIndices.assign((size_t)1 << features.size(), -1);
+        std::vector<unsigned int> used = masks;
+        if (used.empty()) {
+            for (size_t mask = 0; mask < variantIndices.size(); mask++) {
+                used.push_back((unsigned int)mask);
+            }
+        }
+
+        variants.clear();
+        for (unsigned int mask : used) {
+            mask &= (unsigned int)(variantIndices.size() - 1);
+            if (variantIndices[mask] >= 0) {
+                continue;
+            }
+            std::vector<std::string> defines;
+            for (size_t i = 0; i < features.size(); i++) {
+                if (mask & (1u << i)) {
+                    defines.push_back(features[i]);
+                }
+            }
+            variantIndices[mask] = (int)variants.size();
+            variants.push_back(shader);
+            variants.back().setDefines(defines);
+        }
+    }
+
+    void ShaderVariants::compileShaders()
+    {
+        beginCompile();
+        finishCompile();
+    }
+
+    void ShaderVariants::beginCompile()
+    {
+        for (Shader& variant : variants) {
+            variant.beginCompile();
+        }
+    }
+
+    bool ShaderVariants::isCompileDone() const
+    {
+        for (const Shader& variant : variants) {
+            if (!variant.isCompileDone()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void ShaderVariants::finishCompile()
+    {
+        for (Shader& variant : variants) {
+            variant.finishCompile();
+        }
+    }
+
+    Shader& ShaderVariants::getVariant(unsigned int mask)
+    {
+        int index = variantIndices[mask & (variantIndices.size() - 1)];
+        return variants[index >= 0 ? index : 0];
+    }
+
+    std::vector<Shader>& ShaderVariants::getVariants()
+    {
+        return variants;
     }
 
 }
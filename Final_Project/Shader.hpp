@@ -3,25 +3,138 @@
 
 #include <GL/glew.h>
 
+#include <glm/glm.hpp>
+
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <sstream>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace gps {
 
+// Index of an active uniform in the shader's reflection table, -1 when the program
+// doesn't use it: setting it then does nothing, like location -1 does
+typedef GLint UniformHandle;
+
 class Shader
 {
 public:
     GLuint shaderProgram;
     void loadShader(std::string vertexShaderFileName, std::string fragmentShaderFileName);
+    //reads the sources only, no GL calls so it can run on a worker thread
+    void readShaderSources(std::string vertexShaderFileName, std::string fragmentShaderFileName);
+    //#define lines compileShader inserts after the #version line of both stages
+    void setDefines(const std::vector<std::string>& defines);
+    //compiles and links the sources read by readShaderSources, beginCompile and finishCompile in one go
+    void compileShader();
+    //loads the program from the binary cache, or starts compiling and linking it; with
+    //KHR_parallel_shader_compile the driver does the work on its own threads
+    void beginCompile();
+    //true once finishCompile would not wait for the driver
+    bool isCompileDone() const;
+    //waits for the link, reports errors, reflects the uniforms and caches the binary
+    void finishCompile();
+    //lets the driver compile on as many threads as it likes, where it supports that
+    static void enableParallelCompile();
     void useShaderProgram();
 
+    //handle of an active uniform, arrays answer to both "name" and "name[0]"
+    UniformHandle getUniform(const std::string& name) const;
+    //texture unit given to a sampler uniform after linking, -1 for other uniforms
+    GLint getSamplerUnit(UniformHandle uniform) const;
+    GLint getSamplerUnit(const std::string& name) const;
+
+    //typed uploads, skipped when the value equals the last one uploaded; they go
+    //through glProgramUniform, so the program doesn't have to be in use
+    void setInt(UniformHandle uniform, GLint value);
+    void setFloat(UniformHandle uniform, GLfloat value);
+    void setVec3(UniformHandle uniform, const glm::vec3& value);
+    void setMat3(UniformHandle uniform, const glm::mat3& value);
+    void setMat4(UniformHandle uniform, const glm::mat4& value);
+
+    //the same by name, a hash lookup instead of a glGetUniformLocation per call
+    void setInt(const std::string& name, GLint value);
+    void setFloat(const std::string& name, GLfloat value);
+    void setVec3(const std::string& name, const glm::vec3& value);
+    void setMat3(const std::string& name, const glm::mat3& value);
+    void setMat4(const std::string& name, const glm::mat4& value);
+
 private:
+    struct ShaderUniform {
+        std::string name;
+        GLint location;
+        GLenum type;
+        GLint size;
+        GLint samplerUnit;
+        //last uploaded value, valid once cached is set
+        bool cached;
+        bool warned;
+        unsigned char value[sizeof(glm::mat4)];
+    };
+
+    struct UniformTable {
+        std::vector<ShaderUniform> uniforms;
+        std::unordered_map<std::string, UniformHandle> handles;
+    };
+
+    std::string vertexShaderSource;
+    std::string fragmentShaderSource;
+    std::vector<std::string> defines;
+    std::string vertexShaderFileName;
+    std::string fragmentShaderFileName;
+    //between beginCompile and finishCompile, 0 when the program came from the cache
+    GLuint vertexShader = 0;
+    GLuint fragmentShader = 0;
+    uint64_t sourceHash = 0;
+    //shared by the copies of this Shader, so they all agree on the cached values
+    std::shared_ptr<UniformTable> uniformTable;
+
     std::string readShaderFile(std::string fileName);
-    void shaderCompileLog(GLuint shaderId);
-    void shaderLinkLog(GLuint shaderProgramId);
+    //replaces every #include "name" line by the file it names, relative to fileName's
+    //directory; a file already in included is left out
+    std::string resolveIncludes(const std::string& source, const std::string& fileName, std::vector<std::string>& included, int depth);
+    std::string applyDefines(const std::string& source) const;
+    bool shaderCompileLog(GLuint shaderId, const std::string& fileName);
+    bool shaderLinkLog(GLuint shaderProgramId);
+    void reflectUniforms();
+    //points the program's blocks at the shared binding points of UniformBuffer.hpp
+    void bindUniformBlocks();
+    //true when the value differs from the cached one (and caches it), false to skip the upload
+    bool updateUniform(UniformHandle uniform, GLenum type, const void* value, size_t size);
+};
+
+//Permutations of one shader: every feature name is a #define, bit i of a variant's mask
+//defines features[i]. The variants are compiled up front, the renderer picks one per
+//pass from the state it draws with instead of the shader branching on it per fragment
+class ShaderVariants
+{
+public:
+    //reads the sources once, no GL calls so it can run on a worker thread; only the
+    //combinations in masks get a variant, every one of them when it is empty
+    void readShaderSources(std::string vertexShaderFileName, std::string fragmentShaderFileName, const std::vector<std::string>& features,
+        const std::vector<unsigned int>& masks = std::vector<unsigned int>());
+    //compiles and links every variant
+    void compileShaders();
+    //the same split in two, the variants compile side by side in between
+    void beginCompile();
+    //true once every variant is
+    bool isCompileDone() const;
+    void finishCompile();
+
+    //mask has to be one of the combinations given to readShaderSources, others get the first variant
+    Shader& getVariant(unsigned int mask);
+    //all of them, to set the uniforms they share
+    std::vector<Shader>& getVariants();
+
+private:
+    std::vector<std::string> features;
+    std::vector<Shader> variants;
+    //position in variants of every mask, -1 for the combinations left out
+    std::vector<int> variantIndices;
 };
 
 }
@@ -7,6 +7,8 @@
 //
 
 #include "SkyBox.hpp"
+#include "GLState.hpp"
+#include "TextureContainer.hpp"
 
 namespace gps {
     
@@ -17,60 +19,91 @@ namespace gps {
     
     void SkyBox::Load(std::vector<const GLchar*> cubeMapFaces)
     {
-        cubemapTexture = LoadSkyBoxTextures(cubeMapFaces);
+        ReadFaces(cubeMapFaces);
+        Upload();
+    }
+
+    void SkyBox::ReadFaces(std::vector<const GLchar*> cubeMapFaces)
+    {
+        int n;
+        int force_channels = 3;
+
+        faceImages.resize(cubeMapFaces.size());
+        for(GLuint i = 0; i < cubeMapFaces.size(); i++)
+        {
+            faceImages[i].pixels = NULL;
+            faceImages[i].internalFormat = 0;
+
+            // cooked faces are uploaded as they are
+            TextureContainer container;
+            if (container.Open(cubeMapFaces[i]) && (faceImages[i].internalFormat = container.GetInternalFormat()) != 0) {
+                TextureLevel level = container.GetLevel(0);
+                faceImages[i].blocks.assign(level.data, level.data + level.size);
+                faceImages[i].width = level.width;
+                faceImages[i].height = level.height;
+                continue;
+            }
+
+            // pool workers may still carry TextureLoader's flip, cube map faces are stored top-down
+            stbi_set_flip_vertically_on_load_thread(0);
+            faceImages[i].pixels = stbi_load(cubeMapFaces[i], &faceImages[i].width, &faceImages[i].height, &n, force_channels);
+            if (!faceImages[i].pixels) {
+                fprintf(stderr, "ERROR: could not load %s\n", cubeMapFaces[i]);
+            }
+        }
+    }
+
+    void SkyBox::Upload()
+    {
+        cubemapTexture = LoadSkyBoxTextures();
         InitSkyBox();
     }
     
-    void SkyBox::Draw(gps::Shader shader, glm::mat4 viewMatrix, glm::mat4 projectionMatrix)
+    void SkyBox::Draw(gps::Shader& shader)
     {
         shader.useShaderProgram();
         
-        //set the view and projection matrices
-        glm::mat4 transformedView = glm::mat4(glm::mat3(viewMatrix));
-        glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(transformedView));
-        glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "projection"), 1, GL_FALSE, glm::value_ptr(projectionMatrix));
-        
-        glDepthFunc(GL_LEQUAL);
+        GLState& state = GLState::GetShared();
+        state.DepthFunc(GL_LEQUAL);
         
-        glBindVertexArray(skyboxVAO);
-        glActiveTexture(GL_TEXTURE0);
-        glUniform1i(glGetUniformLocation(shader.shaderProgram, "skybox"), 0);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemapTexture);
+        state.BindVertexArray(skyboxVAO);
+        state.BindTexture((GLuint)shader.getSamplerUnit("skybox"), GL_TEXTURE_CUBE_MAP, cubemapTexture);
         glDrawArrays(GL_TRIANGLES, 0, 36);
-        glBindVertexArray(0);
         
-        glDepthFunc(GL_LESS);
+        state.DepthFunc(GL_LESS);
     }
     
-    GLuint SkyBox::LoadSkyBoxTextures(std::vector<const GLchar*> skyBoxFaces)
+    GLuint SkyBox::LoadSkyBoxTextures()
     {
         GLuint textureID;
         glGenTextures(1, &textureID);
-        glActiveTexture(GL_TEXTURE0);
         
-        int width,height, n;
-        unsigned char* image;
-        int force_channels = 3;
-        
-        glBindTexture(GL_TEXTURE_CUBE_MAP, textureID);
-        for(GLuint i = 0; i < skyBoxFaces.size(); i++)
+        GLState::GetShared().BindTextureForEdit(GL_TEXTURE_CUBE_MAP, textureID);
+        for(GLuint i = 0; i < faceImages.size(); i++)
         {
-            image = stbi_load(skyBoxFaces[i], &width, &height, &n, force_channels);
-            if (!image) {
-                fprintf(stderr, "ERROR: could not load %s\n", skyBoxFaces[i]);
-                return false;
+            if (!faceImages[i].blocks.empty()) {
+                glCompressedTexImage2D(
+                                       GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0,
+                                       faceImages[i].internalFormat, faceImages[i].width, faceImages[i].height, 0,
+                                       (GLsizei)faceImages[i].blocks.size(), faceImages[i].blocks.data()
+                                       );
+                continue;
+            }
+            if (!faceImages[i].pixels) {
+                continue;
             }
             glTexImage2D(
                          GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0,
-                         GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image
+                         GL_RGB, faceImages[i].width, faceImages[i].height, 0, GL_RGB, GL_UNSIGNED_BYTE, faceImages[i].pixels
                          );
+            stbi_image_free(faceImages[i].pixels);
         }
+        faceImages.clear();
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
         
         return textureID;
     }
@@ -124,14 +157,12 @@ namespace gps {
         glGenVertexArrays(1, &(this->skyboxVAO));
         glGenBuffers(1, &skyboxVBO);
         
-        glBindVertexArray(skyboxVAO);
+        GLState::GetShared().BindVertexArray(skyboxVAO);
         glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
         glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
         
         glEnableVertexAttribArray(0);
         glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0);
-        
-        glBindVertexArray(0);
     }
     
     GLuint SkyBox::GetTextureId()
@@ -22,13 +22,27 @@ namespace gps {
     public:
         SkyBox();
         void Load(std::vector<const GLchar*> cubeMapFaces);
-        void Draw(gps::Shader shader, glm::mat4 viewMatrix, glm::mat4 projectionMatrix);
+        //decodes the face images, no GL calls so it can run on a worker thread
+        void ReadFaces(std::vector<const GLchar*> cubeMapFaces);
+        //creates the cube map and the cube geometry from the decoded faces
+        void Upload();
+        //the view and projection come from the frame uniform block
+        void Draw(gps::Shader& shader);
         GLuint GetTextureId();
     private:
         GLuint skyboxVAO;
         GLuint skyboxVBO;
         GLuint cubemapTexture;
-        GLuint LoadSkyBoxTextures(std::vector<const GLchar*> cubeMapFaces);
+        struct FaceImage {
+            unsigned char* pixels;
+            int width;
+            int height;
+            // set instead of pixels when the face comes from a cooked container
+            std::vector<unsigned char> blocks;
+            GLenum internalFormat;
+        };
+        std::vector<FaceImage> faceImages;
+        GLuint LoadSkyBoxTextures();
         void InitSkyBox();
     };
 }
@@ -0,0 +1,202 @@
+#include "StartupGraph.hpp"
+
+#include <cstdio>
+
+namespace gps {
+
+    int StartupGraph::AddTask(const std::string& name, std::function<void()> work, std::function<void()> finish,
+        std::vector<int> dependencies)
+    {
+        Task task;
+        task.name = name;
+        task.work = work;
+        task.finish = finish;
+        task.dependencies = dependencies;
+        task.pendingDependencies = (int)dependencies.size();
+        task.workStart = task.workEnd = 0.0;
+        task.finishStart = task.finishEnd = 0.0;
+        task.pollTime = 0.0;
+
+        int taskId = (int)tasks.size();
+        for (size_t i = 0; i < dependencies.size(); i++) {
+            tasks[dependencies[i]].dependents.push_back(taskId);
+        }
+        tasks.push_back(task);
+
+        return taskId;
+    }
+
+    int StartupGraph::AddPollTask(const std::string& name, std::function<bool()> poll, std::vector<int> dependencies)
+    {
+        int taskId = AddTask(name, NULL, NULL, dependencies);
+        tasks[taskId].poll = poll;
+        return taskId;
+    }
+
+    double StartupGraph::Elapsed()
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - runStart).count();
+    }
+
+    void StartupGraph::Launch(ThreadPool& pool, int taskId)
+    {
+        if (!tasks[taskId].work) {
+            // nothing to prepare, the context thread picks it up directly
+            tasks[taskId].workStart = tasks[taskId].workEnd = Elapsed();
+            contextReady.push_back(taskId);
+            return;
+        }
+
+        pool.Submit([this, taskId]() {
+            Task& task = tasks[taskId];
+            task.workStart = Elapsed();
+            task.work();
+            task.workEnd = Elapsed();
+
+            {
+                std::lock_guard<std::mutex> lock(completedMutex);
+                completed.push_back(taskId);
+            }
+            completedCondition.notify_one();
+        });
+    }
+
+    void StartupGraph::Complete(ThreadPool& pool, int taskId)
+    {
+        Task& task = tasks[taskId];
+        task.finishEnd = Elapsed();
+        if (task.poll) {
+            task.finishStart = task.finishEnd - task.pollTime;
+        }
+
+        for (size_t i = 0; i < task.dependents.size(); i++) {
+            int dependent = task.dependents[i];
+            if (--tasks[dependent].pendingDependencies == 0) {
+                Launch(pool, dependent);
+            }
+        }
+    }
+
+    bool StartupGraph::Poll(int taskId)
+    {
+        Task& task = tasks[taskId];
+        double start = Elapsed();
+        bool done = task.poll();
+        task.pollTime += Elapsed() - start;
+        return done;
+    }
+
+    int StartupGraph::GetTaskCount()
+    {
+        return (int)tasks.size();
+    }
+
+    void StartupGraph::Run(ThreadPool& pool)
+    {
+        runStart = std::chrono::high_resolution_clock::now();
+
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (tasks[i].pendingDependencies == 0) {
+                Launch(pool, (int)i);
+            }
+        }
+
+        size_t remaining = tasks.size();
+        while (remaining > 0) {
+            // the waiting tasks get another try between every other one
+            for (size_t i = 0; i < polling.size();) {
+                int taskId = polling[i];
+                if (Poll(taskId)) {
+                    polling.erase(polling.begin() + i);
+                    Complete(pool, taskId);
+                    remaining--;
+                }
+                else {
+                    i++;
+                }
+            }
+            if (remaining == 0) {
+                break;
+            }
+
+            int taskId;
+            if (!contextReady.empty()) {
+                taskId = contextReady.front();
+                contextReady.pop_front();
+            }
+            else {
+                std::unique_lock<std::mutex> lock(completedMutex);
+                if (polling.empty()) {
+                    completedCondition.wait(lock, [this]() { return !completed.empty(); });
+                }
+                else if (!completedCondition.wait_for(lock, std::chrono::milliseconds(1), [this]() { return !completed.empty(); })) {
+                    continue;
+                }
+                taskId = completed.front();
+                completed.pop_front();
+            }
+
+            // GL objects are created in the order the workers finish
+            Task& task = tasks[taskId];
+            task.finishStart = Elapsed();
+            if (task.poll) {
+                if (!Poll(taskId)) {
+                    polling.push_back(taskId);
+                    continue;
+                }
+            }
+            else if (task.finish) {
+                task.finish();
+            }
+            Complete(pool, taskId);
+            remaining--;
+        }
+
+        runTime = Elapsed();
+    }
+
+    void StartupGraph::PrintReport()
+    {
+        // longest chain of work + finish costs; tasks are added after their dependencies
+        std::vector<double> pathCost(tasks.size(), 0.0);
+        std::vector<int> pathPrevious(tasks.size(), -1);
+        double serialTime = 0.0;
+        int pathEnd = -1;
+
+        printf("Startup report\n");
+        printf("  %-40s %10s %10s %10s\n", "task", "work ms", "upload ms", "ready at");
+        for (size_t i = 0; i < tasks.size(); i++) {
+            const Task& task = tasks[i];
+            double cost = (task.workEnd - task.workStart) + (task.finishEnd - task.finishStart);
+            serialTime += cost;
+
+            for (size_t d = 0; d < task.dependencies.size(); d++) {
+                int dependency = task.dependencies[d];
+                if (pathCost[dependency] > pathCost[i]) {
+                    pathCost[i] = pathCost[dependency];
+                    pathPrevious[i] = dependency;
+                }
+            }
+            pathCost[i] += cost;
+            if (pathEnd < 0 || pathCost[i] > pathCost[pathEnd]) {
+                pathEnd = (int)i;
+            }
+
+            printf("  %-40s %10.1f %10.1f %10.1f\n", task.name.c_str(),
+                task.workEnd - task.workStart, task.finishEnd - task.finishStart, task.finishEnd);
+        }
+
+        printf("  Serial order    : %.1f ms\n", serialTime);
+        printf("  Pipelined       : %.1f ms\n", runTime);
+        printf("  Saved           : %.1f ms\n", serialTime - runTime);
+
+        if (pathEnd >= 0) {
+            std::string path;
+            for (int i = pathEnd; i >= 0; i = pathPrevious[i]) {
+                path = tasks[i].name + (path.empty() ? "" : " -> ") + path;
+            }
+            printf("  Critical path   : %s (%.1f ms)\n", path.c_str(), pathCost[pathEnd]);
+        }
+    }
+
+}
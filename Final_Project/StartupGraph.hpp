@@ -0,0 +1,71 @@
+#ifndef StartupGraph_hpp
+#define StartupGraph_hpp
+
+#include "ThreadPool.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gps {
+
+    // Dependency aware startup: the CPU part of every task (file I/O, parsing, decoding)
+    // runs on a worker pool while the GL part runs on the context thread as results arrive
+    class StartupGraph
+    {
+    public:
+        // work runs on a worker (may be empty), finish runs on the context thread (may be empty),
+        // the task starts once the finish step of all its dependencies is done
+        int AddTask(const std::string& name, std::function<void()> work, std::function<void()> finish,
+            std::vector<int> dependencies = std::vector<int>());
+        // A context thread task that is done once poll returns true, until then it is retried
+        // between the other tasks instead of blocking the context thread
+        int AddPollTask(const std::string& name, std::function<bool()> poll,
+            std::vector<int> dependencies = std::vector<int>());
+        int GetTaskCount();
+
+        // Executes the graph, returns once every task has finished
+        void Run(ThreadPool& pool);
+
+        // Per task timings, critical path and time saved compared with running everything serially
+        void PrintReport();
+
+    private:
+        struct Task {
+            std::string name;
+            std::function<void()> work;
+            std::function<void()> finish;
+            std::function<bool()> poll;
+            std::vector<int> dependencies;
+            std::vector<int> dependents;
+            int pendingDependencies;
+            double workStart, workEnd;
+            double finishStart, finishEnd;
+            // spent inside poll, the waits between the calls are not the task's cost
+            double pollTime;
+        };
+
+        std::vector<Task> tasks;
+        std::chrono::high_resolution_clock::time_point runStart;
+        double runTime;
+
+        std::mutex completedMutex;
+        std::condition_variable completedCondition;
+        std::deque<int> completed;
+        std::deque<int> contextReady;
+        std::vector<int> polling;
+
+        void Launch(ThreadPool& pool, int taskId);
+        // records the end of the task and launches the dependents it was the last one for
+        void Complete(ThreadPool& pool, int taskId);
+        bool Poll(int taskId);
+        double Elapsed();
+    };
+
+}
+
+#endif /* StartupGraph_hpp */
@@ -0,0 +1,235 @@
+#include "TextureContainer.hpp"
+#include "Hash.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace gps {
+
+    struct TextureContainerHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint32_t format;
+        uint32_t flags;
+        uint32_t width;
+        uint32_t height;
+        uint32_t levelCount;
+        uint32_t reserved;
+    };
+
+    struct TextureContainerEntry {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    static const char TEXTURE_CONTAINER_MAGIC[4] = { 'G', 'T', 'E', 'X' };
+
+    static int LevelDimension(int size, int level)
+    {
+        int dimension = size >> level;
+        return dimension > 0 ? dimension : 1;
+    }
+
+    TextureContainer::TextureContainer() : format(0), flags(0), width(0), height(0), levelCount(0)
+    {
+    }
+
+    std::string TextureContainer::GetContainerPath(const std::string& sourceFile)
+    {
+        return sourceFile + ".gtex";
+    }
+
+    size_t TextureContainer::GetBlockBytes(uint32_t format)
+    {
+        switch (format) {
+        case TEXTURE_FORMAT_BC1:
+        case TEXTURE_FORMAT_BC4:
+            return 8;
+        case TEXTURE_FORMAT_BC3:
+        case TEXTURE_FORMAT_BC7:
+            return 16;
+        default:
+            return 0;
+        }
+    }
+
+    size_t TextureContainer::GetLevelBytes(uint32_t format, int width, int height)
+    {
+        // partial blocks at the edges are stored whole
+        return (size_t)((width + 3) / 4) * ((height + 3) / 4) * GetBlockBytes(format);
+    }
+
+    bool TextureContainer::Open(const std::string& sourceFile)
+    {
+        Close();
+
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        if (!GetFileStamp(sourceFile, sourceSize, sourceTime)) {
+            return false;
+        }
+
+        if (!file.Open(GetContainerPath(sourceFile))) {
+            return false;
+        }
+
+        const unsigned char* data = file.GetData();
+        size_t size = file.GetSize();
+        const TextureContainerHeader* header = reinterpret_cast<const TextureContainerHeader*>(data);
+
+        if (size < sizeof(TextureContainerHeader) ||
+            memcmp(header->magic, TEXTURE_CONTAINER_MAGIC, sizeof(TEXTURE_CONTAINER_MAGIC)) != 0 ||
+            header->version != TEXTURE_CONTAINER_VERSION ||
+            header->sourceSize != sourceSize ||
+            header->sourceTime != sourceTime ||
+            GetBlockBytes(header->format) == 0 ||
+            header->width == 0 || header->height == 0 || header->levelCount == 0 || header->levelCount > 32 ||
+            size < sizeof(TextureContainerHeader) + header->levelCount * sizeof(TextureContainerEntry)) {
+            Close();
+            return false;
+        }
+
+        // every level must be complete and inside the mapping
+        const TextureContainerEntry* entries = reinterpret_cast<const TextureContainerEntry*>(data + sizeof(TextureContainerHeader));
+        for (uint32_t i = 0; i < header->levelCount; i++) {
+            int levelWidth = LevelDimension((int)header->width, (int)i);
+            int levelHeight = LevelDimension((int)header->height, (int)i);
+            if (entries[i].size != GetLevelBytes(header->format, levelWidth, levelHeight) ||
+                entries[i].offset + entries[i].size > size) {
+                Close();
+                return false;
+            }
+        }
+
+        format = header->format;
+        flags = header->flags;
+        width = (int)header->width;
+        height = (int)header->height;
+        levelCount = (int)header->levelCount;
+        return true;
+    }
+
+    void TextureContainer::Close()
+    {
+        file.Close();
+        format = 0;
+        flags = 0;
+        width = height = 0;
+        levelCount = 0;
+    }
+
+    uint32_t TextureContainer::GetFormat()
+    {
+        return format;
+    }
+
+    uint32_t TextureContainer::GetFlags()
+    {
+        return flags;
+    }
+
+    int TextureContainer::GetLevelCount()
+    {
+        return levelCount;
+    }
+
+    TextureLevel TextureContainer::GetLevel(int level)
+    {
+        const unsigned char* data = file.GetData();
+        const TextureContainerEntry* entry = reinterpret_cast<const TextureContainerEntry*>(data + sizeof(TextureContainerHeader)) + level;
+
+        TextureLevel textureLevel;
+        textureLevel.data = data + entry->offset;
+        textureLevel.size = (size_t)entry->size;
+        textureLevel.width = LevelDimension(width, level);
+        textureLevel.height = LevelDimension(height, level);
+        return textureLevel;
+    }
+
+    GLenum TextureContainer::GetInternalFormat()
+    {
+        bool srgb = (flags & TEXTURE_FLAG_SRGB) != 0;
+
+        switch (format) {
+        case TEXTURE_FORMAT_BC1:
+            if (!GLEW_EXT_texture_compression_s3tc || (srgb && !GLEW_EXT_texture_sRGB)) {
+                return 0;
+            }
+            return srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case TEXTURE_FORMAT_BC3:
+            if (!GLEW_EXT_texture_compression_s3tc || (srgb && !GLEW_EXT_texture_sRGB)) {
+                return 0;
+            }
+            return srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case TEXTURE_FORMAT_BC4:
+            // RGTC is core since OpenGL 3.0
+            return GL_COMPRESSED_RED_RGTC1;
+        case TEXTURE_FORMAT_BC7:
+            // BPTC only became core in 4.2, the 4.1 context needs the extension
+            if (!GLEW_ARB_texture_compression_bptc) {
+                return 0;
+            }
+            return srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+        default:
+            return 0;
+        }
+    }
+
+    bool TextureContainer::Write(const std::string& sourceFile, uint32_t format, uint32_t flags, int width, int height,
+        const std::vector<std::vector<unsigned char> >& levels)
+    {
+        TextureContainerHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TEXTURE_CONTAINER_MAGIC, sizeof(TEXTURE_CONTAINER_MAGIC));
+        header.version = TEXTURE_CONTAINER_VERSION;
+        header.format = format;
+        header.flags = flags;
+        header.width = (uint32_t)width;
+        header.height = (uint32_t)height;
+        header.levelCount = (uint32_t)levels.size();
+        if (!GetFileStamp(sourceFile, header.sourceSize, header.sourceTime)) {
+            return false;
+        }
+
+        // block data follows the header and the level table, compressed blocks need no alignment
+        std::vector<TextureContainerEntry> entries(levels.size());
+        uint64_t offset = sizeof(TextureContainerHeader) + levels.size() * sizeof(TextureContainerEntry);
+        for (size_t i = 0; i < levels.size(); i++) {
+            entries[i].offset = offset;
+            entries[i].size = levels[i].size();
+            offset += levels[i].size();
+        }
+
+        // write to a temporary file first so a crash never leaves a half written container
+        std::string containerPath = GetContainerPath(sourceFile);
+        std::string tempPath = containerPath + ".tmp";
+        FILE* file = fopen(tempPath.c_str(), "wb");
+        if (!file) {
+            fprintf(stderr, "WARNING: could not write texture container %s\n", containerPath.c_str());
+            return false;
+        }
+
+        fwrite(&header, sizeof(header), 1, file);
+        if (!entries.empty()) {
+            fwrite(entries.data(), sizeof(TextureContainerEntry), entries.size(), file);
+        }
+        for (size_t i = 0; i < levels.size(); i++) {
+            fwrite(levels[i].data(), 1, levels[i].size(), file);
+        }
+
+        bool ok = !ferror(file);
+        fclose(file);
+
+        remove(containerPath.c_str());
+        if (!ok || rename(tempPath.c_str(), containerPath.c_str()) != 0) {
+            remove(tempPath.c_str());
+            fprintf(stderr, "WARNING: could not write texture container %s\n", containerPath.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+}
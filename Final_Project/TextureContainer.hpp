@@ -0,0 +1,76 @@
+#ifndef TextureContainer_hpp
+#define TextureContainer_hpp
+
+#include "MappedFile.hpp"
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace gps {
+
+    // bump whenever the layout of the container changes
+    const uint32_t TEXTURE_CONTAINER_VERSION = 1;
+
+    enum TextureFormat {
+        TEXTURE_FORMAT_BC1 = 1, // RGB, 4 bits per texel
+        TEXTURE_FORMAT_BC3 = 2, // RGBA, 8 bits per texel
+        TEXTURE_FORMAT_BC4 = 3, // one channel, 4 bits per texel
+        TEXTURE_FORMAT_BC7 = 4  // RGBA, 8 bits per texel, needs BPTC support
+    };
+
+    enum TextureFlags {
+        TEXTURE_FLAG_SRGB = 1,         // color data, the sampler converts it to linear
+        TEXTURE_FLAG_REPLICATE_RED = 2 // gray image stored in one channel, sampled as (r, r, r, 1)
+    };
+
+    // View of one mip level inside a mapped container
+    struct TextureLevel {
+        const unsigned char* data;
+        size_t size;
+        int width;
+        int height;
+    };
+
+    // Block compressed image with its whole mip chain, written next to the source image
+    // by the cooker and invalidated when the source size or mtime changes
+    class TextureContainer
+    {
+    public:
+        TextureContainer();
+
+        // Maps the container of sourceFile, fails if it is missing or stale
+        bool Open(const std::string& sourceFile);
+        void Close();
+
+        uint32_t GetFormat();
+        uint32_t GetFlags();
+        int GetLevelCount();
+        TextureLevel GetLevel(int level);
+
+        // GL internal format of the blocks, 0 when the driver can't sample them
+        GLenum GetInternalFormat();
+
+        // Writes the container of sourceFile, levels holds the blocks of each mip level
+        static bool Write(const std::string& sourceFile, uint32_t format, uint32_t flags, int width, int height,
+            const std::vector<std::vector<unsigned char> >& levels);
+        static std::string GetContainerPath(const std::string& sourceFile);
+
+        // 8 for BC1/BC4, 16 for BC3/BC7
+        static size_t GetBlockBytes(uint32_t format);
+        static size_t GetLevelBytes(uint32_t format, int width, int height);
+
+    private:
+        MappedFile file;
+        uint32_t format;
+        uint32_t flags;
+        int width;
+        int height;
+        int levelCount;
+    };
+
+}
+
+#endif /* TextureContainer_hpp */
@@ -0,0 +1,543 @@
+#include "TextureCooker.hpp"
+#include "TextureContainer.hpp"
+#include "ThreadPool.hpp"
+
+#include "stb_image.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace gps {
+
+    // RGBA image with float channels in [0, 1]
+    struct CookImage {
+        int width;
+        int height;
+        std::vector<float> texels;
+    };
+
+    static const char* FormatName(uint32_t format)
+    {
+        switch (format) {
+        case TEXTURE_FORMAT_BC1: return "BC1";
+        case TEXTURE_FORMAT_BC3: return "BC3";
+        case TEXTURE_FORMAT_BC4: return "BC4";
+        case TEXTURE_FORMAT_BC7: return "BC7";
+        default: return "?";
+        }
+    }
+
+    struct SrgbTable {
+        float values[256];
+
+        SrgbTable() {
+            for (int i = 0; i < 256; i++) {
+                float c = i / 255.0f;
+                values[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            }
+        }
+    };
+
+    static float SrgbToLinear(unsigned char value)
+    {
+        static const SrgbTable table;
+        return table.values[value];
+    }
+
+    static unsigned char LinearToSrgb(float value)
+    {
+        value = std::min(std::max(value, 0.0f), 1.0f);
+        float c = value <= 0.0031308f ? value * 12.92f : 1.055f * powf(value, 1.0f / 2.4f) - 0.055f;
+        return (unsigned char)(c * 255.0f + 0.5f);
+    }
+
+    static unsigned char ToByte(float value)
+    {
+        value = std::min(std::max(value, 0.0f), 1.0f);
+        return (unsigned char)(value * 255.0f + 0.5f);
+    }
+
+    // alpha is never gamma encoded
+    static CookImage Decode(const unsigned char* pixels, int width, int height, bool srgb)
+    {
+        CookImage image;
+        image.width = width;
+        image.height = height;
+        image.texels.resize((size_t)width * height * 4);
+        for (size_t i = 0; i < image.texels.size(); i++) {
+            bool color = (i & 3) != 3;
+            image.texels[i] = srgb && color ? SrgbToLinear(pixels[i]) : pixels[i] / 255.0f;
+        }
+        return image;
+    }
+
+    static std::vector<unsigned char> Encode(const CookImage& image, bool srgb)
+    {
+        std::vector<unsigned char> pixels(image.texels.size());
+        for (size_t i = 0; i < pixels.size(); i++) {
+            bool color = (i & 3) != 3;
+            pixels[i] = srgb && color ? LinearToSrgb(image.texels[i]) : ToByte(image.texels[i]);
+        }
+        return pixels;
+    }
+
+    // 2x2 box filter, odd edges reuse their last row or column
+    static CookImage Downsample(const CookImage& source)
+    {
+        CookImage image;
+        image.width = std::max(source.width / 2, 1);
+        image.height = std::max(source.height / 2, 1);
+        image.texels.resize((size_t)image.width * image.height * 4);
+
+        for (int y = 0; y < image.height; y++) {
+            int y0 = std::min(2 * y, source.height - 1);
+            int y1 = std::min(2 * y + 1, source.height - 1);
+            for (int x = 0; x < image.width; x++) {
+                int x0 = std::min(2 * x, source.width - 1);
+                int x1 = std::min(2 * x + 1, source.width - 1);
+                for (int c = 0; c < 4; c++) {
+                    float sum = source.texels[((size_t)y0 * source.width + x0) * 4 + c] +
+                        source.texels[((size_t)y0 * source.width + x1) * 4 + c] +
+                        source.texels[((size_t)y1 * source.width + x0) * 4 + c] +
+                        source.texels[((size_t)y1 * source.width + x1) * 4 + c];
+                    image.texels[((size_t)y * image.width + x) * 4 + c] = sum * 0.25f;
+                }
+            }
+        }
+        return image;
+    }
+
+    // Line through the block texels along their principal axis, channels 3 for RGB, 4 for RGBA
+    static void FitEndpoints(const float texels[16][4], int channels, float* low, float* high)
+    {
+        float mean[4] = { 0, 0, 0, 0 };
+        for (int i = 0; i < 16; i++) {
+            for (int c = 0; c < channels; c++) {
+                mean[c] += texels[i][c] / 16.0f;
+            }
+        }
+
+        float covariance[4][4] = { { 0 } };
+        for (int i = 0; i < 16; i++) {
+            for (int a = 0; a < channels; a++) {
+                for (int b = 0; b < channels; b++) {
+                    covariance[a][b] += (texels[i][a] - mean[a]) * (texels[i][b] - mean[b]);
+                }
+            }
+        }
+
+        // power iteration, started from the extent of the block so it rarely starts orthogonal
+        float axis[4] = { 0, 0, 0, 0 };
+        for (int c = 0; c < channels; c++) {
+            float minimum = texels[0][c], maximum = texels[0][c];
+            for (int i = 1; i < 16; i++) {
+                minimum = std::min(minimum, texels[i][c]);
+                maximum = std::max(maximum, texels[i][c]);
+            }
+            axis[c] = maximum - minimum;
+        }
+        for (int iteration = 0; iteration < 8; iteration++) {
+            float next[4] = { 0, 0, 0, 0 };
+            float length = 0.0f;
+            for (int a = 0; a < channels; a++) {
+                for (int b = 0; b < channels; b++) {
+                    next[a] += covariance[a][b] * axis[b];
+                }
+                length += next[a] * next[a];
+            }
+            if (length < 1e-12f) {
+                break;
+            }
+            length = sqrtf(length);
+            for (int c = 0; c < channels; c++) {
+                axis[c] = next[c] / length;
+            }
+        }
+
+        float axisLength = 0.0f;
+        for (int c = 0; c < channels; c++) {
+            axisLength += axis[c] * axis[c];
+        }
+        if (axisLength < 1e-12f) {
+            // flat block
+            for (int c = 0; c < channels; c++) {
+                low[c] = high[c] = mean[c];
+            }
+            return;
+        }
+        axisLength = sqrtf(axisLength);
+
+        float minimum = 0.0f, maximum = 0.0f;
+        for (int i = 0; i < 16; i++) {
+            float t = 0.0f;
+            for (int c = 0; c < channels; c++) {
+                t += (texels[i][c] - mean[c]) * axis[c] / axisLength;
+            }
+            minimum = std::min(minimum, t);
+            maximum = std::max(maximum, t);
+        }
+        for (int c = 0; c < channels; c++) {
+            low[c] = std::min(std::max(mean[c] + axis[c] / axisLength * minimum, 0.0f), 255.0f);
+            high[c] = std::min(std::max(mean[c] + axis[c] / axisLength * maximum, 0.0f), 255.0f);
+        }
+    }
+
+    static uint16_t PackRGB565(const float* color)
+    {
+        int r = (int)(color[0] * 31.0f / 255.0f + 0.5f);
+        int g = (int)(color[1] * 63.0f / 255.0f + 0.5f);
+        int b = (int)(color[2] * 31.0f / 255.0f + 0.5f);
+        return (uint16_t)((r << 11) | (g << 5) | b);
+    }
+
+    static void UnpackRGB565(uint16_t packed, int* color)
+    {
+        int r = packed >> 11;
+        int g = (packed >> 5) & 63;
+        int b = packed & 31;
+        color[0] = (r << 3) | (r >> 2);
+        color[1] = (g << 2) | (g >> 4);
+        color[2] = (b << 3) | (b >> 2);
+    }
+
+    static void WriteLittleEndian(unsigned char* out, uint64_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; i++) {
+            out[i] = (unsigned char)(value >> (8 * i));
+        }
+    }
+
+    // BC1 color block, always in the four color mode so it is also valid inside BC3
+    static void EncodeColorBlock(const float texels[16][4], unsigned char* out)
+    {
+        float low[4], high[4];
+        FitEndpoints(texels, 3, low, high);
+
+        uint16_t color0 = PackRGB565(high);
+        uint16_t color1 = PackRGB565(low);
+        if (color0 < color1) {
+            std::swap(color0, color1);
+        }
+
+        uint32_t indices = 0;
+        if (color0 != color1) {
+            int palette[4][3];
+            UnpackRGB565(color0, palette[0]);
+            UnpackRGB565(color1, palette[1]);
+            for (int c = 0; c < 3; c++) {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+
+            for (int i = 0; i < 16; i++) {
+                int best = 0;
+                float bestError = 1e30f;
+                for (int p = 0; p < 4; p++) {
+                    float error = 0.0f;
+                    for (int c = 0; c < 3; c++) {
+                        float d = texels[i][c] - palette[p][c];
+                        error += d * d;
+                    }
+                    if (error < bestError) {
+                        bestError = error;
+                        best = p;
+                    }
+                }
+                indices |= (uint32_t)best << (2 * i);
+            }
+        }
+
+        WriteLittleEndian(out, color0, 2);
+        WriteLittleEndian(out + 2, color1, 2);
+        WriteLittleEndian(out + 4, indices, 4);
+    }
+
+    // BC4 block of one channel, also the alpha half of BC3
+    static void EncodeChannelBlock(const float texels[16][4], int channel, unsigned char* out)
+    {
+        float minimum = 255.0f, maximum = 0.0f;
+        for (int i = 0; i < 16; i++) {
+            minimum = std::min(minimum, texels[i][channel]);
+            maximum = std::max(maximum, texels[i][channel]);
+        }
+
+        int value0 = (int)(maximum + 0.5f);
+        int value1 = (int)(minimum + 0.5f);
+        uint64_t indices = 0;
+        if (value0 > value1) {
+            // eight value mode: both endpoints and six steps between them
+            int palette[8];
+            palette[0] = value0;
+            palette[1] = value1;
+            for (int i = 1; i < 7; i++) {
+                palette[i + 1] = ((7 - i) * value0 + i * value1) / 7;
+            }
+
+            for (int i = 0; i < 16; i++) {
+                int best = 0;
+                float bestError = 1e30f;
+                for (int p = 0; p < 8; p++) {
+                    float error = fabsf(texels[i][channel] - palette[p]);
+                    if (error < bestError) {
+                        bestError = error;
+                        best = p;
+                    }
+                }
+                indices |= (uint64_t)best << (3 * i);
+            }
+        }
+
+        out[0] = (unsigned char)value0;
+        out[1] = (unsigned char)value1;
+        WriteLittleEndian(out + 2, indices, 6);
+    }
+
+    static const int BC7_WEIGHTS4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+    static void WriteBits(unsigned char* out, int& position, uint32_t value, int bits)
+    {
+        for (int b = 0; b < bits; b++) {
+            if ((value >> b) & 1) {
+                out[position >> 3] |= (unsigned char)(1 << (position & 7));
+            }
+            position++;
+        }
+    }
+
+    // BC7 mode 6: one RGBA line with 7 bit endpoints plus a shared low bit each, 4 bit indices
+    static void EncodeBC7Block(const float texels[16][4], unsigned char* out)
+    {
+        float low[4], high[4];
+        FitEndpoints(texels, 4, low, high);
+
+        int bestEndpoints[2][4];
+        int bestBits[2] = { 0, 0 };
+        int bestIndices[16];
+        float bestError = 1e30f;
+
+        // try every combination of the two endpoint low bits
+        for (int bits = 0; bits < 4; bits++) {
+            int lowBit[2] = { bits & 1, bits >> 1 };
+            int quantized[2][4];
+            int expanded[2][4];
+            for (int c = 0; c < 4; c++) {
+                quantized[0][c] = std::min(std::max((int)((low[c] - lowBit[0]) / 2.0f + 0.5f), 0), 127);
+                quantized[1][c] = std::min(std::max((int)((high[c] - lowBit[1]) / 2.0f + 0.5f), 0), 127);
+                expanded[0][c] = (quantized[0][c] << 1) | lowBit[0];
+                expanded[1][c] = (quantized[1][c] << 1) | lowBit[1];
+            }
+
+            float direction[4];
+            float lengthSquared = 0.0f;
+            for (int c = 0; c < 4; c++) {
+                direction[c] = (float)(expanded[1][c] - expanded[0][c]);
+                lengthSquared += direction[c] * direction[c];
+            }
+
+            int indices[16];
+            float error = 0.0f;
+            for (int i = 0; i < 16; i++) {
+                // project on the line, then snap to the closest of the 16 weights
+                float t = 0.0f;
+                if (lengthSquared > 0.0f) {
+                    for (int c = 0; c < 4; c++) {
+                        t += (texels[i][c] - expanded[0][c]) * direction[c];
+                    }
+                    t = t / lengthSquared * 64.0f;
+                }
+                int index = 0;
+                for (int w = 1; w < 16; w++) {
+                    if (fabsf(BC7_WEIGHTS4[w] - t) < fabsf(BC7_WEIGHTS4[index] - t)) {
+                        index = w;
+                    }
+                }
+                indices[i] = index;
+
+                for (int c = 0; c < 4; c++) {
+                    int value = ((64 - BC7_WEIGHTS4[index]) * expanded[0][c] + BC7_WEIGHTS4[index] * expanded[1][c] + 32) >> 6;
+                    float d = texels[i][c] - value;
+                    error += d * d;
+                }
+            }
+
+            if (error < bestError) {
+                bestError = error;
+                memcpy(bestEndpoints, quantized, sizeof(bestEndpoints));
+                bestBits[0] = lowBit[0];
+                bestBits[1] = lowBit[1];
+                memcpy(bestIndices, indices, sizeof(bestIndices));
+            }
+        }
+
+        // the first index is stored without its top bit, swap the endpoints if it is set
+        if (bestIndices[0] >= 8) {
+            for (int c = 0; c < 4; c++) {
+                std::swap(bestEndpoints[0][c], bestEndpoints[1][c]);
+            }
+            std::swap(bestBits[0], bestBits[1]);
+            for (int i = 0; i < 16; i++) {
+                bestIndices[i] = 15 - bestIndices[i];
+            }
+        }
+
+        memset(out, 0, 16);
+        int position = 0;
+        WriteBits(out, position, 1 << 6, 7);
+        for (int c = 0; c < 4; c++) {
+            WriteBits(out, position, bestEndpoints[0][c], 7);
+            WriteBits(out, position, bestEndpoints[1][c], 7);
+        }
+        WriteBits(out, position, bestBits[0], 1);
+        WriteBits(out, position, bestBits[1], 1);
+        WriteBits(out, position, bestIndices[0], 3);
+        for (int i = 1; i < 16; i++) {
+            WriteBits(out, position, bestIndices[i], 4);
+        }
+    }
+
+    // Compresses one mip level, rows of blocks are spread over the shared pool
+    static std::vector<unsigned char> CompressLevel(const std::vector<unsigned char>& pixels, int width, int height, uint32_t format)
+    {
+        int blocksWide = (width + 3) / 4;
+        int blocksHigh = (height + 3) / 4;
+        size_t blockBytes = TextureContainer::GetBlockBytes(format);
+        std::vector<unsigned char> blocks(TextureContainer::GetLevelBytes(format, width, height));
+
+        ThreadPool::GetShared().ParallelFor(blocksHigh, [&](size_t by) {
+            for (int bx = 0; bx < blocksWide; bx++) {
+                // partial blocks at the edges repeat the last row or column
+                float texels[16][4];
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(bx * 4 + (i & 3), width - 1);
+                    int y = std::min((int)by * 4 + (i >> 2), height - 1);
+                    for (int c = 0; c < 4; c++) {
+                        texels[i][c] = pixels[((size_t)y * width + x) * 4 + c];
+                    }
+                }
+
+                unsigned char* out = &blocks[((size_t)by * blocksWide + bx) * blockBytes];
+                switch (format) {
+                case TEXTURE_FORMAT_BC1:
+                    EncodeColorBlock(texels, out);
+                    break;
+                case TEXTURE_FORMAT_BC3:
+                    EncodeChannelBlock(texels, 3, out);
+                    EncodeColorBlock(texels, out + 8);
+                    break;
+                case TEXTURE_FORMAT_BC4:
+                    EncodeChannelBlock(texels, 0, out);
+                    break;
+                case TEXTURE_FORMAT_BC7:
+                    EncodeBC7Block(texels, out);
+                    break;
+                }
+            }
+        });
+
+        return blocks;
+    }
+
+    static bool WriteContainer(const std::string& sourceFile, uint32_t format, uint32_t flags, int width, int height,
+        const std::vector<std::vector<unsigned char> >& levels)
+    {
+        if (!TextureContainer::Write(sourceFile, format, flags, width, height, levels)) {
+            return false;
+        }
+
+        size_t cookedBytes = 0;
+        for (size_t i = 0; i < levels.size(); i++) {
+            cookedBytes += levels[i].size();
+        }
+        size_t rawBytes = (size_t)width * height * 4;
+        if (levels.size() > 1) {
+            rawBytes = rawBytes * 4 / 3;
+        }
+
+        // cooked on several threads, so each line goes out in one piece
+        std::ostringstream log;
+        log << "Cooked " << sourceFile << " : " << FormatName(format) << " " << width << "x" << height
+            << ", " << levels.size() << " levels, " << cookedBytes / 1024 << " KB (RGBA8: " << rawBytes / 1024 << " KB)" << std::endl;
+        std::cout << log.str() << std::flush;
+        return true;
+    }
+
+    bool TextureCooker::CookTexture(const std::string& sourceFile, bool useBC7)
+    {
+        // same orientation as the images TextureLoader decodes
+        int width, height, n;
+        stbi_set_flip_vertically_on_load_thread(1);
+        unsigned char* pixels = stbi_load(sourceFile.c_str(), &width, &height, &n, 4);
+        if (!pixels) {
+            fprintf(stderr, "ERROR: could not load %s\n", sourceFile.c_str());
+            return false;
+        }
+
+        // pick the format from what the image holds, not from its channel count
+        bool gray = true;
+        bool opaque = true;
+        for (size_t i = 0; i < (size_t)width * height * 4; i += 4) {
+            if (abs(pixels[i] - pixels[i + 1]) > 2 || abs(pixels[i] - pixels[i + 2]) > 2) {
+                gray = false;
+            }
+            if (pixels[i + 3] != 255) {
+                opaque = false;
+            }
+        }
+
+        uint32_t format;
+        uint32_t flags;
+        if (gray && opaque) {
+            // BC4 has no sRGB variant, the channel is stored already linearized
+            format = TEXTURE_FORMAT_BC4;
+            flags = TEXTURE_FLAG_REPLICATE_RED;
+        }
+        else if (!opaque) {
+            format = useBC7 ? TEXTURE_FORMAT_BC7 : TEXTURE_FORMAT_BC3;
+            flags = TEXTURE_FLAG_SRGB;
+        }
+        else {
+            format = useBC7 ? TEXTURE_FORMAT_BC7 : TEXTURE_FORMAT_BC1;
+            flags = TEXTURE_FLAG_SRGB;
+        }
+
+        // the runtime uploads model textures as sRGB, so the mips are averaged in linear space
+        CookImage level = Decode(pixels, width, height, true);
+        stbi_image_free(pixels);
+
+        std::vector<std::vector<unsigned char> > levels;
+        for (;;) {
+            levels.push_back(CompressLevel(Encode(level, (flags & TEXTURE_FLAG_SRGB) != 0), level.width, level.height, format));
+            if (level.width == 1 && level.height == 1) {
+                break;
+            }
+            level = Downsample(level);
+        }
+
+        return WriteContainer(sourceFile, format, flags, width, height, levels);
+    }
+
+    bool TextureCooker::CookSkyBoxFace(const std::string& sourceFile)
+    {
+        int width, height, n;
+        stbi_set_flip_vertically_on_load_thread(0);
+        unsigned char* pixels = stbi_load(sourceFile.c_str(), &width, &height, &n, 4);
+        if (!pixels) {
+            fprintf(stderr, "ERROR: could not load %s\n", sourceFile.c_str());
+            return false;
+        }
+
+        std::vector<unsigned char> rgba(pixels, pixels + (size_t)width * height * 4);
+        stbi_image_free(pixels);
+
+        std::vector<std::vector<unsigned char> > levels;
+        levels.push_back(CompressLevel(rgba, width, height, TEXTURE_FORMAT_BC1));
+        return WriteContainer(sourceFile, TEXTURE_FORMAT_BC1, 0, width, height, levels);
+    }
+
+}
@@ -0,0 +1,24 @@
+#ifndef TextureCooker_hpp
+#define TextureCooker_hpp
+
+#include <string>
+
+namespace gps {
+
+    // Offline conversion of images into .gtex containers: block compressed, with the
+    // whole mip chain built ahead of time, so loading them is a plain copy into GL
+    class TextureCooker
+    {
+    public:
+        // Model texture, flipped for OpenGL and mipmapped in linear space. Gray images
+        // become BC4, images with alpha BC3 and opaque ones BC1, or BC7 for both with useBC7
+        static bool CookTexture(const std::string& sourceFile, bool useBC7);
+
+        // Sky box face, kept top down and linear like the RGB faces it replaces.
+        // Only one level, the sky box samples without mipmaps
+        static bool CookSkyBoxFace(const std::string& sourceFile);
+    };
+
+}
+
+#endif /* TextureCooker_hpp */
@@ -0,0 +1,266 @@
+#include "TextureLoader.hpp"
+#include "GLState.hpp"
+#include "ThreadPool.hpp"
+#include "Hash.hpp"
+#include "TextureContainer.hpp"
+
+#include "stb_image.h"
+
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+namespace gps {
+
+    // handles can outlive the shared loader at exit, Release checks this first
+    static TextureLoader* liveLoader = NULL;
+
+    TextureLoader::TextureLoader() : completed(std::make_shared<CompletedQueue>()), nextPixelBuffer(0)
+    {
+        for (int i = 0; i < PBO_COUNT; i++) {
+            pixelBuffers[i] = 0;
+        }
+        liveLoader = this;
+    }
+
+    TextureLoader::~TextureLoader()
+    {
+        liveLoader = NULL;
+
+        // pixels still queued are released, the GL objects go with the context
+        std::lock_guard<std::mutex> lock(completed->mutex);
+        for (size_t i = 0; i < completed->images.size(); i++) {
+            stbi_image_free(completed->images[i].pixels);
+        }
+        completed->images.clear();
+    }
+
+    TextureLoader& TextureLoader::GetShared()
+    {
+        static TextureLoader sharedLoader;
+        return sharedLoader;
+    }
+
+    GLuint TextureLoader::Request(const std::string& path)
+    {
+        // mid grey placeholder, usable by the shaders right away
+        static const unsigned char placeholder[4] = { 128, 128, 128, 255 };
+
+        GLuint textureID;
+        glGenTextures(1, &textureID);
+        GLState::GetShared().BindTextureForEdit(GL_TEXTURE_2D, textureID);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+        pending.insert(textureID);
+        std::shared_ptr<CompletedQueue> queue = completed;
+        ThreadPool::GetShared().Submit([queue, textureID, path]() {
+            DecodedImage image;
+            image.texture = textureID;
+            image.path = path;
+            image.pixels = NULL;
+            image.internalFormat = 0;
+            image.flags = 0;
+
+            if (ReadContainer(path, image)) {
+                // blocks and mips were built by the cooker, nothing left to do here
+                int size[3] = { image.width, image.height, (int)image.internalFormat };
+                image.pixelHash = HashBytes(image.blocks.data(), image.blocks.size(), HashBytes(size, sizeof(size)));
+
+                std::lock_guard<std::mutex> lock(queue->mutex);
+                queue->images.push_back(std::move(image));
+                return;
+            }
+
+            // decoded bottom-up straight away, OpenGL expects the first row at the bottom
+            int n;
+            int force_channels = 4;
+            stbi_set_flip_vertically_on_load_thread(1);
+            image.pixels = stbi_load(path.c_str(), &image.width, &image.height, &n, force_channels);
+            if (!image.pixels) {
+                fprintf(stderr, "ERROR: could not load %s\n", path.c_str());
+                image.width = image.height = 0;
+            }
+            else if ((image.width & (image.width - 1)) != 0 || (image.height & (image.height - 1)) != 0) {
+                // NPOT check
+                fprintf(stderr, "WARNING: texture %s is not power-of-2 dimensions\n", path.c_str());
+            }
+
+            image.pixelHash = 0;
+            if (image.pixels) {
+                int size[2] = { image.width, image.height };
+                image.pixelHash = HashBytes(image.pixels, (size_t)image.width * image.height * 4, HashBytes(size, sizeof(size)));
+            }
+
+            std::lock_guard<std::mutex> lock(queue->mutex);
+            queue->images.push_back(std::move(image));
+        });
+
+        return textureID;
+    }
+
+    void TextureLoader::Update(size_t byteBudget)
+    {
+        size_t uploadedBytes = 0;
+        bool uploadedAny = false;
+
+        while (!uploadedAny || uploadedBytes < byteBudget) {
+            DecodedImage image;
+            {
+                std::lock_guard<std::mutex> lock(completed->mutex);
+                if (completed->images.empty()) {
+                    break;
+                }
+                image = std::move(completed->images.front());
+                completed->images.pop_front();
+            }
+
+            pending.erase(image.texture);
+            if (released.erase(image.texture) > 0 || (!image.pixels && image.blocks.empty())) {
+                // deleted meanwhile, or failed decode that keeps its placeholder
+                stbi_image_free(image.pixels);
+                continue;
+            }
+
+            // cooked images bring their own mips, otherwise the full chain is about a
+            // third larger than the base level
+            size_t imageBytes = image.blocks.empty() ? (size_t)image.width * image.height * 4 : image.blocks.size();
+            UploadEvent event;
+            event.texture = image.texture;
+            event.aliasOf = 0;
+            event.bytes = image.blocks.empty() ? imageBytes * 4 / 3 : imageBytes;
+
+            std::unordered_map<uint64_t, GLuint>::iterator duplicate = texturesByPixels.find(image.pixelHash);
+            if (duplicate != texturesByPixels.end()) {
+                event.aliasOf = duplicate->second;
+            }
+            else {
+                Upload(image);
+                uploadedBytes += imageBytes;
+                uploadedAny = true;
+                texturesByPixels[image.pixelHash] = image.texture;
+            }
+
+            events.push_back(event);
+            stbi_image_free(image.pixels);
+        }
+    }
+
+    std::vector<TextureLoader::UploadEvent> TextureLoader::TakeEvents()
+    {
+        std::vector<UploadEvent> taken;
+        taken.swap(events);
+        return taken;
+    }
+
+    void TextureLoader::Release(GLuint texture)
+    {
+        if (!liveLoader) {
+            return;
+        }
+
+        // not uploaded yet, remember to skip it
+        if (liveLoader->pending.count(texture) > 0) {
+            liveLoader->released.insert(texture);
+            return;
+        }
+
+        for (std::unordered_map<uint64_t, GLuint>::iterator it = liveLoader->texturesByPixels.begin(); it != liveLoader->texturesByPixels.end(); ++it) {
+            if (it->second == texture) {
+                liveLoader->texturesByPixels.erase(it);
+                return;
+            }
+        }
+    }
+
+    size_t TextureLoader::GetPendingCount()
+    {
+        return pending.size();
+    }
+
+    bool TextureLoader::ReadContainer(const std::string& path, DecodedImage& image)
+    {
+        TextureContainer container;
+        if (!container.Open(path)) {
+            return false;
+        }
+
+        // e.g. BC7 without BPTC support, the source image is decoded instead
+        GLenum internalFormat = container.GetInternalFormat();
+        if (internalFormat == 0) {
+            return false;
+        }
+
+        image.internalFormat = internalFormat;
+        image.flags = container.GetFlags();
+        for (int i = 0; i < container.GetLevelCount(); i++) {
+            TextureLevel level = container.GetLevel(i);
+            CompressedLevel compressed;
+            compressed.offset = image.blocks.size();
+            compressed.size = level.size;
+            compressed.width = level.width;
+            compressed.height = level.height;
+            image.levels.push_back(compressed);
+            image.blocks.insert(image.blocks.end(), level.data, level.data + level.size);
+        }
+        image.width = image.levels[0].width;
+        image.height = image.levels[0].height;
+        return true;
+    }
+
+    void TextureLoader::Upload(const DecodedImage& image)
+    {
+        if (pixelBuffers[0] == 0) {
+            glGenBuffers(PBO_COUNT, pixelBuffers);
+        }
+
+        bool compressed = !image.blocks.empty();
+        const unsigned char* source = compressed ? image.blocks.data() : image.pixels;
+        GLsizeiptr size = compressed ? (GLsizeiptr)image.blocks.size() : (GLsizeiptr)image.width * image.height * 4;
+
+        // rotate through a few buffers and orphan the storage, so the copy never waits
+        // for the GPU to finish reading the previous upload
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixelBuffers[nextPixelBuffer]);
+        nextPixelBuffer = (nextPixelBuffer + 1) % PBO_COUNT;
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+        void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+
+        // with a bound pixel buffer the data arguments are offsets into it
+        size_t base = 0;
+        if (mapped) {
+            memcpy(mapped, source, (size_t)size);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        else {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            base = (size_t)source;
+        }
+
+        GLState::GetShared().BindTextureForEdit(GL_TEXTURE_2D, image.texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (compressed) {
+            for (size_t i = 0; i < image.levels.size(); i++) {
+                const CompressedLevel& level = image.levels[i];
+                glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)i, image.internalFormat, level.width, level.height, 0,
+                    (GLsizei)level.size, (const GLvoid*)(base + level.offset));
+            }
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)image.levels.size() - 1);
+            if (image.flags & TEXTURE_FLAG_REPLICATE_RED) {
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_G, GL_RED);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_B, GL_RED);
+            }
+        }
+        else {
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB, image.width, image.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, (const GLvoid*)base);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+            glGenerateMipmap(GL_TEXTURE_2D);
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+}
@@ -0,0 +1,101 @@
+#ifndef TextureLoader_hpp
+#define TextureLoader_hpp
+
+#include <GL/glew.h>
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace gps {
+
+    // Streams 2D textures in without blocking the frame loop: images are decoded on the
+    // shared thread pool and uploaded from the context thread through pixel buffer objects
+    class TextureLoader
+    {
+    public:
+        TextureLoader();
+        ~TextureLoader();
+
+        // Returns a texture that holds a placeholder texel until the real image is uploaded
+        GLuint Request(const std::string& path);
+
+        // Context thread, once per frame: uploads finished images, at most byteBudget bytes
+        // (but always at least one image so the queue keeps moving)
+        void Update(size_t byteBudget = 8 * 1024 * 1024);
+
+        // Requests that are still decoding or waiting for their upload
+        size_t GetPendingCount();
+
+        // Result of Update for one request: either uploaded, or skipped because another
+        // texture already holds the same pixels (aliasOf)
+        struct UploadEvent {
+            GLuint texture;
+            GLuint aliasOf;
+            size_t bytes;
+        };
+
+        // Events produced by Update since the last call
+        std::vector<UploadEvent> TakeEvents();
+
+        // The texture is being deleted: drop pending uploads into it and stop offering it as an alias
+        static void Release(GLuint texture);
+
+        static TextureLoader& GetShared();
+
+    private:
+        struct CompressedLevel {
+            size_t offset;
+            size_t size;
+            int width;
+            int height;
+        };
+
+        struct DecodedImage {
+            GLuint texture;
+            std::string path;
+            unsigned char* pixels;
+            int width;
+            int height;
+            uint64_t pixelHash;
+            // set instead of pixels when the image comes from a cooked container
+            std::vector<unsigned char> blocks;
+            std::vector<CompressedLevel> levels;
+            GLenum internalFormat;
+            uint32_t flags;
+        };
+
+        // outlives the loader, the decode tasks hold a reference to it
+        struct CompletedQueue {
+            std::mutex mutex;
+            std::deque<DecodedImage> images;
+        };
+
+        std::shared_ptr<CompletedQueue> completed;
+        std::unordered_set<GLuint> pending;
+        std::vector<UploadEvent> events;
+        std::unordered_map<uint64_t, GLuint> texturesByPixels;
+        std::unordered_set<GLuint> released;
+
+        static const int PBO_COUNT = 3;
+        GLuint pixelBuffers[PBO_COUNT];
+        int nextPixelBuffer;
+
+        void Upload(const DecodedImage& image);
+
+        // Copies the blocks of a fresh cooked container of path, false if there is none
+        // the driver can sample
+        static bool ReadContainer(const std::string& path, DecodedImage& image);
+
+        TextureLoader(const TextureLoader&);
+        TextureLoader& operator=(const TextureLoader&);
+    };
+
+}
+
+#endif /* TextureLoader_hpp */
@@ -0,0 +1,117 @@
+#include "ThreadPool.hpp"
+
+#include <atomic>
+#include <memory>
+
+namespace gps {
+
+    ThreadPool::ThreadPool(unsigned threadCount) : stopping(false)
+    {
+        if (threadCount == 0) {
+            unsigned cores = std::thread::hardware_concurrency();
+            threadCount = cores > 1 ? cores - 1 : 1;
+        }
+
+        for (unsigned i = 0; i < threadCount; i++) {
+            workers.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            stopping = true;
+        }
+        tasksCondition.notify_all();
+
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+    }
+
+    void ThreadPool::Submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(tasksMutex);
+            tasks.push_back(task);
+        }
+        tasksCondition.notify_one();
+    }
+
+    // state shared between the caller of ParallelFor and its helper tasks,
+    // helpers that start after all items are claimed simply return
+    struct ParallelForState {
+        std::function<void(size_t)> body;
+        size_t count;
+        std::atomic<size_t> nextItem;
+        std::atomic<size_t> doneItems;
+        std::mutex doneMutex;
+        std::condition_variable doneCondition;
+    };
+
+    static void RunParallelForItems(const std::shared_ptr<ParallelForState>& state)
+    {
+        size_t item;
+        while ((item = state->nextItem.fetch_add(1)) < state->count) {
+            state->body(item);
+            if (state->doneItems.fetch_add(1) + 1 == state->count) {
+                std::lock_guard<std::mutex> lock(state->doneMutex);
+                state->doneCondition.notify_all();
+            }
+        }
+    }
+
+    void ThreadPool::ParallelFor(size_t count, std::function<void(size_t)> body)
+    {
+        if (count == 0) {
+            return;
+        }
+
+        std::shared_ptr<ParallelForState> state = std::make_shared<ParallelForState>();
+        state->body = body;
+        state->count = count;
+        state->nextItem = 0;
+        state->doneItems = 0;
+
+        size_t helpers = count - 1 < workers.size() ? count - 1 : workers.size();
+        for (size_t i = 0; i < helpers; i++) {
+            Submit([state]() { RunParallelForItems(state); });
+        }
+
+        // the caller works too, then waits only for items already claimed by helpers
+        RunParallelForItems(state);
+
+        std::unique_lock<std::mutex> lock(state->doneMutex);
+        state->doneCondition.wait(lock, [&state]() { return state->doneItems.load() == state->count; });
+    }
+
+    unsigned ThreadPool::GetThreadCount()
+    {
+        return (unsigned)workers.size();
+    }
+
+    ThreadPool& ThreadPool::GetShared()
+    {
+        static ThreadPool sharedPool;
+        return sharedPool;
+    }
+
+    void ThreadPool::WorkerLoop()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(tasksMutex);
+                tasksCondition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (stopping && tasks.empty()) {
+                    return;
+                }
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+}
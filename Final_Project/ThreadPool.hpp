@@ -0,0 +1,46 @@
+#ifndef ThreadPool_hpp
+#define ThreadPool_hpp
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace gps {
+
+    // Fixed set of worker threads consuming a FIFO of tasks
+    class ThreadPool
+    {
+    public:
+        // threadCount 0 picks one thread per hardware core, minus the context thread
+        explicit ThreadPool(unsigned threadCount = 0);
+        ~ThreadPool();
+
+        void Submit(std::function<void()> task);
+
+        // Runs body(i) for i in [0, count), the calling thread takes part so this is safe from inside a task
+        void ParallelFor(size_t count, std::function<void(size_t)> body);
+
+        unsigned GetThreadCount();
+
+        // Process wide pool shared by the loaders
+        static ThreadPool& GetShared();
+
+    private:
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()> > tasks;
+        std::mutex tasksMutex;
+        std::condition_variable tasksCondition;
+        bool stopping;
+
+        void WorkerLoop();
+
+        ThreadPool(const ThreadPool&);
+        ThreadPool& operator=(const ThreadPool&);
+    };
+
+}
+
+#endif /* ThreadPool_hpp */
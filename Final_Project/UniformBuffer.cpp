@@ -0,0 +1,125 @@
+#include "UniformBuffer.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace gps {
+
+    static_assert(sizeof(FrameUniforms) == 496, "FrameUniforms must match the std140 layout of FrameData");
+
+    static const UniformBlockInfo UNIFORM_BLOCKS[] = {
+        { "FrameData", FRAME_UNIFORM_BINDING, sizeof(FrameUniforms) },
+    };
+
+    // waits between checks of a fence, in nanoseconds
+    static const GLuint64 FENCE_WAIT_TIMEOUT = 1000000000;
+
+    const UniformBlockInfo* FindUniformBlock(const char* name)
+    {
+        for (size_t i = 0; i < sizeof(UNIFORM_BLOCKS) / sizeof(UNIFORM_BLOCKS[0]); i++) {
+            if (strcmp(UNIFORM_BLOCKS[i].name, name) == 0) {
+                return &UNIFORM_BLOCKS[i];
+            }
+        }
+        return NULL;
+    }
+
+    UniformRing::UniformRing()
+    {
+        buffer = 0;
+        binding = 0;
+        slotSize = 0;
+        slotsPerFrame = 0;
+        frame = 0;
+        nextSlot = 0;
+        for (int i = 0; i < UNIFORM_RING_FRAMES; i++) {
+            fences[i] = NULL;
+        }
+        overflowed = false;
+        warned = false;
+    }
+
+    void UniformRing::Create(GLuint binding, GLsizeiptr blockSize, GLsizeiptr blocksPerFrame)
+    {
+        // every bound range has to start on the alignment the driver asks for
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        this->binding = binding;
+        slotSize = (blockSize + alignment - 1) / alignment * alignment;
+        slotsPerFrame = blocksPerFrame;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        glBufferData(GL_UNIFORM_BUFFER, slotSize * slotsPerFrame * UNIFORM_RING_FRAMES, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+
+    void UniformRing::Destroy()
+    {
+        for (int i = 0; i < UNIFORM_RING_FRAMES; i++) {
+            if (fences[i] != NULL) {
+                glDeleteSync(fences[i]);
+                fences[i] = NULL;
+            }
+        }
+        if (buffer != 0) {
+            glDeleteBuffers(1, &buffer);
+            buffer = 0;
+        }
+    }
+
+    void UniformRing::BeginFrame()
+    {
+        frame = (frame + 1) % UNIFORM_RING_FRAMES;
+        nextSlot = 0;
+        overflowed = false;
+
+        GLsync fence = fences[frame];
+        if (fence == NULL) {
+            return;
+        }
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, FENCE_WAIT_TIMEOUT) == GL_TIMEOUT_EXPIRED) {
+        }
+        glDeleteSync(fence);
+        fences[frame] = NULL;
+    }
+
+    void UniformRing::EndFrame()
+    {
+        fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    GLintptr UniformRing::Write(const void* data, GLsizeiptr size)
+    {
+        if (nextSlot == slotsPerFrame) {
+            if (!warned) {
+                fprintf(stderr, "WARNING: more than %d uniform blocks in one frame on binding %u\n", (int)slotsPerFrame, binding);
+                warned = true;
+            }
+            // the slots of this frame may still be in use by its earlier draws
+            nextSlot = 0;
+            overflowed = true;
+        }
+
+        GLintptr offset = (frame * slotsPerFrame + nextSlot) * slotSize;
+        nextSlot++;
+
+        GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+        if (!overflowed) {
+            access |= GL_MAP_UNSYNCHRONIZED_BIT;
+        }
+        glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+        void* slot = glMapBufferRange(GL_UNIFORM_BUFFER, offset, size, access);
+        if (slot != NULL) {
+            memcpy(slot, data, size);
+            glUnmapBuffer(GL_UNIFORM_BUFFER);
+        }
+        return offset;
+    }
+
+    void UniformRing::Bind(GLintptr offset, GLsizeiptr size)
+    {
+        glBindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+    }
+
+}
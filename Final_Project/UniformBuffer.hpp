@@ -0,0 +1,97 @@
+#ifndef UniformBuffer_hpp
+#define UniformBuffer_hpp
+
+#include <GL/glew.h>
+
+#include <glm/glm.hpp>
+
+namespace gps {
+
+    // Binding points of the std140 blocks the shaders share. GL 4.1 has no layout(binding)
+    // for blocks, so Shader binds every block it knows by name after linking
+    const GLuint FRAME_UNIFORM_BINDING = 0;
+
+    // Regions a ring is split into, a frame writes its own while the GPU reads the older ones
+    const int UNIFORM_RING_FRAMES = 3;
+
+    // Shadow cascades FrameData has room for, shaders/frameData.glsl declares the same size
+    const int MAX_SHADOW_CASCADES = 4;
+
+    // FrameData in shaders/frameData.glsl, written once per frame. In std140 a vec3 followed by a
+    // scalar packs into one 16 byte slot, vec4 arrays have no padding and bools are 4 bytes
+    struct FrameUniforms {
+        glm::mat4 view;
+        glm::mat4 projection;
+        // world to light clip space of every cascade
+        glm::mat4 lightSpaceTrMatrices[MAX_SHADOW_CASCADES];
+        // view space depth where each cascade ends
+        glm::vec4 cascadeSplits;
+        glm::vec3 lightDir;
+        GLfloat cutoff;
+        glm::vec3 lightColor;
+        GLfloat outerCutoff;
+        glm::vec3 spotLightPos;
+        GLfloat fogDensity;
+        glm::vec3 spotLightDir;
+        GLint isNight;
+        // fragment coordinates and view depth to light cluster, LightClusters::GetShaderParams
+        glm::vec4 clusterParams;
+        GLint foginit;
+        GLint cascadeCount;
+        GLint padding[2];
+    };
+
+    struct UniformBlockInfo {
+        const char* name;
+        GLuint binding;
+        GLsizeiptr size;
+    };
+
+    // The shared block called name, NULL for blocks nobody binds
+    const UniformBlockInfo* FindUniformBlock(const char* name);
+
+    // Streams uniform blocks through one buffer split into UNIFORM_RING_FRAMES regions.
+    // Each Write copies the block into a fresh slot of the current frame's region without
+    // waiting for the GPU, the fence set by EndFrame keeps the region from being rewritten
+    // before the GPU is done reading it. Context thread only
+    class UniformRing
+    {
+    public:
+        UniformRing();
+
+        // blockSize is the largest block pushed, blocksPerFrame the most one frame pushes
+        void Create(GLuint binding, GLsizeiptr blockSize, GLsizeiptr blocksPerFrame);
+        void Destroy();
+
+        // Moves to the next region, waiting in the rare case the GPU still reads it
+        void BeginFrame();
+        void EndFrame();
+
+        // Returns the offset of the slot written, valid until the end of the frame
+        GLintptr Write(const void* data, GLsizeiptr size);
+        // Points the ring's binding point at a slot returned by Write
+        void Bind(GLintptr offset, GLsizeiptr size);
+
+        // Write and Bind in one go
+        template <typename T>
+        void Push(const T& block)
+        {
+            Bind(Write(&block, sizeof(T)), sizeof(T));
+        }
+
+    private:
+        GLuint buffer;
+        GLuint binding;
+        GLsizeiptr slotSize;
+        GLsizeiptr slotsPerFrame;
+        int frame;
+        GLsizeiptr nextSlot;
+        GLsync fences[UNIFORM_RING_FRAMES];
+        // set once the frame ran out of slots, the reused ones are then written synchronized
+        bool overflowed;
+        bool warned;
+    };
+
+}
+
+#endif /* UniformBuffer_hpp */
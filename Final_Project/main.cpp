@@ -12,8 +12,22 @@
 #include "Camera.hpp"
 #include "Model3D.hpp"
 #include "SkyBox.hpp"
+#include "StartupGraph.hpp"
+#include "ResourceRegistry.hpp"
+#include "TextureLoader.hpp"
+#include "TextureCooker.hpp"
+#include "GLState.hpp"
+#include "UniformBuffer.hpp"
+#include "RenderQueue.hpp"
+#include "GeometryPool.hpp"
+#include "GpuTimer.hpp"
+#include "LightClusters.hpp"
 #include <iostream>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <set>
+#include <random>
 
 
 #ifdef __cplusplus
@@ -30,8 +44,79 @@ extern "C" {
 // window
 gps::Window myWindow;
 
-const unsigned int SHADOW_WIDTH = 10000;
-const unsigned int SHADOW_HEIGHT = 10000;
+// camera clip planes
+const float CAMERA_NEAR_PLANE = 0.1f;
+const float CAMERA_FAR_PLANE = 1000.0f;
+
+// cascaded shadow maps: the view up to SHADOW_DISTANCE is split into SHADOW_CASCADE_COUNT
+// slices, each rendered into its own SHADOW_MAP_SIZE square layer of one depth texture array
+const int SHADOW_CASCADE_COUNT = 3;
+const int SHADOW_MAP_SIZE = 2048;
+// 16 or 24
+const int SHADOW_DEPTH_BITS = 24;
+const float SHADOW_DISTANCE = 150.0f;
+// blend between uniform (0) and logarithmic (1) split distances
+const float SHADOW_SPLIT_LAMBDA = 0.75f;
+// depth range of the light's projection, every cascade shares it so the bias means the same
+const float SHADOW_NEAR_PLANE = 0.1f;
+const float SHADOW_FAR_PLANE = 400.0f;
+// static casters are drawn into a cached copy of the cascades, kept until a cascade moves.
+// The cascades move in steps of this fraction of their radius and cover that much more,
+// trading some resolution for fewer redraws of the cache
+const float SHADOW_CACHE_STEP = 0.2f;
+
+// how the main pass filters the shadow maps, the same values as in basic.frag
+enum ShadowFilter {
+    SHADOW_FILTER_REFERENCE = 0, // 7x7 grid of nearest compares, 49 lookups per fragment
+    SHADOW_FILTER_HARDWARE = 1,  // one hardware compared 2x2 lookup
+    SHADOW_FILTER_POISSON = 2,   // 12 lookups on a rotated Poisson disk
+    SHADOW_FILTER_VARIANCE = 3,  // one lookup into mipmapped depth moments
+    SHADOW_FILTER_COUNT
+};
+const char* SHADOW_FILTER_NAMES[SHADOW_FILTER_COUNT] = { "reference", "hardware", "poisson", "variance" };
+// picked with --shadow-filter, K cycles through them at runtime
+ShadowFilter startupShadowFilter = SHADOW_FILTER_POISSON;
+ShadowFilter shadowFilter = SHADOW_FILTER_POISSON;
+
+// --shadow-benchmark runs every filter for this many frames and prints the GPU time of
+// the main pass, where the filter runs
+const int SHADOW_BENCHMARK_FRAMES = 240;
+gps::GpuTimer shadowTimer;
+// the filter being measured, -1 when not benchmarking
+int benchmarkFilter = -1;
+int benchmarkFrames = 0;
+// next to the shadow maps it reattaches, K switches filters before that
+void setShadowFilter(ShadowFilter filter);
+static_assert(SHADOW_CASCADE_COUNT >= 1 && SHADOW_CASCADE_COUNT <= gps::MAX_SHADOW_CASCADES, "FrameData has room for MAX_SHADOW_CASCADES cascades");
+static_assert(SHADOW_DEPTH_BITS == 16 || SHADOW_DEPTH_BITS == 24, "shadow maps are 16 or 24 bit");
+
+// projected error (in pixels) a level of detail may have, the shadow pass is filtered
+// and viewed from far away, so it takes coarser levels
+const float LOD_ERROR_PIXELS = 1.0f;
+const float SHADOW_LOD_ERROR_PIXELS = 4.0f;
+gps::DrawContext cameraDrawContext;
+
+struct shadowCascade {
+    // view space depth where the cascade ends
+    float splitFar;
+    glm::mat4 lightSpaceTrMatrix;
+    // moving casters, culled against the receivers in the slice
+    gps::DrawContext drawContext;
+    // static casters, culled against the whole cascade since the cache outlives the slice
+    gps::DrawContext staticDrawContext;
+    // the static layer holds the static casters seen through staticLightSpaceTrMatrix,
+    // clear staticValid after moving static geometry
+    bool staticValid;
+    glm::mat4 staticLightSpaceTrMatrix;
+};
+shadowCascade shadowCascades[SHADOW_CASCADE_COUNT];
+
+// frames averaged by the GL state report printed once after startup
+const int STATE_REPORT_FRAMES = 300;
+// T prints the culling and draw counts of every frame
+bool renderStats = false;
+// sections the static shadow queue culled when it last redrew the cache
+size_t staticShadowCulled = 0;
 
 int retina_width, retina_height;
 GLFWwindow* glWindow = NULL;
@@ -65,26 +150,53 @@ struct circle {
 glm::mat4 model;
 glm::mat4 view;
 glm::mat4 projection;
-glm::mat3 normalMatrix;
 glm::mat4 tumbleWeedMatrix = glm::mat4(1.0f);
 
 // light parameters
 glm::vec3 lightDir;
 glm::vec3 lightColor;
+// point lights above the lamps, binned into view clusters every frame so a fragment only
+// pays for the lamps near it
+gps::LightClusters lightClusters;
+const glm::vec3 LAMP_LIGHT_COLOR = glm::vec3(1.0f, 0.474f, 0.301f);
+const float LAMP_LIGHT_HEIGHT = 3.5f;
+const float LAMP_LIGHT_INTENSITY = 7.5f;
+const float LAMP_LIGHT_RADIUS = 25.0f;
+// clusters cover view depths up to LIGHT_CLUSTER_FAR, nearer than LIGHT_CLUSTER_NEAR is all one slice
+const float LIGHT_CLUSTER_NEAR = 1.0f;
+const float LIGHT_CLUSTER_FAR = 400.0f;
+// --lamps <count> scatters that many dimmer lamps over a grid around the scene
+const float LAMP_FIELD_SPACING = 8.0f;
+const float LAMP_FIELD_INTENSITY = 2.0f;
+const float LAMP_FIELD_RADIUS = 12.0f;
+int lampFieldCount = 0;
+std::vector<glm::vec3> lampFieldPositions;
+// spot light cone, the shaders get the cosines of these half angles
+const float SPOT_CUTOFF_DEGREES = 12.5f;
+const float SPOT_OUTER_CUTOFF_DEGREES = 17.5f;
 
 //fog parameters
 bool foginit = false;
 GLfloat fogDensity = 0.005f;
 
-// shader uniform locations
-GLint modelLoc;
-GLint viewLoc;
-GLint projectionLoc;
-GLint normalMatrixLoc;
-GLint lightDirLoc;
-GLint lightColorLoc;
-GLuint shadowMapFBO;
+// uniform block shared by all shaders, the objects' transforms travel as instance data
+gps::UniformRing frameUniforms;
+gps::RenderQueue renderQueue;
+// redraws the static shadow casters, only into the cascades whose cache went stale
+gps::RenderQueue staticShadowQueue;
+
+// one framebuffer per cascade, each with its layer of depthMapTexture attached. Every frame
+// a layer starts as a copy of its static layer, then takes the moving casters
+GLuint shadowMapFBOs[SHADOW_CASCADE_COUNT];
 GLuint depthMapTexture;
+GLuint staticShadowMapFBOs[SHADOW_CASCADE_COUNT];
+GLuint staticDepthMapTexture;
+// depth and squared depth of the same layers for the variance filter, created when it is
+// first picked and attached only while it is in use
+GLuint shadowMomentsTexture = 0;
+GLuint staticShadowMomentsTexture = 0;
+// reads the depth layers unfiltered and without comparison, for the reference filter
+GLuint shadowReferenceSampler = 0;
 
 // camera
 gps::Camera myCamera(
@@ -113,6 +225,39 @@ gps::Model3D lamp2;
 gps::Model3D lamp3;
 gps::Model3D specialWeed;
 
+struct ModelFile {
+    gps::Model3D* model;
+    const char* fileName;
+};
+
+// biggest model first, it is the longest task of the whole startup
+ModelFile modelFiles[] = {
+    { &bigScene, "models/scene/KB3D_Gaea-Native.obj" },
+    { &teapot, "models/teapot/teapot20segUT.obj" },
+    { &tumbleWeed, "models/tumbleweed/tumbleweed.obj" },
+    { &tumbleWeed2, "models/tumbleweed2/tumbleweed2.obj" },
+    { &tumbleWeed3, "models/tumbleweed3/tumbleweed3.obj" },
+    { &tumbleWeed4, "models/tumbleweed4/tumbleweed4.obj" },
+    { &specialWeed, "models/specialWeed/specialWeed.obj" },
+    { &eagleBody, "models/eagle/body.obj" },
+    { &eagleFeathers, "models/eagle/feathers.obj" },
+    { &eagleWings, "models/eagle/wings.obj" },
+    { &eagleTail, "models/eagle/tail.obj" },
+    { &lamp, "models/lamp/lamp.obj" },
+    { &lamp2, "models/lamp2/lamp2.obj" },
+    { &lamp3, "models/lamp3/lamp3.obj" },
+    { &ground, "models/ground/untitled.obj" },
+};
+
+const GLchar* skyBoxFaces[] = {
+    "skybox/right.tga",
+    "skybox/left.tga",
+    "skybox/top.tga",
+    "skybox/bottom.tga",
+    "skybox/back.tga",
+    "skybox/front.tga",
+};
+
 float bodyAngle;
 float feathersAngle;
 GLfloat angle;
@@ -123,8 +268,23 @@ GLfloat angleWeedZ = 0.0f;
 GLfloat angleWeedX = 0.0f;
 glm::vec3 currentWeedPosition;
 bool objGen = false;
+
+// tumbleweeds the wind blows across the scene, drawn instanced. The original four by
+// default, --tumbleweeds <count> scatters more behind them
+const int WIND_TUMBLEWEED_COUNT = 4;
+int windTumbleWeedCount = WIND_TUMBLEWEED_COUNT;
+struct windTumbleWeed {
+    glm::vec3 start;
+    float speed;
+    float spin;
+    int model;
+};
+std::vector<windTumbleWeed> windTumbleWeeds;
+std::vector<gps::InstanceData> windInstances[4];
 bool objStop = false;
 bool isNight = false;
+// the sun's shadows, never drawn at night
+bool shadowsEnabled = true;
 bool scenePrev = false;
 int featherDirection = 0;
 
@@ -133,7 +293,22 @@ gps::SkyBox mySkyBox;
 
 
 // shaders
-gps::Shader myBasicShader;
+// basic.frag features, bit i of a variant's mask defines BASIC_SHADER_FEATURES[i]
+enum BasicShaderFeature {
+    BASIC_SHADER_NIGHT = 1 << 0,
+    BASIC_SHADER_FOG = 1 << 1,
+    BASIC_SHADER_SHADOWS = 1 << 2
+};
+const std::vector<std::string> BASIC_SHADER_FEATURES = { "NIGHT", "FOG", "SHADOWS" };
+// the night has neither fog nor sun shadows, so only these combinations are ever drawn with
+const std::vector<unsigned int> BASIC_SHADER_MASKS = {
+    BASIC_SHADER_NIGHT,
+    0,
+    BASIC_SHADER_FOG,
+    BASIC_SHADER_SHADOWS,
+    BASIC_SHADER_FOG | BASIC_SHADER_SHADOWS
+};
+gps::ShaderVariants basicShaders;
 gps::Shader skyboxShader;
 gps::Shader depthMapShader;
 int nr_rectangles = 0;
@@ -211,17 +386,12 @@ void windowResizeCallback(GLFWwindow* window, int width, int height) {
 	//TODO
     glfwGetFramebufferSize(glWindow, &retina_width, &retina_height);
 
-    myBasicShader.useShaderProgram();
-
-    // set projection matrix
-    glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)retina_width / (float)retina_height, 0.1f, 1000.0f);
-    //send matrix data to shader
-    GLint projLoc = glGetUniformLocation(myBasicShader.shaderProgram, "projection");
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+    // set projection matrix, the next frame uploads it
+    projection = glm::perspective(glm::radians(45.0f), (float)retina_width / (float)retina_height, CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE);
 
 
     // set Viewport transform
-    glViewport(0, 0, retina_width, retina_height);
+    gps::GLState::GetShared().Viewport(0, 0, retina_width, retina_height);
 }
 
 void keyboardCallback(GLFWwindow* window, int key, int scancode, int action, int mode) {
@@ -229,6 +399,16 @@ void keyboardCallback(GLFWwindow* window, int key, int scancode, int action, int
         glfwSetWindowShouldClose(window, GL_TRUE);
     }
 
+    // cycle the shadow filters, the benchmark picks its own
+    if (key == GLFW_KEY_K && action == GLFW_PRESS && benchmarkFilter < 0) {
+        setShadowFilter((ShadowFilter)((shadowFilter + 1) % SHADOW_FILTER_COUNT));
+        printf("shadow filter: %s\n", SHADOW_FILTER_NAMES[shadowFilter]);
+    }
+
+    if (key == GLFW_KEY_T && action == GLFW_PRESS) {
+        renderStats = !renderStats;
+    }
+
 	if (key >= 0 && key < 1024) {
         if (action == GLFW_PRESS) {
             pressedKeys[key] = true;
@@ -272,12 +452,6 @@ void mouseCallback(GLFWwindow* window, double xpos, double ypos) {
         front.z = sin(glm::radians(yaw)) * cos(glm::radians(pitch));
         //cameraFront = glm::normalize(front);*/
         myCamera.rotate(pitch, yaw);
-
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        // compute normal matrix for teapot
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
     }
 }
 
@@ -291,74 +465,47 @@ glm::vec3 takeNextPosition(float transWeedX, float transWeedZ) {
 void processMovement() {
 	if (pressedKeys[GLFW_KEY_W]) {
 		myCamera.move(gps::MOVE_FORWARD, cameraSpeed);
-		//update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        // compute normal matrix for teapot
-        normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
 	}
 
 	if (pressedKeys[GLFW_KEY_S]) {
 		myCamera.move(gps::MOVE_BACKWARD, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        // compute normal matrix for teapot
-        normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
 	}
 
 	if (pressedKeys[GLFW_KEY_A]) {
 		myCamera.move(gps::MOVE_LEFT, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        // compute normal matrix for teapot
-        normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
 	}
 
 	if (pressedKeys[GLFW_KEY_D]) {
 		myCamera.move(gps::MOVE_RIGHT, cameraSpeed);
-        //update view matrix
-        view = myCamera.getViewMatrix();
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-        // compute normal matrix for teapot
-        normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
 	}
 
     if (pressedKeys[GLFW_KEY_X]) {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+        gps::GLState::GetShared().PolygonMode(GL_LINE);
     }
 
     if (pressedKeys[GLFW_KEY_Z]) {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        gps::GLState::GetShared().PolygonMode(GL_FILL);
     }
 
     if (pressedKeys[GLFW_KEY_C]) {
-        glPolygonMode(GL_FRONT_AND_BACK, GL_POINT);
+        gps::GLState::GetShared().PolygonMode(GL_POINT);
     }
 
     if (pressedKeys[GLFW_KEY_F]) {
-
-        myBasicShader.useShaderProgram();
         foginit = true;
-        glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "foginit"), foginit);
-
-        skyboxShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(skyboxShader.shaderProgram, "foginit"), foginit);
-
     }
 
     if (pressedKeys[GLFW_KEY_G]) {
-        myBasicShader.useShaderProgram();
         foginit = false;
-        glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "foginit"), foginit);
+    }
+
+    // sun shadows on and off
+    if (pressedKeys[GLFW_KEY_B]) {
+        shadowsEnabled = true;
+    }
 
-        skyboxShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(skyboxShader.shaderProgram, "foginit"), foginit);
+    if (pressedKeys[GLFW_KEY_V]) {
+        shadowsEnabled = false;
     }
 
     if (pressedKeys[GLFW_KEY_H])
@@ -386,19 +533,11 @@ void processMovement() {
     // it is night and we open the flashlight
     if (pressedKeys[GLFW_KEY_N]) {
         isNight = true;
-        myBasicShader.useShaderProgram();
-        glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "isNight"), isNight);
-        skyboxShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(skyboxShader.shaderProgram, "isNight"), isNight);
     }
 
     //it is day
     if (pressedKeys[GLFW_KEY_M]) {
         isNight = false;
-        myBasicShader.useShaderProgram();
-        glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "isNight"), isNight);
-        skyboxShader.useShaderProgram();
-        glUniform1i(glGetUniformLocation(skyboxShader.shaderProgram, "isNight"), isNight);
     }
 
     //preview of the scene
@@ -478,194 +617,459 @@ void setWindowCallbacks() {
 
 void initOpenGLState() {
 	glClearColor(0.7f, 0.7f, 0.7f, 1.0f);
-	glViewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
+	gps::GLState::GetShared().Viewport(0, 0, myWindow.getWindowDimensions().width, myWindow.getWindowDimensions().height);
     glEnable(GL_FRAMEBUFFER_SRGB);
 	glEnable(GL_DEPTH_TEST); // enable depth-testing
-	glDepthFunc(GL_LESS); // depth-testing interprets a smaller value as "closer"
+	gps::GLState::GetShared().DepthFunc(GL_LESS); // depth-testing interprets a smaller value as "closer"
 	glEnable(GL_CULL_FACE); // cull face
 	glCullFace(GL_BACK); // cull back face
 	glFrontFace(GL_CCW); // GL_CCW for counter clock-wise
+    gps::Shader::enableParallelCompile();
+}
+
+// parse + decode on a worker, GL upload on the context thread
+int addModelTask(gps::StartupGraph& startup, gps::Model3D& model, std::string fileName) {
+    return startup.AddTask(fileName,
+        [&model, fileName]() { model.ReadModel(fileName); },
+        [&model]() { model.UploadModel(); });
+}
+
+// the compile started by the first task is only waited for once the driver reports it done,
+// the context thread uploads the models in the meantime (the driver compiles on its own
+// threads with KHR_parallel_shader_compile)
+template <typename ShaderType>
+int addShaderLinkTask(gps::StartupGraph& startup, ShaderType& shader, std::string name, int compileTask) {
+    return startup.AddPollTask(name + " link",
+        [&shader]() {
+            if (!shader.isCompileDone()) {
+                return false;
+            }
+            shader.finishCompile();
+            return true;
+        },
+        { compileTask });
+}
+
+int addShaderTask(gps::StartupGraph& startup, gps::Shader& shader, std::string vertexShaderFileName, std::string fragmentShaderFileName) {
+    int compileTask = startup.AddTask(fragmentShaderFileName,
+        [&shader, vertexShaderFileName, fragmentShaderFileName]() { shader.readShaderSources(vertexShaderFileName, fragmentShaderFileName); },
+        [&shader]() { shader.beginCompile(); });
+    return addShaderLinkTask(startup, shader, fragmentShaderFileName, compileTask);
+}
+
+int addShaderVariantsTask(gps::StartupGraph& startup, gps::ShaderVariants& shaders, std::string vertexShaderFileName, std::string fragmentShaderFileName,
+    const std::vector<std::string>& features, const std::vector<unsigned int>& masks) {
+    int compileTask = startup.AddTask(fragmentShaderFileName + " variants",
+        [&shaders, vertexShaderFileName, fragmentShaderFileName, features, masks]() {
+            shaders.readShaderSources(vertexShaderFileName, fragmentShaderFileName, features, masks);
+        },
+        [&shaders]() { shaders.beginCompile(); });
+    return addShaderLinkTask(startup, shaders, fragmentShaderFileName + " variants", compileTask);
+}
+
+void initModels(gps::StartupGraph& startup) {
+    for (size_t i = 0; i < sizeof(modelFiles) / sizeof(modelFiles[0]); i++) {
+        addModelTask(startup, *modelFiles[i].model, modelFiles[i].fileName);
+    }
+    faces.assign(skyBoxFaces, skyBoxFaces + sizeof(skyBoxFaces) / sizeof(skyBoxFaces[0]));
+    startup.AddTask("skybox",
+        []() { mySkyBox.ReadFaces(faces); },
+        []() { mySkyBox.Upload(); });
+}
+
+// model draws of one pass over the whole scene, shapes sharing a material are merged at load
+void printDrawCounts() {
+    size_t drawCount = 0;
+    size_t shapeCount = 0;
+    for (size_t i = 0; i < sizeof(modelFiles) / sizeof(modelFiles[0]); i++) {
+        drawCount += modelFiles[i].model->GetDrawCount();
+        shapeCount += modelFiles[i].model->GetShapeCount();
+    }
+    std::cout << "Draw calls per pass: " << drawCount << " (" << shapeCount << " without merging)" << std::endl;
+}
+
+// offline step (--cook [--bc7]): compresses the model textures and sky box faces
+// into .gtex containers next to the source images, the loaders prefer those
+int cookTextures(bool useBC7) {
+    std::set<std::string> texturePaths;
+    for (size_t i = 0; i < sizeof(modelFiles) / sizeof(modelFiles[0]); i++) {
+        gps::Model3D model;
+        model.ReadModel(modelFiles[i].fileName);
+        std::vector<std::string> paths = model.GetTexturePaths();
+        texturePaths.insert(paths.begin(), paths.end());
+    }
+
+    std::vector<std::string> textures(texturePaths.begin(), texturePaths.end());
+    std::vector<char> cooked(textures.size(), 0);
+    gps::ThreadPool::GetShared().ParallelFor(textures.size(), [&](size_t i) {
+        cooked[i] = gps::TextureCooker::CookTexture(textures[i], useBC7);
+    });
+
+    int failed = 0;
+    for (size_t i = 0; i < cooked.size(); i++) {
+        failed += cooked[i] ? 0 : 1;
+    }
+    for (size_t i = 0; i < sizeof(skyBoxFaces) / sizeof(skyBoxFaces[0]); i++) {
+        failed += gps::TextureCooker::CookSkyBoxFace(skyBoxFaces[i]) ? 0 : 1;
+    }
+
+    std::cout << "Cooked " << textures.size() + sizeof(skyBoxFaces) / sizeof(skyBoxFaces[0]) - failed << " textures, "
+        << failed << " failed" << std::endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-void initModels() {
-    teapot.LoadModel("models/teapot/teapot20segUT.obj");
-    bigScene.LoadModel("models/scene/KB3D_Gaea-Native.obj");
-    tumbleWeed.LoadModel("models/tumbleweed/tumbleweed.obj");
-    tumbleWeed2.LoadModel("models/tumbleweed2/tumbleweed2.obj");
-    tumbleWeed3.LoadModel("models/tumbleweed3/tumbleweed3.obj");
-    tumbleWeed4.LoadModel("models/tumbleweed4/tumbleweed4.obj");
-    specialWeed.LoadModel("models/specialWeed/specialWeed.obj");
-    eagleBody.LoadModel("models/eagle/body.obj");
-    eagleFeathers.LoadModel("models/eagle/feathers.obj");
-    eagleWings.LoadModel("models/eagle/wings.obj");
-    eagleTail.LoadModel("models/eagle/tail.obj");
-    lamp.LoadModel("models/lamp/lamp.obj");
-    lamp2.LoadModel("models/lamp2/lamp2.obj");
-    lamp3.LoadModel("models/lamp3/lamp3.obj");
-    ground.LoadModel("models/ground/untitled.obj");
-    faces.push_back("skybox/right.tga");
-    faces.push_back("skybox/left.tga");
-    faces.push_back("skybox/top.tga");
-    faces.push_back("skybox/bottom.tga");
-    faces.push_back("skybox/back.tga");
-    faces.push_back("skybox/front.tga");
-    mySkyBox.Load(faces);
-}
-
-void initShaders() {
-	myBasicShader.loadShader(
+void initShaders(gps::StartupGraph& startup) {
+    addShaderVariantsTask(startup, basicShaders,
         "shaders/basic.vert",
-        "shaders/basic.frag");
-    skyboxShader.loadShader(
+        "shaders/basic.frag",
+        BASIC_SHADER_FEATURES,
+        BASIC_SHADER_MASKS);
+    addShaderTask(startup, skyboxShader,
         "shaders/skyboxShader.vert", 
         "shaders/skyboxShader.frag");
-    depthMapShader.loadShader(
+    addShaderTask(startup, depthMapShader,
         "shaders/depthMapShader.vert",
         "shaders/depthMapShader.frag");
 }
 
 void initUniforms() {
-	myBasicShader.useShaderProgram();
-
     // create model matrix for teapot
     model = glm::rotate(glm::mat4(1.0f), glm::radians(angle), glm::vec3(0.0f, 1.0f, 0.0f));
-	modelLoc = glGetUniformLocation(myBasicShader.shaderProgram, "model");
 
 	// get view matrix for current camera
 	view = myCamera.getViewMatrix();
-	viewLoc = glGetUniformLocation(myBasicShader.shaderProgram, "view");
-	// send view matrix to shader
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-
-    // compute normal matrix for teapot
-    normalMatrix = glm::mat3(glm::inverseTranspose(view*model));
-	normalMatrixLoc = glGetUniformLocation(myBasicShader.shaderProgram, "normalMatrix");
 
 	// create projection matrix
 	projection = glm::perspective(glm::radians(45.0f),
                                (float)myWindow.getWindowDimensions().width / (float)myWindow.getWindowDimensions().height,
-                               0.1f, 1000.0f);
-	projectionLoc = glGetUniformLocation(myBasicShader.shaderProgram, "projection");
-	// send projection matrix to shader
-	glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));	
+                               CAMERA_NEAR_PLANE, CAMERA_FAR_PLANE);
 
 	//set the light direction (direction towards the light)
 	lightDir = glm::vec3(-80.0f, 125.0f, 50.0f);
-	lightDirLoc = glGetUniformLocation(myBasicShader.shaderProgram, "lightDir");
-	// send light dir to shader
-	glUniform3fv(lightDirLoc, 1, glm::value_ptr(lightDir));
 
 	//set light color
 	lightColor = glm::vec3(1.0f, 1.0f, 1.0f); //white light
-	lightColorLoc = glGetUniformLocation(myBasicShader.shaderProgram, "lightColor");
-	// send light color to shader
-	glUniform3fv(lightColorLoc, 1, glm::value_ptr(lightColor));
 
-    //spot light
-    glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "cutoff"), glm::cos(glm::radians(12.5f)));
-    glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "outerCutoff"), glm::cos(glm::radians(17.5f)));
-    glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "isNight"), isNight);
+    //point lights, one above each lamp
+    lightClusters.Create(LIGHT_CLUSTER_NEAR, LIGHT_CLUSTER_FAR);
+    const float lampX[] = { 9.0f, -3.0f, -14.0f };
+    for (float x : lampX) {
+        lightClusters.AddPointLight(glm::vec3(x, LAMP_LIGHT_HEIGHT, 0), LAMP_LIGHT_COLOR * LAMP_LIGHT_INTENSITY, LAMP_LIGHT_RADIUS);
+    }
+    for (const glm::vec3& position : lampFieldPositions) {
+        lightClusters.AddPointLight(position + glm::vec3(0, LAMP_LIGHT_HEIGHT, 0), LAMP_LIGHT_COLOR * LAMP_FIELD_INTENSITY, LAMP_FIELD_RADIUS);
+    }
 
-    glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "spotLightDir"), 1, glm::value_ptr(myCamera.getCameraDirection()));
-    glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "spotLightPos"), 1, glm::value_ptr(myCamera.getCameraPosition()));
+    frameUniforms.Create(gps::FRAME_UNIFORM_BINDING, sizeof(gps::FrameUniforms), 1);
+}
 
-    //point light
-    glm::vec3 pointLightPos = glm::vec3(9.0f, 3.5f, 0);
-    glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "pointLightLocation"), 1, glm::value_ptr(pointLightPos));
+// A depth texture array with one layer per cascade, each layer attached to its own FBO so a
+// cascade pass only binds
+void createShadowMaps(GLuint& texture, GLuint framebuffers[SHADOW_CASCADE_COUNT]) {
+    GLenum depthFormat = SHADOW_DEPTH_BITS == 16 ? GL_DEPTH_COMPONENT16 : GL_DEPTH_COMPONENT24;
+    glGenTextures(1, &texture);
+    gps::GLState::GetShared().BindTextureForEdit(GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, depthFormat,
+        SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADE_COUNT, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    // lookups compare against the fragment's depth and filter the 2x2 results bilinearly
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, borderColor);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+
+    glGenFramebuffers(SHADOW_CASCADE_COUNT, framebuffers);
+    for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+        gps::GLState::GetShared().BindFramebuffer(framebuffers[cascade]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, cascade);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+    }
 
-    glm::vec3 pointLightPos2 = glm::vec3(-3.0f, 3.5f, 0);
-    glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "pointLightLocation2"), 1, glm::value_ptr(pointLightPos2));
+    gps::GLState::GetShared().BindFramebuffer(0);
+}
 
-    glm::vec3 pointLightPos3 = glm::vec3(-14.0f, 3.5f, 0);
-    glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "pointLightLocation3"), 1, glm::value_ptr(pointLightPos3));
+// Moments of the same layers, two floats per texel with a full mip chain
+void createShadowMoments(GLuint& texture) {
+    glGenTextures(1, &texture);
+    gps::GLState::GetShared().BindTextureForEdit(GL_TEXTURE_2D_ARRAY, texture);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RG32F,
+        SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADE_COUNT, 0, GL_RG, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    // outside the cascade everything is lit, at the far plane
+    float borderColor[] = { 1.0f, 1.0f, 0.0f, 0.0f };
+    glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, borderColor);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+}
 
+void attachShadowMoments(GLuint framebuffer, GLuint texture, int cascade) {
+    gps::GLState::GetShared().BindFramebuffer(framebuffer);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, texture, 0, cascade);
+    GLenum buffer = texture != 0 ? GL_COLOR_ATTACHMENT0 : GL_NONE;
+    glDrawBuffer(buffer);
+    glReadBuffer(buffer);
+}
+
+// Switches the main pass to filter, the shadow passes write moments only for the variance filter
+void setShadowFilter(ShadowFilter filter) {
+    bool variance = filter == SHADOW_FILTER_VARIANCE;
+    bool wasVariance = shadowFilter == SHADOW_FILTER_VARIANCE;
+    shadowFilter = filter;
+    for (gps::Shader& shader : basicShaders.getVariants()) {
+        shader.setInt("shadowFilter", filter);
+    }
+    if (variance == wasVariance && (!variance || shadowMomentsTexture != 0)) {
+        return;
+    }
+
+    if (variance && shadowMomentsTexture == 0) {
+        createShadowMoments(shadowMomentsTexture);
+        createShadowMoments(staticShadowMomentsTexture);
+        // a full mip chain is a third more
+        double megabytes = 2.0 * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE * SHADOW_CASCADE_COUNT * 8 * 4.0 / 3.0 / (1024.0 * 1024.0);
+        printf("shadow moments: %.1f MB with the static cache\n", megabytes);
+    }
+    for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+        attachShadowMoments(shadowMapFBOs[cascade], variance ? shadowMomentsTexture : 0, cascade);
+        attachShadowMoments(staticShadowMapFBOs[cascade], variance ? staticShadowMomentsTexture : 0, cascade);
+        // the cached layers were drawn without moments, or with ones nobody reads anymore
+        shadowCascades[cascade].staticValid = false;
+    }
+    gps::GLState::GetShared().BindFramebuffer(0);
 }
 
 void initFBO() {
-    //TODO - Create the FBO, the depth texture and attach the depth texture to the FBO
-    //generate FBO ID
-    glGenFramebuffers(1, &shadowMapFBO);
-
-    //create depth texture for FBO
-    glGenTextures(1, &depthMapTexture);
-    glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-        SHADOW_WIDTH, SHADOW_HEIGHT, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, borderColor);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    createShadowMaps(depthMapTexture, shadowMapFBOs);
+    createShadowMaps(staticDepthMapTexture, staticShadowMapFBOs);
+    for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+        shadowCascades[cascade].staticValid = false;
+    }
 
-    //attach texture to FBO
-    glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMapTexture, 0);
+    // drivers keep 24 bit depth in 4 bytes, the static copy doubles it
+    double megabytes = 2.0 * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE * SHADOW_CASCADE_COUNT * (SHADOW_DEPTH_BITS == 16 ? 2 : 4) / (1024.0 * 1024.0);
+    printf("shadow maps: %d cascades of %dx%d, %d bit depth, %.1f MB with the static cache\n",
+        SHADOW_CASCADE_COUNT, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_DEPTH_BITS, megabytes);
 
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
+    glGenSamplers(1, &shadowReferenceSampler);
+    glSamplerParameteri(shadowReferenceSampler, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+    glSamplerParameteri(shadowReferenceSampler, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glSamplerParameteri(shadowReferenceSampler, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    float borderColor[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    glSamplerParameterfv(shadowReferenceSampler, GL_TEXTURE_BORDER_COLOR, borderColor);
+    glSamplerParameteri(shadowReferenceSampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glSamplerParameteri(shadowReferenceSampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
 
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    shadowTimer.Create();
 }
 
+glm::mat4 computeLightView() {
+    return glm::lookAt(lightDir, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
 
-glm::mat4 computeLightSpaceTrMatrix() {
-    //TODO - Return the light-space transformation matrix
-    glm::mat4 lightView = glm::lookAt(lightDir, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-    const GLfloat near_plane = 0.1f, far_plane = 400.0f;
-    glm::mat4 lightProjection = glm::ortho(-100.0f, 100.0f, -100.0f, 100.0f, near_plane, far_plane);
-    glm::mat4 lightSpaceTrMatrix = lightProjection * lightView;
-
-    return lightSpaceTrMatrix;
+// Orthographic light projection covering the sphere at center. The sphere's size does not
+// change as the camera turns and its center is snapped to a grid of whole shadow map texels,
+// so the texels keep their place in the world and the shadow edges do not shimmer. The grid
+// step is SHADOW_CACHE_STEP of the radius, the projection grows by one step to cover the
+// sphere wherever it sits in its grid cell, and the matrix only changes between cells
+glm::mat4 computeLightSpaceTrMatrix(const glm::mat4& lightView, const glm::vec3& center, float radius) {
+    float halfSize = radius * (1.0f + SHADOW_CACHE_STEP);
+    float texelSize = 2.0f * halfSize / SHADOW_MAP_SIZE;
+    float step = std::max(std::floor(radius * SHADOW_CACHE_STEP / texelSize), 1.0f) * texelSize;
+    glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+    lightCenter.x = std::floor(lightCenter.x / step) * step;
+    lightCenter.y = std::floor(lightCenter.y / step) * step;
+
+    glm::mat4 lightProjection = glm::ortho(lightCenter.x - halfSize, lightCenter.x + halfSize,
+        lightCenter.y - halfSize, lightCenter.y + halfSize, SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE);
+    return lightProjection * lightView;
 }
 
-void renderTeapot(gps::Shader shader, bool depthPass) {
-    // select active shader program
-    shader.useShaderProgram();
-    //send teapot model matrix data to shader
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-    //send teapot normal matrix data to shader
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+// Shadow casters worth drawing: the part of the light's volume around the receivers, the
+// world space corners of a slice of the camera frustum, open towards the light so casters
+// in front of its near plane are kept as well
+gps::Frustum computeShadowCasterFrustum(const glm::mat4& lightSpaceTrMatrix, const glm::vec3 receivers[8]) {
+    // the light's projection is orthographic, so its clip space is a box and the corners
+    // bound everything visible
+    glm::vec3 receiversMin(1.0f);
+    glm::vec3 receiversMax(-1.0f);
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 lightCorner = lightSpaceTrMatrix * glm::vec4(receivers[corner], 1.0f);
+        glm::vec3 position = glm::vec3(lightCorner) / lightCorner.w;
+        receiversMin = glm::min(receiversMin, position);
+        receiversMax = glm::max(receiversMax, position);
     }
-    // draw teapot
-    teapot.Draw(shader);
+    receiversMin = glm::clamp(receiversMin, -1.0f, 1.0f);
+    receiversMax = glm::clamp(receiversMax, -1.0f, 1.0f);
+
+    // casters behind the farthest receiver shadow nothing visible
+    gps::Frustum frustum = gps::ExtractFrustum(lightSpaceTrMatrix, receiversMin, receiversMax);
+    frustum.planes[gps::FRUSTUM_NEAR] = gps::FRUSTUM_OPEN_PLANE;
+    return frustum;
 }
 
-void renderAllObjects(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+// Splits the camera frustum up to SHADOW_DISTANCE and fits a light projection to each slice
+void updateShadowCascades() {
+    glm::mat4 lightView = computeLightView();
+
+    // corners of the whole camera frustum, view depth grows linearly along the edges from
+    // the near to the far ones, so a slice's corners are interpolated between them
+    glm::mat4 clipToWorld = glm::inverse(projection * myCamera.getViewMatrix());
+    glm::vec3 nearCorners[4];
+    glm::vec3 farCorners[4];
+    for (int corner = 0; corner < 4; corner++) {
+        float x = (corner & 1) ? 1.0f : -1.0f;
+        float y = (corner & 2) ? 1.0f : -1.0f;
+        glm::vec4 nearCorner = clipToWorld * glm::vec4(x, y, -1.0f, 1.0f);
+        glm::vec4 farCorner = clipToWorld * glm::vec4(x, y, 1.0f, 1.0f);
+        nearCorners[corner] = glm::vec3(nearCorner) / nearCorner.w;
+        farCorners[corner] = glm::vec3(farCorner) / farCorner.w;
+    }
+
+    float splitNear = CAMERA_NEAR_PLANE;
+    for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+        // practical split scheme, logarithmic splits keep the texel to pixel ratio even but
+        // leave the first cascade tiny, the uniform part evens that out
+        float fraction = (float)(cascade + 1) / SHADOW_CASCADE_COUNT;
+        float logSplit = CAMERA_NEAR_PLANE * std::pow(SHADOW_DISTANCE / CAMERA_NEAR_PLANE, fraction);
+        float uniformSplit = CAMERA_NEAR_PLANE + (SHADOW_DISTANCE - CAMERA_NEAR_PLANE) * fraction;
+        float splitFar = glm::mix(uniformSplit, logSplit, SHADOW_SPLIT_LAMBDA);
+
+        float nearFraction = (splitNear - CAMERA_NEAR_PLANE) / (CAMERA_FAR_PLANE - CAMERA_NEAR_PLANE);
+        float farFraction = (splitFar - CAMERA_NEAR_PLANE) / (CAMERA_FAR_PLANE - CAMERA_NEAR_PLANE);
+        glm::vec3 corners[8];
+        glm::vec3 center(0.0f);
+        for (int corner = 0; corner < 4; corner++) {
+            corners[corner] = glm::mix(nearCorners[corner], farCorners[corner], nearFraction);
+            corners[corner + 4] = glm::mix(nearCorners[corner], farCorners[corner], farFraction);
+            center += corners[corner] + corners[corner + 4];
+        }
+        center /= 8.0f;
+        float radius = 0.0f;
+        for (int corner = 0; corner < 8; corner++) {
+            radius = std::max(radius, glm::length(corners[corner] - center));
+        }
+        // rounded up so float noise does not resize the projection from frame to frame
+        radius = std::ceil(radius * 16.0f) / 16.0f;
+
+        shadowCascade& shadow = shadowCascades[cascade];
+        shadow.splitFar = splitFar;
+        shadow.lightSpaceTrMatrix = computeLightSpaceTrMatrix(lightView, center, radius);
+
+        shadow.drawContext.viewPosition = lightDir;
+        shadow.drawContext.pixelScale = SHADOW_MAP_SIZE / (2.0f * radius * (1.0f + SHADOW_CACHE_STEP));
+        shadow.drawContext.orthographic = true;
+        shadow.drawContext.lodErrorPixels = SHADOW_LOD_ERROR_PIXELS;
+        shadow.drawContext.cull = true;
+        shadow.drawContext.frustum = computeShadowCasterFrustum(shadow.lightSpaceTrMatrix, corners);
+
+        shadow.staticDrawContext = shadow.drawContext;
+        shadow.staticDrawContext.frustum = gps::ExtractFrustum(shadow.lightSpaceTrMatrix);
+        shadow.staticDrawContext.frustum.planes[gps::FRUSTUM_NEAR] = gps::FRUSTUM_OPEN_PLANE;
+
+        splitNear = splitFar;
     }
-    bigScene.Draw(shader);
 }
 
-void renderSkyBox(gps::Shader shader) {
-    shader.useShaderProgram();
+void updateDrawContexts() {
+    // projection[1][1] is 1 / tan(fov / 2): pixels per unit at distance 1 over half the viewport
+    cameraDrawContext.viewPosition = myCamera.getCameraPosition();
+    cameraDrawContext.pixelScale = projection[1][1] * glWindowHeight * 0.5f;
+    cameraDrawContext.orthographic = false;
+    cameraDrawContext.lodErrorPixels = LOD_ERROR_PIXELS;
+    cameraDrawContext.cull = true;
+    cameraDrawContext.frustum = myCamera.getFrustum(projection);
+
+    updateShadowCascades();
+}
+
+// everything the shaders read per frame, one upload shared by all of them
+void uploadFrameUniforms() {
     view = myCamera.getViewMatrix();
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "view"), 1, GL_FALSE,
-        glm::value_ptr(view));
 
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "projection"), 1, GL_FALSE,
-        glm::value_ptr(projection));
-    mySkyBox.Draw(shader, view, projection);
+    gps::FrameUniforms frame;
+    frame.view = view;
+    frame.projection = projection;
+    // the shader picks the first cascade whose split lies past the fragment
+    for (int cascade = 0; cascade < gps::MAX_SHADOW_CASCADES; cascade++) {
+        const shadowCascade& shadow = shadowCascades[std::min(cascade, SHADOW_CASCADE_COUNT - 1)];
+        frame.lightSpaceTrMatrices[cascade] = shadow.lightSpaceTrMatrix;
+        frame.cascadeSplits[cascade] = shadow.splitFar;
+    }
+    frame.cascadeCount = SHADOW_CASCADE_COUNT;
+    frame.lightDir = lightDir;
+    frame.cutoff = glm::cos(glm::radians(SPOT_CUTOFF_DEGREES));
+    frame.lightColor = lightColor;
+    frame.outerCutoff = glm::cos(glm::radians(SPOT_OUTER_CUTOFF_DEGREES));
+    frame.spotLightPos = myCamera.getCameraPosition();
+    frame.fogDensity = fogDensity;
+    frame.spotLightDir = myCamera.getCameraDirection();
+    frame.isNight = isNight;
+    lightClusters.Update(view, projection, glWindowWidth, glWindowHeight);
+    frame.clusterParams = lightClusters.GetShaderParams();
+    frame.foginit = foginit;
+    memset(frame.padding, 0, sizeof(frame.padding));
+
+    frameUniforms.BeginFrame();
+    frameUniforms.Push(frame);
+}
+
+// queues a model for both passes
+// moving objects, drawn into the shadow cascades every frame
+void submitModel(gps::Model3D& model3D, const glm::mat4& modelMatrix) {
+    renderQueue.Submit(model3D, modelMatrix, gps::RENDER_PASS_SHADOW_BIT | gps::RENDER_PASS_MAIN_BIT);
 }
 
-void renderGround(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(model));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+// lampFieldCount lamps on a square grid centered on the scene, jittered so the rows do not line up
+void generateLampField() {
+    lampFieldPositions.clear();
+    int side = (int)std::ceil(std::sqrt((float)lampFieldCount));
+    std::mt19937 random(4321);
+    std::uniform_real_distribution<float> jitter(-0.25f * LAMP_FIELD_SPACING, 0.25f * LAMP_FIELD_SPACING);
+    for (int i = 0; i < lampFieldCount; i++) {
+        float x = ((i % side) - 0.5f * (side - 1)) * LAMP_FIELD_SPACING + jitter(random);
+        float z = ((i / side) - 0.5f * (side - 1)) * LAMP_FIELD_SPACING + jitter(random);
+        lampFieldPositions.push_back(glm::vec3(x, 0.0f, z));
     }
-    ground.Draw(shader);
 }
 
-void renderTumbleWeed(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
+void generateWindTumbleWeeds() {
+    windTumbleWeeds = {
+        { glm::vec3(-40.0f, 0.6f, 2.5f), 1.0f, 1.0f, 0 },
+        { glm::vec3(-45.0f, 0.3f, 4.25f), 1.12f, 1.2f, 1 },
+        { glm::vec3(-42.0f, 0.4f, 6.5f), 1.05f, 1.07f, 2 },
+        { glm::vec3(-35.0f, 0.7f, 8.5f), 0.9f, 0.95f, 3 },
+    };
+
+    // fixed seed, the field looks the same on every run
+    std::mt19937 random(1234);
+    std::uniform_real_distribution<float> startX(-70.0f, -30.0f);
+    std::uniform_real_distribution<float> startY(0.3f, 0.7f);
+    std::uniform_real_distribution<float> startZ(-40.0f, 40.0f);
+    std::uniform_real_distribution<float> speed(0.85f, 1.15f);
+    std::uniform_real_distribution<float> spin(0.9f, 1.2f);
+    windTumbleWeeds.resize(std::min((int)windTumbleWeeds.size(), windTumbleWeedCount));
+    for (int i = (int)windTumbleWeeds.size(); i < windTumbleWeedCount; i++) {
+        windTumbleWeed weed;
+        weed.start = glm::vec3(startX(random), startY(random), startZ(random));
+        weed.speed = speed(random);
+        weed.spin = spin(random);
+        weed.model = i % 4;
+        windTumbleWeeds.push_back(weed);
+    }
+}
+
+void submitTumbleWeeds() {
+    if (!objGen) {
+        angle = trans = 0;
+        objStop = false;
+        return;
+    }
     if (!objStop) {
         angle += 1.2f;
         trans += 0.03f;
@@ -674,151 +1078,118 @@ void renderTumbleWeed(gps::Shader shader, bool depthPass) {
         objStop = true;
     }
 
-    tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(trans, 0, 0));
-    tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(-40.0, 0.6f, 2.5f));
-    tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(-angle), glm::vec3(0, 0, 1));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(tumbleWeedMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * tumbleWeedMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+    gps::Model3D* models[4] = { &tumbleWeed, &tumbleWeed2, &tumbleWeed3, &tumbleWeed4 };
+    for (int i = 0; i < 4; i++) {
+        windInstances[i].clear();
     }
-    tumbleWeed.Draw(shader);
-
-    tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(trans * 1.12, 0, 0));
-    tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(-45.0, 0.3f, 4.25f));
-    tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(-(angle * 1.2f)), glm::vec3(0, 0, 1));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(tumbleWeedMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * tumbleWeedMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+    for (size_t i = 0; i < windTumbleWeeds.size(); i++) {
+        const windTumbleWeed& weed = windTumbleWeeds[i];
+        tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(trans * weed.speed, 0, 0));
+        tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, weed.start);
+        tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(-(angle * weed.spin)), glm::vec3(0, 0, 1));
+        windInstances[weed.model].push_back(gps::MakeInstance(tumbleWeedMatrix));
     }
-    tumbleWeed2.Draw(shader);
-
-    tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(trans * 1.05, 0, 0));
-    tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(-42.0, 0.4f, 6.5f));
-    tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(-(angle * 1.07f)), glm::vec3(0, 0, 1));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(tumbleWeedMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * tumbleWeedMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+    for (int i = 0; i < 4; i++) {
+        renderQueue.SubmitInstances(*models[i], windInstances[i].data(), windInstances[i].size(),
+            gps::RENDER_PASS_SHADOW_BIT | gps::RENDER_PASS_MAIN_BIT);
     }
-    tumbleWeed3.Draw(shader);
-
-    tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(trans * 0.9, 0, 0));
-    tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(-35.0, 0.7f, 8.5f));
-    tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(-(angle * 0.95f)), glm::vec3(0, 0, 1));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(tumbleWeedMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * tumbleWeedMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    tumbleWeed4.Draw(shader);
 }
 
-void renderSpecialWeed(gps::Shader shader, bool depthPass) {
+void submitSpecialWeed() {
     tumbleWeedMatrix = glm::translate(glm::mat4(1.0f), glm::vec3(transWeedX, 0, 0));
     tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(0, 0, transWeedZ));
     tumbleWeedMatrix = glm::translate(tumbleWeedMatrix, glm::vec3(-60.0, 0.6f, 2.5f));
     tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(angleWeedZ), glm::vec3(0, 0, 1));
     tumbleWeedMatrix = glm::rotate(tumbleWeedMatrix, glm::radians(angleWeedX), glm::vec3(1, 0, 0));
     currentWeedPosition = glm::vec3(tumbleWeedMatrix * glm::vec4(0, 0, 0, 1.0f));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(tumbleWeedMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * tumbleWeedMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    specialWeed.Draw(shader);
+    submitModel(specialWeed, tumbleWeedMatrix);
 }
 
-void renderEagleBody(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 eagleBodyMatrix;
-    eagleBodyMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(bodyAngle), glm::vec3(0, 1, 0));
-    eagleBodyMatrix = glm::translate(eagleBodyMatrix, glm::vec3(-10.0f, 12.0f, 6.0f));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(eagleBodyMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * eagleBodyMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    eagleBody.Draw(shader);
-}
+void submitEagle() {
+    glm::mat4 eagleMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(bodyAngle), glm::vec3(0, 1, 0));
+    eagleMatrix = glm::translate(eagleMatrix, glm::vec3(-10.0f, 12.0f, 6.0f));
+    submitModel(eagleBody, eagleMatrix);
+    submitModel(eagleFeathers, glm::rotate(eagleMatrix, glm::radians(1.5f * feathersAngle), glm::vec3(1, 0, 0)));
+    submitModel(eagleWings, glm::rotate(eagleMatrix, glm::radians(feathersAngle), glm::vec3(1, 0, 0)));
+    submitModel(eagleTail, glm::rotate(eagleMatrix, glm::radians(0.2f * feathersAngle), glm::vec3(1, 0, 0)));
 
-void renderEagleWings(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 eagleWingsMatrix;
-    eagleWingsMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(bodyAngle), glm::vec3(0, 1, 0));
-    eagleWingsMatrix = glm::translate(eagleWingsMatrix, glm::vec3(-10.0f, 12.0f, 6.0f));
-    eagleWingsMatrix = glm::rotate(eagleWingsMatrix, glm::radians(feathersAngle), glm::vec3(1, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(eagleWingsMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * eagleWingsMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+    bodyAngle += 0.6f;
+    if (feathersAngle > 10) featherDirection = 1;
+    if (feathersAngle < -10) featherDirection = 0;
+    if (featherDirection)
+        feathersAngle -= 0.45f;
+    else
+        feathersAngle += 0.45f;
+    if (bodyAngle > 360) {
+        bodyAngle -= 360;
     }
-    eagleWings.Draw(shader);
 }
 
-void renderEagleFeathers(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 eagleFeathersMatrix;
-    eagleFeathersMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(bodyAngle), glm::vec3(0, 1, 0));
-    eagleFeathersMatrix = glm::translate(eagleFeathersMatrix, glm::vec3(-10.0f, 12.0f, 6.0f));
-    eagleFeathersMatrix = glm::rotate(eagleFeathersMatrix, glm::radians(1.5f * feathersAngle), glm::vec3(1, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(eagleFeathersMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * eagleFeathersMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+// objects that never move, their shadows come from the static cache
+void submitStaticScene(gps::RenderQueue& queue, uint32_t passMask) {
+    queue.Submit(teapot, model, passMask);
+    queue.Submit(bigScene, model, passMask);
+    queue.Submit(lamp, glm::translate(glm::mat4(1.0f), glm::vec3(9.0f, 0, 0)), passMask);
+    queue.Submit(lamp2, glm::translate(glm::mat4(1.0f), glm::vec3(-3.0f, 0, 0)), passMask);
+    queue.Submit(lamp3, glm::translate(glm::mat4(1.0f), glm::vec3(-14.0f, 0, 0)), passMask);
+    for (const glm::vec3& position : lampFieldPositions) {
+        queue.Submit(lamp, glm::translate(glm::mat4(1.0f), position), passMask);
     }
-    eagleFeathers.Draw(shader);
+    queue.Submit(ground, model, passMask);
 }
 
-void renderEagleTail(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 eagleTailMatrix;
-    eagleTailMatrix = glm::rotate(glm::mat4(1.0f), glm::radians(bodyAngle), glm::vec3(0, 1, 0));
-    eagleTailMatrix = glm::translate(eagleTailMatrix, glm::vec3(-10.0f, 12.0f, 6.0f));
-    eagleTailMatrix = glm::rotate(eagleTailMatrix, glm::radians(0.2f * feathersAngle), glm::vec3(1, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(eagleTailMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * eagleTailMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    eagleTail.Draw(shader);
+// every object of the scene, once per frame for all passes
+void submitScene() {
+    submitStaticScene(renderQueue, gps::RENDER_PASS_MAIN_BIT);
+    submitTumbleWeeds();
+    submitEagle();
+    submitSpecialWeed();
 }
 
-void renderLamp(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 lampMatrix = glm::mat4(1.0f);
-    lampMatrix = glm::translate(lampMatrix, glm::vec3(9.0f, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(lampMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * lampMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
+// Redraws the static casters into the cascades that moved to another grid cell since their
+// cache was drawn, or whose cache was invalidated
+void updateStaticShadows() {
+    bool stale = false;
+    for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+        shadowCascade& shadow = shadowCascades[cascade];
+        if (shadow.staticValid && shadow.staticLightSpaceTrMatrix == shadow.lightSpaceTrMatrix) {
+            continue;
+        }
+        shadow.staticValid = true;
+        shadow.staticLightSpaceTrMatrix = shadow.lightSpaceTrMatrix;
+        stale = true;
+
+        staticShadowQueue.SetPass((gps::RenderPass)(gps::RENDER_PASS_SHADOW + cascade), depthMapShader,
+            shadow.staticDrawContext, [cascade]() {
+            gps::GLState::GetShared().Viewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+            gps::GLState::GetShared().BindFramebuffer(staticShadowMapFBOs[cascade]);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            if (shadowFilter == SHADOW_FILTER_VARIANCE) {
+                // moments of an empty layer, nothing occludes up to the far plane
+                const GLfloat farMoments[] = { 1.0f, 1.0f, 0.0f, 0.0f };
+                glClearBufferfv(GL_COLOR, 0, farMoments);
+            }
+            glEnable(GL_DEPTH_CLAMP);
+            depthMapShader.setInt("cascade", cascade);
+        });
+    }
+    if (stale) {
+        submitStaticScene(staticShadowQueue, gps::RENDER_PASS_SHADOW_BIT);
+        staticShadowQueue.Execute();
+        staticShadowCulled = staticShadowQueue.GetCulledCount();
     }
-    lamp.Draw(shader);
 }
 
-void renderLamp2(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 lampMatrix = glm::mat4(1.0f);
-    lampMatrix = glm::translate(lampMatrix, glm::vec3(-3.0f, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(lampMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * lampMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    lamp2.Draw(shader);
+// sections culled per pass of the last frame, then what the rest became
+void printRenderStats() {
+    size_t mainCulled = renderQueue.GetCulledCount(gps::RENDER_PASS_MAIN);
+    printf("render queue: %d culled in the main pass, %d in the shadow cascades, %d static casters at the last cache redraw; "
+        "%d packets, %d commands in %d draws\n", (int)mainCulled, (int)(renderQueue.GetCulledCount() - mainCulled),
+        (int)staticShadowCulled, (int)renderQueue.GetPacketCount(), (int)renderQueue.GetCommandCount(), (int)renderQueue.GetDrawCount());
 }
 
-void renderLamp3(gps::Shader shader, bool depthPass) {
-    shader.useShaderProgram();
-    glm::mat4 lampMatrix = glm::mat4(1.0f);
-    lampMatrix = glm::translate(lampMatrix, glm::vec3(-14.0f, 0, 0));
-    glUniformMatrix4fv(glGetUniformLocation(shader.shaderProgram, "model"), 1, GL_FALSE, glm::value_ptr(lampMatrix));
-    if (!depthPass) {
-        normalMatrix = glm::mat3(glm::inverseTranspose(view * lampMatrix));
-        glUniformMatrix3fv(normalMatrixLoc, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-    }
-    lamp3.Draw(shader);
+void renderSkyBox(gps::Shader& shader) {
+    mySkyBox.Draw(shader);
 }
 
 glm::vec3 bezierCurve(glm::vec3 a[], float t) {
@@ -833,115 +1204,103 @@ void scenePreview() {
     myCamera.setFrontDirection(glm::normalize(myCamera.getCameraTarget() - myCamera.getCameraPosition()));
     myCamera.setUpDirection(glm::vec3(0, 1, 0));
 
-    view = myCamera.getViewMatrix();
-    myBasicShader.useShaderProgram();
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    normalMatrix = glm::mat3(glm::inverseTranspose(view * model));
     if (t >= 1)
         scenePrev = false;
 }
 
 void renderScene() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    if (!isNight) {
-        depthMapShader.useShaderProgram();
-        glUniformMatrix4fv(glGetUniformLocation(depthMapShader.shaderProgram, "lightSpaceTrMatrix"),
-            1,
-            GL_FALSE,
-            glm::value_ptr(computeLightSpaceTrMatrix()));
-        glViewport(0, 0, SHADOW_WIDTH, SHADOW_HEIGHT);
-        glBindFramebuffer(GL_FRAMEBUFFER, shadowMapFBO);
-        glClear(GL_DEPTH_BUFFER_BIT);
-        renderTeapot(depthMapShader, true);
-        renderGround(depthMapShader, true);
-        renderLamp(depthMapShader, true);
-        renderLamp2(depthMapShader, true);
-        renderLamp3(depthMapShader, true);
-        if (objGen) {
-            renderTumbleWeed(depthMapShader, true);
+    updateDrawContexts();
+    uploadFrameUniforms();
+
+    // the sun casts no shadows at night
+    bool shadows = !isNight && shadowsEnabled;
+    if (shadows) {
+        updateStaticShadows();
+        for (int cascade = 0; cascade < SHADOW_CASCADE_COUNT; cascade++) {
+            renderQueue.SetPass((gps::RenderPass)(gps::RENDER_PASS_SHADOW + cascade), depthMapShader,
+                shadowCascades[cascade].drawContext, [cascade]() {
+                gps::GLState::GetShared().Viewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+                gps::GLState::GetShared().BindFramebuffer(shadowMapFBOs[cascade]);
+                // start from the static casters instead of clearing, the read framebuffer goes
+                // back to the one GLState knows about
+                GLbitfield copied = GL_DEPTH_BUFFER_BIT;
+                if (shadowFilter == SHADOW_FILTER_VARIANCE) {
+                    copied |= GL_COLOR_BUFFER_BIT;
+                }
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, staticShadowMapFBOs[cascade]);
+                glBlitFramebuffer(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE,
+                    copied, GL_NEAREST);
+                glBindFramebuffer(GL_READ_FRAMEBUFFER, shadowMapFBOs[cascade]);
+                // casters between the light and the near plane land on it instead of being clipped
+                glEnable(GL_DEPTH_CLAMP);
+                depthMapShader.setInt("cascade", cascade);
+            });
         }
-        else {
-            angle = trans = 0;
-            objStop = false;
-        }
-        renderSpecialWeed(depthMapShader, true);
-        renderAllObjects(depthMapShader, true);
-        renderEagleBody(depthMapShader, true);
-        renderEagleFeathers(depthMapShader, true);
-        renderEagleWings(depthMapShader, true);
-        renderEagleTail(depthMapShader, true);
-
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        myBasicShader.useShaderProgram();
-        glUniformMatrix4fv(glGetUniformLocation(myBasicShader.shaderProgram, "lightSpaceTrMatrix"), 1, GL_FALSE, glm::value_ptr(computeLightSpaceTrMatrix()));
-        view = myCamera.getViewMatrix();
-        glUniformMatrix4fv(glGetUniformLocation(myBasicShader.shaderProgram, "view"), 1, GL_FALSE, glm::value_ptr(view));
-
-
-        glViewport(0, 0, glWindowWidth, glWindowHeight);
-        myBasicShader.useShaderProgram();
-
-        glActiveTexture(GL_TEXTURE3);
-        glBindTexture(GL_TEXTURE_2D, depthMapTexture);
-        glUniform1i(glGetUniformLocation(myBasicShader.shaderProgram, "shadowMap"), 3);
-
-        glUniform1f(glGetUniformLocation(myBasicShader.shaderProgram, "fogDensity"), fogDensity);
-    }
-    else {
-        myBasicShader.useShaderProgram();
-        glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "spotLightDir"), 1, glm::value_ptr(myCamera.getCameraDirection()));
-        glUniform3fv(glGetUniformLocation(myBasicShader.shaderProgram, "spotLightPos"), 1, glm::value_ptr(myCamera.getCameraPosition()));
-    }
-
-	// render the teapot
-    renderTeapot(myBasicShader, false);
-
-    //render all objects
-    renderAllObjects(myBasicShader, false);
-
-    //render tumbleweed
-    if (objGen) {
-        renderTumbleWeed(myBasicShader, false);
     }
-    else {
-        angle = trans = 0;
-        objStop = false;
+    // the night has neither fog nor sun shadows
+    unsigned int features = BASIC_SHADER_NIGHT;
+    if (!isNight) {
+        features = (foginit ? BASIC_SHADER_FOG : 0) | (shadows ? BASIC_SHADER_SHADOWS : 0);
     }
-
-    //render eagle
-    renderEagleBody(myBasicShader, false);
-    renderEagleFeathers(myBasicShader, false);
-    renderEagleWings(myBasicShader, false);
-    renderEagleTail(myBasicShader, false);
-    bodyAngle += 0.6f;
-    if (feathersAngle > 10) featherDirection = 1;
-    if (feathersAngle < -10) featherDirection = 0;
-    if (featherDirection)
-        feathersAngle -= 0.45f;
-    else
-        feathersAngle += 0.45f;
-    if (bodyAngle > 360) {
-        bodyAngle -= 360;
+    gps::Shader& basicShader = basicShaders.getVariant(features);
+    renderQueue.SetPass(gps::RENDER_PASS_MAIN, basicShader, cameraDrawContext, [&basicShader, shadows]() {
+        glDisable(GL_DEPTH_CLAMP);
+        gps::GLState::GetShared().BindFramebuffer(0);
+        gps::GLState::GetShared().Viewport(0, 0, glWindowWidth, glWindowHeight);
+        // the filter's cost is what is measured, the shadow passes before it are left out
+        shadowTimer.Begin(shadowFilter);
+        lightClusters.Bind((GLuint)basicShader.getSamplerUnit("lightData"), (GLuint)basicShader.getSamplerUnit("clusterLights"),
+            (GLuint)basicShader.getSamplerUnit("lightIndices"));
+        if (!shadows) {
+            return;
+        }
+        gps::GLState::GetShared().BindTexture((GLuint)basicShader.getSamplerUnit("shadowMap"), GL_TEXTURE_2D_ARRAY, depthMapTexture);
+        if (shadowFilter == SHADOW_FILTER_REFERENCE) {
+            GLuint unit = (GLuint)basicShader.getSamplerUnit("shadowDepths");
+            gps::GLState::GetShared().BindTexture(unit, GL_TEXTURE_2D_ARRAY, depthMapTexture);
+            glBindSampler(unit, shadowReferenceSampler);
+        }
+        if (shadowFilter == SHADOW_FILTER_VARIANCE) {
+            // the prefilter: the mip chain averages the moments, so minified lookups stay smooth
+            gps::GLState::GetShared().BindTextureForEdit(GL_TEXTURE_2D_ARRAY, shadowMomentsTexture);
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+            gps::GLState::GetShared().BindTexture((GLuint)basicShader.getSamplerUnit("shadowMoments"), GL_TEXTURE_2D_ARRAY, shadowMomentsTexture);
+        }
+    });
+    submitScene();
+    // the main pass is the last one, its begin started the timer
+    renderQueue.Execute();
+    shadowTimer.End();
+    if (shadows && shadowFilter == SHADOW_FILTER_REFERENCE) {
+        // the sampler would override whatever the next programs bind on the unit
+        glBindSampler((GLuint)basicShader.getSamplerUnit("shadowDepths"), 0);
     }
 
     //if eagle POV is set, change the camera accordingly
     if (scenePrev) {
         scenePreview();
     }
-    renderSpecialWeed(myBasicShader, false);
-    renderLamp(myBasicShader, false);
-    renderLamp2(myBasicShader, false);
-    renderLamp3(myBasicShader, false);
-
-    //render ground
-    renderGround(myBasicShader, false);
 
     //render skybox
     renderSkyBox(skyboxShader);
 
+    frameUniforms.EndFrame();
 }
 
 void cleanup() {
+    frameUniforms.Destroy();
+    lightClusters.Destroy();
+    renderQueue.Destroy();
+    staticShadowQueue.Destroy();
+    shadowTimer.Destroy();
+    glDeleteSamplers(1, &shadowReferenceSampler);
+    // the last handles free their textures and pool ranges here, while the context and the
+    // shared GLState and GeometryPool still exist, not when the globals are destroyed
+    for (size_t i = 0; i < sizeof(modelFiles) / sizeof(modelFiles[0]); i++) {
+        modelFiles[i].model->Release();
+    }
+    gps::GeometryPool::GetShared().Destroy();
     myWindow.Delete();
     //cleanup code for your own data
 }
@@ -967,8 +1326,59 @@ void generateBoundingBoxes() {
     nr_circles++;
 }
 
+// Moves the shadow benchmark to the next filter every SHADOW_BENCHMARK_FRAMES frames, and
+// prints the averages after the last one. The camera should stay still meanwhile
+void updateShadowBenchmark() {
+    if (benchmarkFilter < 0 || ++benchmarkFrames < SHADOW_BENCHMARK_FRAMES) {
+        return;
+    }
+    benchmarkFrames = 0;
+    if (++benchmarkFilter < SHADOW_FILTER_COUNT) {
+        setShadowFilter((ShadowFilter)benchmarkFilter);
+        return;
+    }
+
+    shadowTimer.Flush();
+    printf("shadow filters, GPU time of the main pass:\n");
+    double reference = shadowTimer.GetAverageMilliseconds(SHADOW_FILTER_REFERENCE);
+    for (int filter = 0; filter < SHADOW_FILTER_COUNT; filter++) {
+        double milliseconds = shadowTimer.GetAverageMilliseconds(filter);
+        printf("  %-10s %7.3f ms  %5.2fx faster than reference over %d frames\n", SHADOW_FILTER_NAMES[filter],
+            milliseconds, milliseconds > 0.0 ? reference / milliseconds : 0.0, shadowTimer.GetSampleCount(filter));
+    }
+    benchmarkFilter = -1;
+    setShadowFilter(startupShadowFilter);
+}
+
 int main(int argc, const char * argv[]) {
 
+    if (argc > 1 && strcmp(argv[1], "--cook") == 0) {
+        return cookTextures(argc > 2 && strcmp(argv[2], "--bc7") == 0);
+    }
+
+    bool shadowBenchmark = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--shadow-benchmark") == 0) {
+            shadowBenchmark = true;
+        } else if (strcmp(argv[i], "--tumbleweeds") == 0 && i + 1 < argc) {
+            windTumbleWeedCount = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--lamps") == 0 && i + 1 < argc) {
+            lampFieldCount = std::max(atoi(argv[++i]), 0);
+        } else if (strcmp(argv[i], "--shadow-filter") == 0 && i + 1 < argc) {
+            i++;
+            bool found = false;
+            for (int filter = 0; filter < SHADOW_FILTER_COUNT; filter++) {
+                if (strcmp(argv[i], SHADOW_FILTER_NAMES[filter]) == 0) {
+                    startupShadowFilter = (ShadowFilter)filter;
+                    found = true;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "WARNING: unknown shadow filter %s, using %s\n", argv[i], SHADOW_FILTER_NAMES[startupShadowFilter]);
+            }
+        }
+    }
+
     try {
         initOpenGLWindow();
     } catch (const std::exception& e) {
@@ -977,19 +1387,53 @@ int main(int argc, const char * argv[]) {
     }
 
     initOpenGLState();
-	initModels();
-    initFBO();
-	initShaders();
-	initUniforms();
+
+    generateLampField();
+
+    // shader sources are tiny, queue them first so the driver compiles while the models parse
+    gps::StartupGraph startup;
+    initShaders(startup);
+    startup.AddTask("shadow FBO", NULL, initFBO);
+    startup.AddTask("uniforms", NULL, initUniforms);
+    initModels(startup);
+    startup.Run(gps::ThreadPool::GetShared());
+    startup.PrintReport();
+    printDrawCounts();
+    std::cout << "Clustered lights: " << lightClusters.GetLightCount() << std::endl;
+    gps::GeometryPool::GetShared().PrintReport();
+    if (shadowBenchmark) {
+        benchmarkFilter = SHADOW_FILTER_REFERENCE;
+        setShadowFilter(SHADOW_FILTER_REFERENCE);
+    } else {
+        setShadowFilter(startupShadowFilter);
+    }
+
     setWindowCallbacks();
     generateBoundingBoxes();
+    generateWindTumbleWeeds();
 
 
 	glCheckError();
+    bool registryReported = false;
+    int renderedFrames = 0;
 	// application loop
 	while (!glfwWindowShouldClose(myWindow.getWindow())) {
+        // stream in the textures decoded in the background since the last frame
+        gps::ResourceRegistry::GetShared().Update();
+        if (!registryReported && gps::TextureLoader::GetShared().GetPendingCount() == 0) {
+            gps::ResourceRegistry::GetShared().PrintReport();
+            registryReported = true;
+        }
         processMovement();
 	    renderScene();
+        updateShadowBenchmark();
+        gps::GLState::GetShared().EndFrame();
+        if (++renderedFrames == STATE_REPORT_FRAMES) {
+            gps::GLState::GetShared().PrintReport();
+        }
+        if (renderedFrames == STATE_REPORT_FRAMES || renderStats) {
+            printRenderStats();
+        }
         
         //std::cout << myCamera.getCameraPosition().x << " " << myCamera.getCameraPosition().y << " " << myCamera.getCameraPosition().z << "\n";
 
@@ -1,29 +1,23 @@
 #version 410 core
+// variants (ShaderVariants in Shader.hpp): NIGHT lights the scene with the flashlight instead
+// of the sun, FOG blends distant fragments into the fog, SHADOWS samples the sun's cascades
 
+// world space
 in vec3 fPosition;
 in vec3 fNormal;
 in vec2 fTexCoords;
-in vec4 fragPosLightSpace;
+// eye space, the vertex shader applies the instance transform
+in vec4 fPosEye;
+in vec3 fNormalEye;
+// light directions and vectors, computed per vertex
+flat in vec3 fLightDirEye;
+#ifdef NIGHT
+in vec3 fSpotLightVector;
+#endif
 
 out vec4 fColor;
 
-//matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat3 normalMatrix;
-
-
-//lighting
-uniform vec3 lightDir;
-uniform vec3 lightColor;
-uniform vec3 spotLightPos;
-uniform vec3 spotLightDir;
-uniform float cutoff;
-uniform float outerCutoff;
-uniform bool isNight;
-uniform vec3 pointLightLocation;
-uniform vec3 pointLightLocation2;
-uniform vec3 pointLightLocation3;
+#include "frameData.glsl"
 
 float spotQuadratic = 0.0028f;
 float spotLinear = 0.027f;
@@ -37,11 +31,48 @@ float shininess = 64.0f;
 // textures
 uniform sampler2D diffuseTexture;
 uniform sampler2D specularTexture;
-uniform sampler2D shadowMap;
 
-//fog
-uniform bool foginit;
-uniform float fogDensity;
+// clustered lights (LightClusters.hpp): the light list, three texels per light, the
+// (offset, count) of every cluster's run of lightIndices, and the runs themselves
+uniform samplerBuffer lightData;
+uniform usamplerBuffer clusterLights;
+uniform usamplerBuffer lightIndices;
+
+// LIGHT_CLUSTER_GRID_* in LightClusters.hpp
+const int CLUSTER_GRID_X = 16;
+const int CLUSTER_GRID_Y = 9;
+const int CLUSTER_GRID_Z = 24;
+#ifdef SHADOWS
+// one layer per shadow cascade, compared in hardware: a lookup returns the lit fraction of
+// the 2x2 texels around it
+uniform sampler2DArrayShadow shadowMap;
+// the same layers read without comparison and unfiltered, only bound for the reference filter
+uniform sampler2DArray shadowDepths;
+// depth and squared depth per cascade, mipmapped, only written for the variance filter
+uniform sampler2DArray shadowMoments;
+// SHADOW_FILTER_* in main.cpp
+uniform int shadowFilter;
+
+const int SHADOW_FILTER_REFERENCE = 0;
+const int SHADOW_FILTER_HARDWARE = 1;
+const int SHADOW_FILTER_POISSON = 2;
+const int SHADOW_FILTER_VARIANCE = 3;
+
+// taps of the Poisson filter on the unit disk, rotated per pixel
+const int POISSON_TAPS = 12;
+const vec2 poissonDisk[POISSON_TAPS] = vec2[](
+    vec2(-0.326f, -0.406f), vec2(-0.840f, -0.074f), vec2(-0.696f, 0.457f),
+    vec2(-0.203f, 0.621f), vec2(0.962f, -0.195f), vec2(0.473f, -0.480f),
+    vec2(0.519f, 0.767f), vec2(0.185f, -0.893f), vec2(0.507f, 0.064f),
+    vec2(0.896f, 0.412f), vec2(-0.322f, -0.933f), vec2(-0.792f, -0.598f)
+);
+// disk radius, in shadow map texels
+const float POISSON_RADIUS = 2.5f;
+// variance below this is noise of the depth format, the top of the tail the variance
+// filter cuts to keep overlapping casters from bleeding light
+const float VARIANCE_MIN = 0.00002f;
+const float VARIANCE_BLEED_CUT = 0.3f;
+#endif
 
 //components
 vec3 ambient;
@@ -56,147 +87,198 @@ float constant = 0.01f;
 float linear = 0.22f;
 float quadratic = 0.2f;
 
+//shared by every light, computed once at the start of main
+vec3 normalEye;
+//view direction (in eye coordinates, the viewer is situated at the origin)
+vec3 viewDirN;
+vec3 diffuseColor;
+vec3 specularColor;
+
 void computeDirLight()
 {
-    //compute eye space coordinates
-    vec4 fPosEye = view * model * vec4(fPosition, 1.0f);
-    vec3 normalEye = normalize(normalMatrix * fNormal);
-
-    //normalize light direction
-    vec3 lightDirN = vec3(normalize(view * vec4(lightDir, 0.0f)));
-
-    //compute view direction (in eye coordinates, the viewer is situated at the origin
-    vec3 viewDir = normalize(- fPosEye.xyz);
-
     //compute ambient light
     ambient = ambientStrength * lightColor;
 
+#ifdef NIGHT
+    diffuse = vec3(0, 0, 0);
+    specular = vec3(0.01, 0.01, 0.01);
+#else
     //compute diffuse light
-    diffuse = max(dot(normalEye, lightDirN), 0.0f) * lightColor;
-    if(!isNight)
-        diffuse = 0.7f *diffuse;
+    diffuse = 0.7f * max(dot(normalEye, fLightDirEye), 0.0f) * lightColor;
 
     //compute specular light
-    vec3 reflectDir = reflect(-lightDirN, normalEye);
-    float specCoeff = pow(max(dot(viewDir, reflectDir), 0.0f), 32);
+    vec3 reflectDir = reflect(-fLightDirEye, normalEye);
+    float specCoeff = pow(max(dot(viewDirN, reflectDir), 0.0f), 32);
     specular = specularStrength * specCoeff * lightColor;
-
-    if(isNight){
-        diffuse = vec3(0, 0, 0);
-        specular = vec3(0.01, 0.01, 0.01);
-    }
+#endif
 }
 
+#ifdef SHADOWS
 float computeShadow()
 {
+	//the first cascade reaching past the fragment covers it with the smallest texels
+	float viewDepth = -fPosEye.z;
+	if (viewDepth > cascadeSplits[cascadeCount - 1])
+		return 0.0f;
+	int cascade = 0;
+	while (cascade < cascadeCount - 1 && viewDepth > cascadeSplits[cascade])
+		cascade++;
+	vec4 fragPosLightSpace = lightSpaceTrMatrices[cascade] * vec4(fPosition, 1.0f);
+
 	//perform perspective divide
 	vec3 normalizedCoords= fragPosLightSpace.xyz / fragPosLightSpace.w;
 
 	//tranform from [-1,1] range to [0,1] range
 	normalizedCoords = normalizedCoords * 0.5 + 0.5;
 
-	//get closest depth value from lights perspective
-	float closestDepth = texture(shadowMap, normalizedCoords.xy).r;
-
 	//get depth of current fragment from lights perspective
 	float currentDepth = normalizedCoords.z;
-
-	//if the current fragments depth is greater than the value in the depth map, the current fragment is in shadow 
-	//else it is illuminated
-	//float shadow = currentDepth > closestDepth ? 1.0 : 0.0;
 	float bias = 0.001f;
-	//float shadow = currentDepth - bias > closestDepth ? 1.0 : 0.0;
 	if (normalizedCoords.z > 1.0f)
 		return 0.0f;
+	vec4 lookup = vec4(normalizedCoords.xy, cascade, currentDepth - bias);
+	vec2 texelSize = 1.0 / textureSize(shadowMap, 0).xy;
+
+	//the lookups below return how lit they are, the shadow is what remains
+	if (shadowFilter == SHADOW_FILTER_HARDWARE) {
+		return 1.0f - texture(shadowMap, lookup);
+	}
+	if (shadowFilter == SHADOW_FILTER_POISSON) {
+		//a per pixel rotation turns the banding of few taps into fine noise
+		float angle = 6.2831853f * fract(52.9829189f * fract(dot(gl_FragCoord.xy, vec2(0.06711056f, 0.00583715f))));
+		mat2 rotation = mat2(cos(angle), sin(angle), -sin(angle), cos(angle));
+		float lit = 0.0f;
+		for (int i = 0; i < POISSON_TAPS; i++) {
+			vec2 offset = rotation * poissonDisk[i] * POISSON_RADIUS * texelSize;
+			lit += texture(shadowMap, lookup + vec4(offset, 0.0f, 0.0f));
+		}
+		return 1.0f - lit / POISSON_TAPS;
+	}
+	if (shadowFilter == SHADOW_FILTER_VARIANCE) {
+		//Chebyshev's bound on the fraction of the filtered depths behind the fragment
+		vec2 moments = texture(shadowMoments, lookup.xyz).xy;
+		if (currentDepth - bias <= moments.x)
+			return 0.0f;
+		float variance = max(moments.y - moments.x * moments.x, VARIANCE_MIN);
+		float distance = currentDepth - moments.x;
+		float lit = variance / (variance + distance * distance);
+		return 1.0f - clamp((lit - VARIANCE_BLEED_CUT) / (1.0f - VARIANCE_BLEED_CUT), 0.0f, 1.0f);
+	}
+
+	//reference: the original 7x7 grid of nearest depth compares, 49 lookups
     float shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadowMap, 0);
     for(int x = -3; x <= 3; ++x){
         for(int y = -3; y <= 3; ++y){
-            float pcfDepth = texture(shadowMap, normalizedCoords.xy + vec2(x, y) * texelSize).r; 
-            shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;        
+            float pcfDepth = texture(shadowDepths, vec3(normalizedCoords.xy + vec2(x, y) * texelSize, cascade)).r;
+            shadow += currentDepth - bias > pcfDepth ? 1.0 : 0.0;
         }    
     }
     shadow /= 49.0;
     return shadow;
 }
+#endif
 
+#ifdef FOG
 float computeFog(){
-    vec4 fPosEye = view * model * vec4(fPosition, 1.0f);
     float fragmentDistance = length(fPosEye);
     float fogFactor = exp(-pow(fragmentDistance * fogDensity, 2));
     return clamp(fogFactor, 0.0f, 1.0f);
 }
-
-vec3 computePointLight(vec3 pointLightLocation){
-    vec3 lightColor = vec3(1.0f, 0.474f, 0.301f); 
-    vec4 fPosEye = view * model * vec4(fPosition, 1.0f);
-    vec3 normalEye = normalize(normalMatrix * fNormal);
-    vec3 lightDirN = vec3(normalize(view * vec4(pointLightLocation, 0.0f)));
-    vec3 viewDirN = normalize(vec3(0.0f) - fPosEye.xyz);
+#endif
+
+vec3 computePointLight(int light){
+    vec4 positionRadius = texelFetch(lightData, light * 3);
+    vec3 lightVector = positionRadius.xyz - fPosition;
+    float distance = length(lightVector);
+    if (distance >= positionRadius.w)
+        return vec3(0.0f);
+    vec4 colorOuterCutoff = texelFetch(lightData, light * 3 + 1);
+    vec4 directionInnerCutoff = texelFetch(lightData, light * 3 + 2);
+
+    vec3 lightColor = colorOuterCutoff.rgb;
+    vec3 lightDirN = normalize(mat3(view) * lightVector);
     vec3 ambient = ambientPoint * lightColor;
 	vec3 diffuse = max(dot(normalEye, lightDirN), 0.0f) * lightColor;
 	vec3 halfVector = normalize(lightDirN + viewDirN);
-	vec3 reflection = reflect(-lightDirN, normalEye);
     float specCoeff = pow(max(dot(normalEye, halfVector), 0.0f), shininessPoint);
 	vec3 specular = specularStrengthPoint * specCoeff * lightColor;
-	float distance = length((view * vec4(pointLightLocation, 1.0f)).xyz - fPosEye.xyz);
 	float att = 1.0f / (constant + linear * distance + quadratic * distance * distance);
-	return (ambient + diffuse + specular) * att * vec3(7.5f,7.5f,7.5f);
+	//fades out towards the radius the light was binned with
+	float fade = clamp(1.0f - pow(distance / positionRadius.w, 4.0f), 0.0f, 1.0f);
+	//a point light's outer cutoff lies behind it, its cone never dims anything
+	float theta = dot(-lightVector / max(distance, 0.0001f), directionInnerCutoff.xyz);
+	float cone = clamp((theta - colorOuterCutoff.w) / (directionInnerCutoff.w - colorOuterCutoff.w), 0.0f, 1.0f);
+	return (ambient + diffuse + specular) * att * fade * fade * cone;
+}
+
+//only the lights binned into this fragment's cluster
+vec3 computeClusterLights(){
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterParams.xy), ivec2(CLUSTER_GRID_X - 1, CLUSTER_GRID_Y - 1));
+    int slice = clamp(int(log(max(-fPosEye.z, 0.0001f)) * clusterParams.z + clusterParams.w), 0, CLUSTER_GRID_Z - 1);
+    uvec2 run = texelFetch(clusterLights, (slice * CLUSTER_GRID_Y + tile.y) * CLUSTER_GRID_X + tile.x).xy;
+    vec3 light = vec3(0.0f);
+    for (uint i = 0u; i < run.y; i++) {
+        light += computePointLight(int(texelFetch(lightIndices, int(run.x + i)).r));
+    }
+    return light;
 }
 
+#ifdef NIGHT
 vec3 computeSpotLight(){
-    vec3 lightDir = normalize(spotLightPos - fPosition);
-    vec4 fPosEye = view * model * vec4(fPosition, 1.0f);
+    vec3 lightDir = normalize(fSpotLightVector);
 
     float theta = dot(lightDir, normalize(-spotLightDir));
     float epsilon = cutoff - outerCutoff;
     float intensity = clamp((theta - outerCutoff) / epsilon, 0.0, 1.0);
 
-    vec3 normalEye = normalize(normalMatrix * fNormal);
-    vec3 lightDirN = vec3(normalize(view * vec4(lightDir, 0.0f)));
-    vec3 viewDir = normalize(- fPosEye.xyz);
-    vec3 viewDirN = normalize(vec3(0.0f) - fPosEye.xyz);
+    vec3 lightDirN = normalize(mat3(view) * lightDir);
     vec3 halfVector = normalize(lightDirN + viewDirN);
 
     float diff = max(dot(fNormal, lightDir), 0.0f);
 	float spec = pow(max(dot(normalEye, halfVector), 0.0f), shininess);
-	float dist = length(spotLightPos - fPosition);
+	float dist = length(fSpotLightVector);
 	float attenuation = 1.0f / (spotConstant + spotLinear * dist + spotQuadratic * dist * dist);
         
-    vec3 ambient = attenuation * intensity * spotLightColor * spotLightAmbient * texture(diffuseTexture, fTexCoords).rgb;
-    vec3 specular = attenuation * intensity * spotLightColor * spotLightSpecular * spec * texture(specularTexture, fTexCoords).rgb;
-    vec3 diffuse = attenuation * intensity * spotLightColor * spotLightSpecular * diff * texture(diffuseTexture, fTexCoords).rgb;
+    vec3 ambient = attenuation * intensity * spotLightColor * spotLightAmbient * diffuseColor;
+    vec3 specular = attenuation * intensity * spotLightColor * spotLightSpecular * spec * specularColor;
+    vec3 diffuse = attenuation * intensity * spotLightColor * spotLightSpecular * diff * diffuseColor;
 
     return ambient + specular + diffuse;
 }
+#endif
 
 void main() 
 {
+    normalEye = normalize(fNormalEye);
+    viewDirN = normalize(-fPosEye.xyz);
+    diffuseColor = texture(diffuseTexture, fTexCoords).rgb;
+    specularColor = texture(specularTexture, fTexCoords).rgb;
+
     computeDirLight();
     vec3 color;
     vec3 lightVal = vec3(1.0f, 1.0f, 1.0f);
 
-    float fogFactor = computeFog();
-	vec4 fogColor = vec4(0.3f, 0.3f, 0.3f, 1.0f);
-
-    if(!isNight){
-        ambient *= texture(diffuseTexture, fTexCoords).rgb;
-	    diffuse *= texture(diffuseTexture, fTexCoords).rgb;
-	    specular *= texture(specularTexture, fTexCoords).rgb;
-        float shadow = computeShadow();
-        color = min((ambient + (1.0f - shadow) * diffuse) + (1.0f - shadow) * specular, 1.0f);
-    }
-    else{
-        color = min((ambient + diffuse) * texture(diffuseTexture, fTexCoords).rgb + specular * texture(specularTexture, fTexCoords).rgb, 1.0f);
-        lightVal= computeSpotLight();
-    }
-    lightVal += computePointLight(pointLightLocation) 
-                + computePointLight(pointLightLocation2)
-                + computePointLight(pointLightLocation3);
-
-    if (!foginit || isNight){
-        fColor = min(vec4(color, 1.0f) * vec4(lightVal, 1.0f), 1.0f);
-    }else{
-        fColor = mix(fogColor, min(vec4(color, 1.0f) * vec4(lightVal, 1.0f), 1.0f), fogFactor);
-    }
+#ifdef NIGHT
+    color = min((ambient + diffuse) * diffuseColor + specular * specularColor, 1.0f);
+    lightVal = computeSpotLight();
+#else
+    ambient *= diffuseColor;
+    diffuse *= diffuseColor;
+    specular *= specularColor;
+#ifdef SHADOWS
+    float shadow = computeShadow();
+#else
+    float shadow = 0.0f;
+#endif
+    color = min((ambient + (1.0f - shadow) * diffuse) + (1.0f - shadow) * specular, 1.0f);
+#endif
+    lightVal += computeClusterLights();
+
+    vec4 litColor = min(vec4(color, 1.0f) * vec4(lightVal, 1.0f), 1.0f);
+#ifdef FOG
+    vec4 fogColor = vec4(0.3f, 0.3f, 0.3f, 1.0f);
+    fColor = mix(fogColor, litColor, computeFog());
+#else
+    fColor = litColor;
+#endif
 }
@@ -1,24 +1,55 @@
 #version 410 core
+// compiled once per variant of basic.frag, NIGHT adds the flashlight vector
 
 layout(location=0) in vec3 vPosition;
 layout(location=1) in vec3 vNormal;
 layout(location=2) in vec2 vTexCoords;
+// per instance (InstanceData in Mesh.hpp), a mat4 takes locations 3-6 and a mat3 7-9
+layout(location=3) in mat4 instanceModel;
+layout(location=7) in mat3 instanceNormalMatrix;
 
 out vec3 fPosition;
 out vec3 fNormal;
 out vec2 fTexCoords;
-out vec4 fragPosLightSpace;
+out vec4 fPosEye;
+out vec3 fNormalEye;
+// eye space light directions, the same for every fragment, so they are worked out here once
+// per vertex instead of once per fragment
+flat out vec3 fLightDirEye;
+#ifdef NIGHT
+// from the vertex to the flashlight, world space
+out vec3 fSpotLightVector;
+#endif
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-uniform mat4 lightSpaceTrMatrix;
+#include "frameData.glsl"
+
+// packed meshes store octahedral normals in xy, their positions are relative to the
+// mesh bounds and rescaled by instanceModel
+uniform bool packedNormals;
+
+vec3 decodeNormal(vec3 n)
+{
+	if (!packedNormals)
+		return n;
+	vec3 unfolded = vec3(n.xy, 1.0f - abs(n.x) - abs(n.y));
+	float fold = max(-unfolded.z, 0.0f);
+	unfolded.x += unfolded.x >= 0.0f ? -fold : fold;
+	unfolded.y += unfolded.y >= 0.0f ? -fold : fold;
+	return normalize(unfolded);
+}
 
 void main() 
 {
-	gl_Position = projection * view * model * vec4(vPosition, 1.0f);
-	fPosition = vPosition;
-	fNormal = vNormal;
+	vec4 worldPosition = instanceModel * vec4(vPosition, 1.0f);
+	fPosEye = view * worldPosition;
+	gl_Position = projection * fPosEye;
+	fPosition = worldPosition.xyz;
+	fNormal = instanceNormalMatrix * decodeNormal(vNormal);
+	fNormalEye = mat3(view) * fNormal;
 	fTexCoords = vTexCoords;
-	fragPosLightSpace = lightSpaceTrMatrix * model * vec4(vPosition, 1.0f);
+
+	fLightDirEye = normalize(mat3(view) * lightDir);
+#ifdef NIGHT
+	fSpotLightVector = spotLightPos - fPosition;
+#endif
 }
@@ -1,8 +1,13 @@
 #version 410 core
-//simple fragment shader that writes dummy output
-out vec4 fColor;
+//writes the moments the variance shadow filter reads, the other filters only keep the depth
+out vec4 fMoments;
 
 void main()
 {
-	fColor = vec4(1.0f);
-}
\ No newline at end of file
+	//depth clamping leaves casters in front of the near plane outside [0, 1]
+	float depth = clamp(gl_FragCoord.z, 0.0f, 1.0f);
+	//the slope term widens the variance where the surface is steep in the light's view
+	float dx = dFdx(depth);
+	float dy = dFdy(depth);
+	fMoments = vec4(depth, depth * depth + 0.25f * (dx * dx + dy * dy), 0.0f, 0.0f);
+}
@@ -2,11 +2,15 @@
 //the vertex shader that  transforms all vertices intro the lights space
 
 layout(location=0) in vec3 vPosition;
+// per instance (InstanceData in Mesh.hpp), for packed meshes it also rescales the positions
+layout(location=3) in mat4 instanceModel;
 
-uniform mat4 lightSpaceTrMatrix;
-uniform mat4 model;
+#include "frameData.glsl"
+
+// the cascade this pass renders
+uniform int cascade;
 
 void main()
 {
-	gl_Position = lightSpaceTrMatrix * model * vec4(vPosition, 1.0f);
+	gl_Position = lightSpaceTrMatrices[cascade] * instanceModel * vec4(vPosition, 1.0f);
 }
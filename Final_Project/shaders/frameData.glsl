@@ -0,0 +1,18 @@
+// shared by every shader, uploaded once per frame (FrameUniforms in UniformBuffer.hpp)
+layout(std140) uniform FrameData {
+    mat4 view;
+    mat4 projection;
+    mat4 lightSpaceTrMatrices[4]; // MAX_SHADOW_CASCADES
+    vec4 cascadeSplits;
+    vec3 lightDir;
+    float cutoff;
+    vec3 lightColor;
+    float outerCutoff;
+    vec3 spotLightPos;
+    float fogDensity;
+    vec3 spotLightDir;
+    bool isNight;
+    vec4 clusterParams; // LightClusters::GetShaderParams
+    bool foginit;
+    int cascadeCount;
+};
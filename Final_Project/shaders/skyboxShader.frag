@@ -5,8 +5,7 @@ out vec4 color;
 
 uniform samplerCube skybox;
 
-uniform bool foginit;
-uniform bool isNight;
+#include "frameData.glsl"
 
 void main()
 {